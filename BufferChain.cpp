@@ -0,0 +1,215 @@
+#include <sys/uio.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include "BufferChain.hpp"
+#include "constant.hpp"
+
+const std::size_t BufferChain::npos;
+
+BufferChain::BufferChain()
+: _size(0) { }
+
+//  Destructor of BufferChain. The blocks are given back to their pools.
+BufferChain::~BufferChain() {
+    this->clear();
+}
+
+//  Receive from a socket with a readv() of 'length' bytes at most, into the
+//  free space of the last block, then into blocks taken from 'pool', up to
+//  'blockCount' and RECEIVE_IOV_COUNT. The blocks taken but not filled are
+//  given back.
+//  - Parameters
+//      fd: The socket to read.
+//      length: The bytes to read at most, set to the bytes offered to readv(),
+//          by which a short read is told from a full one.
+//      pool: The pool new blocks are taken from.
+//      blockCount: The most blocks to take.
+//  - Return: The result of readv().
+ssize_t BufferChain::receive(int fd, std::size_t& length, BufferPool& pool, std::size_t blockCount) {
+    struct iovec iov[RECEIVE_IOV_COUNT];
+    const std::size_t firstNew = this->_blocks.size();
+    std::size_t offered = 0;
+    int count = 0;
+
+    if (!this->_blocks.empty() && this->_blocks.back().end < this->_blocks.back().capacity) {
+        Block& last = this->_blocks.back();
+
+        iov[count].iov_base = last.data + last.end;
+        iov[count].iov_len = std::min(last.capacity - last.end, length);
+        offered += iov[count++].iov_len;
+    }
+    while (offered < length && count < RECEIVE_IOV_COUNT && this->_blocks.size() - firstNew < blockCount) {
+        Block block;
+
+        block.data = pool.acquire();
+        block.begin = 0;
+        block.end = 0;
+        block.capacity = pool.getBlockSize();
+        block.pool = &pool;
+        this->_blocks.push_back(block);
+        iov[count].iov_base = block.data;
+        iov[count].iov_len = std::min(block.capacity, length - offered);
+        offered += iov[count++].iov_len;
+    }
+    length = offered;
+
+    const ssize_t result = readv(fd, iov, count);
+    std::size_t left = (result > 0) ? static_cast<std::size_t>(result) : 0;
+
+    this->_size += left;
+    for (std::size_t i = (firstNew > 0) ? firstNew - 1 : 0; i < this->_blocks.size() && left > 0; ++i) {
+        Block& block = this->_blocks[i];
+        const std::size_t filled = std::min(block.capacity - block.end, left);
+
+        block.end += filled;
+        left -= filled;
+    }
+    while (this->_blocks.size() > firstNew && this->_blocks.back().begin == this->_blocks.back().end) {
+        this->_blocks.back().pool->release(this->_blocks.back().data);
+        this->_blocks.pop_back();
+    }
+    return result;
+}
+
+//  Copy bytes received by other means, like by the kernel into a buffer of its
+//  own, into the free space of the last block, then into a block taken from
+//  'pool'. What does not fit is left to the next call, which may take from
+//  another pool.
+//  - Parameters
+//      data: The bytes.
+//      length: The number of bytes.
+//      pool: The pool a new block is taken from.
+//  - Return: The bytes copied, 1 at least if 'length' is.
+std::size_t BufferChain::append(const char* data, std::size_t length, BufferPool& pool) {
+    if (this->_blocks.empty() || this->_blocks.back().end == this->_blocks.back().capacity) {
+        Block block;
+
+        block.data = pool.acquire();
+        block.begin = 0;
+        block.end = 0;
+        block.capacity = pool.getBlockSize();
+        block.pool = &pool;
+        this->_blocks.push_back(block);
+    }
+
+    Block& last = this->_blocks.back();
+    const std::size_t copied = std::min(last.capacity - last.end, length);
+
+    std::memcpy(last.data + last.end, data, copied);
+    last.end += copied;
+    this->_size += copied;
+    return copied;
+}
+
+//  Find a string in the bytes held.
+//  - Parameters
+//      pattern: The string to find.
+//      from: The position to search from.
+//  - Return: The position of the first match from 'from', npos if none.
+std::size_t BufferChain::find(const char* pattern, std::size_t from) const {
+    const std::size_t length = std::strlen(pattern);
+    std::size_t index;
+    std::size_t offset;
+
+    if (length == 0 || from + length > this->_size)
+        return npos;
+    this->locate(from, index, offset);
+    for (std::size_t position = from; position + length <= this->_size; ++position) {
+        std::size_t matchIndex = index;
+        std::size_t matchOffset = offset;
+        std::size_t matched = 0;
+
+        while (matched < length && this->_blocks[matchIndex].data[matchOffset] == pattern[matched]) {
+            ++matched;
+            if (++matchOffset == this->_blocks[matchIndex].end && ++matchIndex < this->_blocks.size())
+                matchOffset = this->_blocks[matchIndex].begin;
+        }
+        if (matched == length)
+            return position;
+        if (++offset == this->_blocks[index].end && ++index < this->_blocks.size())
+            offset = this->_blocks[index].begin;
+    }
+    return npos;
+}
+
+//  The byte at a position.
+//  - Parameters position: The position, less than size().
+//  - Return: The byte.
+char BufferChain::at(std::size_t position) const {
+    std::size_t index;
+    std::size_t offset;
+
+    assert(position < this->_size);
+    this->locate(position, index, offset);
+    return this->_blocks[index].data[offset];
+}
+
+//  Append the first bytes to a string, leaving them held.
+//  - Parameters
+//      length: The bytes to append, size() at most.
+//      out: The string to append to.
+//  - Return(None)
+void BufferChain::copy(std::size_t length, std::string& out) const {
+    assert(length <= this->_size);
+    for (std::deque<Block>::const_iterator itr = this->_blocks.begin(); length > 0; ++itr) {
+        const std::size_t taken = std::min(itr->end - itr->begin, length);
+
+        out.append(itr->data + itr->begin, taken);
+        length -= taken;
+    }
+}
+
+//  Append the first bytes to a string and drop them.
+//  - Parameters
+//      out: The string to append to.
+//      length: The bytes to move, size() at most.
+//  - Return(None)
+void BufferChain::moveTo(std::string& out, std::size_t length) {
+    this->copy(length, out);
+    this->consume(length);
+}
+
+//  Drop the first bytes. The blocks emptied are given back.
+//  - Parameters length: The bytes to drop, size() at most.
+//  - Return(None)
+void BufferChain::consume(std::size_t length) {
+    assert(length <= this->_size);
+    this->_size -= length;
+    while (length > 0) {
+        Block& block = this->_blocks.front();
+        const std::size_t taken = std::min(block.end - block.begin, length);
+
+        block.begin += taken;
+        length -= taken;
+        if (block.begin == block.end)
+            this->releaseFront();
+    }
+}
+
+//  Drop every byte and give back every block.
+//  - Parameters(None)
+//  - Return(None)
+void BufferChain::clear() {
+    while (!this->_blocks.empty())
+        this->releaseFront();
+    this->_size = 0;
+}
+
+//  Give back the first block.
+void BufferChain::releaseFront() {
+    this->_blocks.front().pool->release(this->_blocks.front().data);
+    this->_blocks.pop_front();
+}
+
+//  Find the block holding a position.
+//  - Parameters
+//      position: The position, less than size().
+//      index: Set to the index of the block.
+//      offset: Set to the offset of the position in the data of the block.
+//  - Return(None)
+void BufferChain::locate(std::size_t position, std::size_t& index, std::size_t& offset) const {
+    for (index = 0; position >= this->_blocks[index].end - this->_blocks[index].begin; ++index)
+        position -= this->_blocks[index].end - this->_blocks[index].begin;
+    offset = this->_blocks[index].begin + position;
+}
@@ -0,0 +1,66 @@
+#ifndef BUFFERCHAIN_HPP_
+#define BUFFERCHAIN_HPP_
+
+#include <sys/types.h>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include "BufferPool.hpp"
+
+//  BufferChain holds the bytes received on a connection in blocks of
+//  BufferPools, read into with readv() and consumed from the front by offset,
+//  so nothing is moved as a message is received or parsed. A block is given
+//  back to its pool as soon as it is consumed, so an idle connection holds none.
+//  - Member variables
+//      _blocks: the blocks in order, the first from 'begin', the last up to 'end'.
+//      _size: the bytes held.
+//  - Methods
+//      receive: readv() the socket into the free space of the last block and
+//          blocks taken from a pool.
+//      append: Copy bytes received by other means behind the bytes held.
+//      find: The position of a string, from a position on.
+//      at: The byte at a position.
+//      copy: Append the first bytes to a string.
+//      moveTo: Append the first bytes to a string, then consume them.
+//      consume: Drop the first bytes.
+//      clear: Drop every byte.
+class BufferChain {
+public:
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    BufferChain();
+    ~BufferChain();
+
+    std::size_t size() const { return this->_size; };
+    bool empty() const { return this->_size == 0; };
+
+    ssize_t receive(int fd, std::size_t& length, BufferPool& pool, std::size_t blockCount);
+    std::size_t append(const char* data, std::size_t length, BufferPool& pool);
+    std::size_t find(const char* pattern, std::size_t from) const;
+    char at(std::size_t position) const;
+    void copy(std::size_t length, std::string& out) const;
+    void moveTo(std::string& out, std::size_t length);
+    void consume(std::size_t length);
+    void clear();
+
+private:
+    //  Block is a block of a BufferPool, holding bytes from 'begin' to 'end'.
+    struct Block {
+        char* data;
+        std::size_t begin;
+        std::size_t end;
+        std::size_t capacity;
+        BufferPool* pool;
+    };
+
+    std::deque<Block> _blocks;
+    std::size_t _size;
+
+    void releaseFront();
+    void locate(std::size_t position, std::size_t& index, std::size_t& offset) const;
+
+    BufferChain(const BufferChain&);
+    BufferChain& operator=(const BufferChain&);
+};
+
+#endif  // BUFFERCHAIN_HPP_
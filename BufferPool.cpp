@@ -0,0 +1,72 @@
+#include <cassert>
+#include "BufferPool.hpp"
+
+//  Constructor of BufferPool.
+//  - Parameters
+//      blockSize: The size of a block, 1 at least.
+//      idleLimit: The most bytes of idle blocks kept.
+BufferPool::BufferPool(std::size_t blockSize, std::size_t idleLimit)
+: _blockSize(blockSize)
+, _idleLimit(idleLimit) {
+    this->_stats.capacity = 0;
+    this->_stats.inUse = 0;
+    this->_stats.peak = 0;
+    this->_stats.slabs = 0;
+}
+
+//  Destructor of BufferPool. The blocks still in use are not freed by it.
+BufferPool::~BufferPool() {
+    this->freeIdle();
+}
+
+//  Change the size of the blocks. The idle blocks are freed.
+//  - Parameters blockSize: The size of a block, 1 at least.
+//  - Return(None)
+void BufferPool::setBlockSize(std::size_t blockSize) {
+    assert(this->_stats.inUse == 0 && blockSize > 0);
+    this->freeIdle();
+    this->_blockSize = blockSize;
+}
+
+//  Take a block of getBlockSize() bytes.
+//  - Parameters(None)
+//  - Return: The block, to be given back by release().
+char* BufferPool::acquire() {
+    char* block;
+
+    if (this->_idle.empty()) {
+        block = new char[this->_blockSize];
+        ++this->_stats.capacity;
+        ++this->_stats.slabs;
+    } else {
+        block = this->_idle.back();
+        this->_idle.pop_back();
+    }
+    if (++this->_stats.inUse > this->_stats.peak)
+        this->_stats.peak = this->_stats.inUse;
+    return block;
+}
+
+//  Give back a block. It is kept idle for the next acquire() within the limit.
+//  - Parameters block: The block taken by acquire().
+//  - Return(None)
+void BufferPool::release(char* block) {
+    assert(this->_stats.inUse > 0);
+    --this->_stats.inUse;
+    if ((this->_idle.size() + 1) * this->_blockSize > this->_idleLimit) {
+        delete[] block;
+        --this->_stats.capacity;
+        --this->_stats.slabs;
+        return;
+    }
+    this->_idle.push_back(block);
+}
+
+//  Free the idle blocks.
+void BufferPool::freeIdle() {
+    for (std::vector<char*>::iterator itr = this->_idle.begin(); itr != this->_idle.end(); ++itr)
+        delete[] *itr;
+    this->_stats.capacity -= this->_idle.size();
+    this->_stats.slabs -= this->_idle.size();
+    this->_idle.clear();
+}
@@ -0,0 +1,46 @@
+#ifndef BUFFERPOOL_HPP_
+#define BUFFERPOOL_HPP_
+
+#include <cstddef>
+#include <vector>
+#include "ObjectPool.hpp"
+
+//  BufferPool recycles blocks of a fixed size for the messages received by the
+//  connections of an event loop. Blocks given back are kept idle for the next
+//  acquire(), up to 'idleLimit' bytes, and freed beyond it, so the memory held
+//  follows the blocks in use rather than their peak.
+//  A pool is owned by one event loop and is not thread-safe.
+//  - Member variables
+//      _blockSize: the size of a block.
+//      _idleLimit: the most bytes of idle blocks kept.
+//      _idle: the blocks not in use.
+//      _stats: occupancy of the pool, in blocks. Every block is its own slab.
+//  - Methods
+//      setBlockSize: Change the size of the blocks, while none is in use.
+//      acquire: Take a block, allocated if none is idle.
+//      release: Give back a block taken by acquire().
+class BufferPool {
+public:
+    BufferPool(std::size_t blockSize, std::size_t idleLimit);
+    ~BufferPool();
+
+    std::size_t getBlockSize() const { return this->_blockSize; };
+    const PoolStats& getStats() const { return this->_stats; };
+
+    void setBlockSize(std::size_t blockSize);
+    char* acquire();
+    void release(char* block);
+
+private:
+    std::size_t _blockSize;
+    const std::size_t _idleLimit;
+    std::vector<char*> _idle;
+    PoolStats _stats;
+
+    void freeIdle();
+
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+};
+
+#endif  // BUFFERPOOL_HPP_
@@ -0,0 +1,22 @@
+#ifndef COMPLETIONHANDLER_HPP_
+#define COMPLETIONHANDLER_HPP_
+
+#include <stdint.h>
+#include "EventContext.hpp"
+
+//  CompletionHandler takes the bytes received by a completion based poller on
+//  its socket, delivered as EF_RECEIVED events, where a readiness poller reports
+//  the socket readable to its handler. They are taken before the coroutine
+//  awaiting the socket is resumed, as they are lent only until the next wait.
+//  The results of the messages sent, EF_SENT, are the results of their co_await.
+//  - Methods
+//      completeReceive: Take the bytes received, lent until the next wait of the
+//          poller. 'result' is their number, 0 at the end of stream, or -errno.
+class CompletionHandler {
+public:
+    virtual ~CompletionHandler() { };
+
+    virtual void completeReceive(const char* data, intptr_t result) = 0;
+};
+
+#endif  // COMPLETIONHANDLER_HPP_
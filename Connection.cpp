@@ -1,3 +1,6 @@
+#include <netinet/tcp.h>
+#include <cerrno>
+#include <utility>
 #include "Connection.hpp"
 #include "constant.hpp"
 
@@ -5,33 +8,108 @@
 // Generates a Connection instance for servers.
 //  - Parameters
 //      - port: Port number to open
-Connection::Connection(port_t port, EventHandler& evHandler)
+//      - reusePort: Share the port with listening sockets of other worker threads
+//      - options: The parameters of the 'listen' directive
+Connection::Connection(port_t port, EventHandler& evHandler, bool reusePort, const ListenOptions& options)
 : _client(false)
 , _hostPort(port)
 , _eventHandler(evHandler)
+, _closed(false)
+, _processing(false)
+, _receiving(false)
+, _receiveEnded(false)
+, _requestCount(0)
+, _keepAlive(0)
+, _parsedAt(0)
+, _idleChecked(false)
+, _requestContext(NULL)
+, _responseContext(NULL)
+, _sendContext(NULL)
+, _sending(false)
+, _fileJob(NULL)
+, _cgiProcess(-1)
+, _cgiInput(-1)
+, _cgiOutput(-1)
+, _cgiInputContext(NULL)
+, _generation(0)
 , _targetVirtualServer(NULL) {
-    this->newSocket();
-    this->bindSocket();
-    this->listenSocket();
+    std::memset(&this->_remoteAddr, 0, sizeof(this->_remoteAddr));
+    this->_ident = openListenSocket(port, reusePort, options);
     this->updatePortString();
     Log::info("New Server Connection: socket[%d] port[%d]", _ident, _hostPort);
 }
 
+// Constructor of Connection class
+// Generates a Connection instance for servers, on a socket opened beforehand
+// for the event loop, or passed by the binary upgraded from.
+//  - Parameters
+//      - ident: The listening socket
+//      - port: Port number it listens on
+Connection::Connection(int ident, port_t port, EventHandler& evHandler)
+: _client(false)
+, _ident(ident)
+, _hostPort(port)
+, _eventHandler(evHandler)
+, _closed(false)
+, _processing(false)
+, _receiving(false)
+, _receiveEnded(false)
+, _requestCount(0)
+, _keepAlive(0)
+, _parsedAt(0)
+, _idleChecked(false)
+, _requestContext(NULL)
+, _responseContext(NULL)
+, _sendContext(NULL)
+, _sending(false)
+, _fileJob(NULL)
+, _cgiProcess(-1)
+, _cgiInput(-1)
+, _cgiOutput(-1)
+, _cgiInputContext(NULL)
+, _generation(0)
+, _targetVirtualServer(NULL) {
+    std::memset(&this->_remoteAddr, 0, sizeof(this->_remoteAddr));
+    this->updatePortString();
+    Log::info("Server Connection: socket[%d] port[%d]", _ident, _hostPort);
+}
+
 // Constructor of Connection class
 // Generates a Connection instance for clients.
 //  - Parameters
 //      - ident: Socket FD which is delivered by accept
-//      - addr: Address to the client
+//      - remoteAddr: Address of the client
 //      - port: Port number to open
-Connection::Connection(int ident, std::string addr, port_t port, EventHandler& evHandler)
+//      - buffers: The pools its requests are received into
+Connection::Connection(int ident, const sockaddr_in& remoteAddr, port_t port, EventHandler& evHandler, RequestBuffers& buffers)
 : _client(true)
 , _ident(ident)
 , _hostPort(port)
-, _addr(addr)
+, _remoteAddr(remoteAddr)
+, _request(buffers)
 , _eventHandler(evHandler)
 , _closed(false)
+, _processing(false)
+, _receiving(false)
+, _receiveEnded(false)
+, _requestCount(0)
+, _keepAlive(0)
+, _parsedAt(0)
+, _idleChecked(false)
+, _requestContext(NULL)
+, _responseContext(NULL)
+, _sendContext(NULL)
+, _sending(false)
+, _fileJob(NULL)
+, _cgiProcess(-1)
+, _cgiInput(-1)
+, _cgiOutput(-1)
+, _cgiInputContext(NULL)
+, _generation(0)
 , _targetVirtualServer(NULL) {
     this->updatePortString();
+    for (int kind = 0; kind < TK_Count; ++kind)
+        this->_timeouts[kind].set(this->_ident, kind, this);
     Log::info("New Client Connection: socket[%d]", _ident);
 }
 
@@ -43,174 +121,554 @@ void Connection::updatePortString() {
 };
 
 // Destructor of the Socket class
-// Closes opened socket file descriptor.
+// Closes opened socket file descriptor, and the CGI pipes no EventContext owns.
+// The frames of its coroutines are destroyed with it.
 Connection::~Connection() {
     Log::verbose("Connection instance destructor has been called: [%d]", _ident);
-    // this->_eventHandler.deleteTimeoutEvent(this->_ident);
+    for (int kind = 0; kind < TK_Count; ++kind)
+        this->cancelTimeout(static_cast<TimeoutKind>(kind));
     this->clearContextChain();
+    if (this->_cgiInput != -1 && this->_cgiInputContext == NULL)
+        close(this->_cgiInput);
+    if (this->_cgiOutput != -1)
+        close(this->_cgiOutput);
+    this->_eventHandler.clearEvents(this->_ident);
     close(this->_ident);
 }
 
 // Used with accept(), creates a new Connection instance by the information of accepted client.
+// The client socket is made non-blocking and close-on-exec by accept4() where
+// available, by fcntl() otherwise.
+//  - Parameters
+//      - pool: The pool to build the Connection on, to be destroyed with.
+//      - buffers: The pools its requests are received into.
 //  - Return
-//      new Connection instance
-Connection* Connection::acceptClient() {
+//      new Connection instance, NULL if no client is pending.
+Connection* Connection::acceptClient(ObjectPool<Connection>& pool, RequestBuffers& buffers) {
     sockaddr_in     remoteaddr;
-    socklen_t       remoteaddrSize = sizeof(remoteaddr);
-    int clientfd = accept(this->_ident, reinterpret_cast<sockaddr*>(&remoteaddr), &remoteaddrSize);
-    std::string     addr;
-    port_t  port;
+    socklen_t       remoteaddrSize;
+    int clientfd;
+
+    do {
+        remoteaddrSize = sizeof(remoteaddr);
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+        clientfd = accept4(this->_ident, reinterpret_cast<sockaddr*>(&remoteaddr), &remoteaddrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        clientfd = accept(this->_ident, reinterpret_cast<sockaddr*>(&remoteaddr), &remoteaddrSize);
+#endif
+    } while (clientfd < 0 && (errno == EINTR || errno == ECONNABORTED));
 
     if (clientfd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return NULL;
         throw std::runtime_error("accept() Failed");
-        return NULL;
     }
-    addr = inet_ntoa(remoteaddr.sin_addr);
-    port = ntohs(remoteaddr.sin_port);
-    Log::info("Connected from client[%s:%d]", addr.c_str(), port);
-    if (fcntl(clientfd, F_SETFL, O_NONBLOCK) < 0)
+#if !(defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC))
+    if (fcntl(clientfd, F_SETFL, O_NONBLOCK) < 0 || fcntl(clientfd, F_SETFD, FD_CLOEXEC) < 0) {
+        close(clientfd);
         throw std::runtime_error("fcntl Failed");
-    return new Connection(clientfd, addr, this->_hostPort, _eventHandler);
+    }
+#endif
+
+    return this->newClient(clientfd, remoteaddr, pool, buffers);
 }
 
-// The way how Connection class handles receive event.
+// Creates a new Connection instance for a client accepted by the kernel, as a
+// completion based poller does, and closes the client if it cannot.
+//  - Parameters
+//      - clientfd: The client socket, non-blocking and close-on-exec.
+//      - pool: The pool to build the Connection on, to be destroyed with.
+//      - buffers: The pools its requests are received into.
 //  - Return
-//      Result of receiving process.
-EventContext::EventResult Connection::eventReceive() {
-    ReturnCaseOfRecv result = this->_request.receive(this->_ident);
-
-	switch (result) {
-	case RCRECV_ERROR:
-		Log::debug("Error has been occured while recieving from [%d].", this->_ident);
-	case RCRECV_ZERO:
-		this->dispose();
-		return EventContext::ER_Remove;
-	case RCRECV_SOME:
-		break;
-	case RCRECV_PARSING_FINISH:
-		return this->passParsedRequest();
-    case RCRECV_ALREADY_PROCESSING_WAIT:
-        break;
-	}
-	return EventContext::ER_Continue;
-}
-
-//  Send response message to client.
-//  - Parameters(None)
+//      new Connection instance, NULL if the client is gone already.
+Connection* Connection::adoptClient(int clientfd, ObjectPool<Connection>& pool, RequestBuffers& buffers) {
+    sockaddr_in     remoteaddr;
+    socklen_t       remoteaddrSize = sizeof(remoteaddr);
+
+    if (getpeername(clientfd, reinterpret_cast<sockaddr*>(&remoteaddr), &remoteaddrSize) < 0) {
+        close(clientfd);
+        return NULL;
+    }
+    return this->newClient(clientfd, remoteaddr, pool, buffers);
+}
+
+// Build the Connection of a client accepted on this listening socket.
+Connection* Connection::newClient(int clientfd, const sockaddr_in& remoteaddr, ObjectPool<Connection>& pool, RequestBuffers& buffers) {
+    Connection* connection = new (pool.allocate()) Connection(clientfd, remoteaddr, this->_hostPort, _eventHandler, buffers);
+    if (Log::isEnabled(Log::LogInfo))
+        Log::info("Connected from client[%s:%d]", connection->getAddr().c_str(), connection->getRemotePort());
+    return connection;
+}
+
+// Format the address of client.
+//  - Return: The address in dotted-decimal notation.
+std::string Connection::getAddr() const {
+    char addrString[INET_ADDRSTRLEN];
+
+    if (!this->_client || inet_ntop(AF_INET, &this->_remoteAddr.sin_addr, addrString, sizeof(addrString)) == NULL)
+        return std::string();
+    return addrString;
+}
+
+//  Run the coroutine serving the connection until it first suspends. It is
+//  resumed by the events it awaits, and destroyed with the connection.
+//  - Parameters coroutine: The coroutine.
 //  - Return(None)
-EventContext::EventResult Connection::eventTransmit() {
-    ReturnCaseOfSend result;
-    
-    this->_response.forgeMessageIfEmpty();
-    this->_response.forgeStartlineForCGI();
-    
-    result = this->_response.sendResponseMessage(this->_ident);
-
-    switch (result) {
-	case RCSEND_ERROR:
-		Log::debug("Error has been occured while Sending to [%d].", this->_ident);
-	case RCSEND_ALL:
-		return EventContext::ER_Remove;
-	case RCSEND_SOME:
-		break;
-	default:
-		assert(false);
-		break;
+void Connection::run(Coroutine coroutine) {
+    this->_coroutine = std::move(coroutine);
+    this->_coroutine.start();
+}
+
+//  Receive the next request from client. The requests received behind the last
+//  one are parsed first, then the socket is awaited until one is complete. A
+//  client which closes or fails is disposed of.
+//  With a completion based poller, the bytes are taken by completeReceive(),
+//  and the socket is only awaited here.
+//  - Return: The coroutine, done once a request has been parsed, or the
+//      connection closed.
+Coroutine Connection::receiveRequest() {
+    while (!this->_closed && !this->parseNextRequest()) {
+        if (this->_receiveEnded) {
+            this->dispose();
+            co_return;
+        }
+        this->_receiving = true;
+        const Event event = co_await this->_eventHandler.readable(this->_requestContext);
+        this->_receiving = false;
+        if (this->_closed || event.filter == EF_RECEIVED)
+            continue;
+
+        const bool idle = this->_request.isIdle();
+        const std::size_t sizeHint = (event.data > 0) ? event.data : 0;
+        const ReturnCaseOfRecv result = this->_request.receive(this->_ident, sizeHint,
+            this->_eventHandler.isEdgeTriggered(), true);
+
+        // The keep-alive timeout only covers the wait for the next request.
+        if (idle && !this->_request.isIdle())
+            this->armTimeout(TK_Idle, TIMEOUT);
+
+        switch (result) {
+        case RCRECV_ERROR:
+            Log::debug("Error has been occured while recieving from [%d].", this->_ident);
+            // fall through
+        case RCRECV_ZERO:
+            this->dispose();
+            co_return;
+        case RCRECV_SOME_LEFT:
+            this->_eventHandler.continueEvent(event);
+            break;
+        case RCRECV_PARSING_FINISH:
+            this->_parsedAt = this->_eventHandler.getClock().getMicroseconds();
+            co_return;
+        default:
+            break;
+        }
+    }
+}
+
+//  Take the bytes the kernel received from client, to be parsed by
+//  receiveRequest(). They are kept even while no request can be taken, as they
+//  have left the socket, but beyond PIPELINE_BUFFER_SIZE, or while a request
+//  parsed waits to be taken, the receive is paused until it awaits the socket
+//  again. Those of a connection closed are dropped.
+//  - Parameters
+//      - data: The bytes received, lent until the next wait.
+//      - result: The number of bytes, 0 at the end of stream, or -errno.
+//  - Return(None)
+void Connection::completeReceive(const char* data, intptr_t result) {
+    if (this->_closed)
+        return;
+    if (result <= 0) {
+        if (result < 0)
+            Log::debug("Error has been occured while recieving from [%d].", this->_ident);
+        this->_receiveEnded = true;
+        return;
+    }
+
+    const bool idle = this->_request.isIdle();
+    ReturnCaseOfRecv received = this->_request.receiveCompleted(data, result, false);
+
+    if (idle && !this->_request.isIdle())
+        this->armTimeout(TK_Idle, TIMEOUT);
+    if (received == RCRECV_ALREADY_PROCESSING_WAIT && !this->_receiving)
+        this->_eventHandler.pauseEvent(EF_READ, this->_requestContext);
+}
+
+//  Finish the request processed in progress: await its file job, or its CGI
+//  process, set its response and commit it.
+//  The job is released by the event loop once this coroutine suspends again.
+//  - Parameters fileIOPool: The pool running the file job.
+//  - Return: The coroutine.
+Coroutine Connection::completeRequest(FileIOPool& fileIOPool) {
+    if (this->_fileJob != NULL) {
+        FileJob* job = this->_fileJob;
+
+        this->_fileJob = NULL;
+        co_await this->_eventHandler.fileRead(fileIOPool, job);
+        this->_targetVirtualServer->setFileJobResponse(*this, *job);
+    } else
+        co_await this->runCGI();
+    if (!this->_closed)
+        this->commitResponse();
+}
+
+//  Send the output: memory first by the write syscalls at once, then on the
+//  write event while the socket is full, or with a completion based poller by
+//  a message of its segments in memory sent by the kernel, one at a time. A
+//  file is sent by sendfile() on the write event still. Once all is sent, the
+//  connection waits for the next request for the keep-alive time, or is
+//  closed without it.
+//  A connection disposed of while a message was sent is disposed of again once
+//  it completes, as the kernel does not read its output any more.
+//  - Return: The coroutine.
+Coroutine Connection::transmit() {
+    bool watched = false;
+
+    while (!this->_closed && this->_response.hasOutput()) {
+        const bool completion = this->_eventHandler.isCompletionBased() && !this->_response.isFileFirst();
+        ReturnCaseOfSend result;
+
+        if (completion) {
+            if (this->_sendContext == NULL) {
+                this->_sendContext = this->_eventHandler.addContext(this->_ident, EventContext::EV_Response, this);
+                this->appendContextChain(this->_sendContext);
+            }
+            this->_sending = true;
+            const Event event = co_await this->_eventHandler.send(this->_sendContext, this->_response.gatherMessage(this->_ident));
+            this->_sending = false;
+            if (this->_closed) {
+                this->_eventHandler.addTask(this->_ident, this->_generation, EventContext::EV_DisposeConn);
+                co_return;
+            }
+            result = this->_response.completeMessage(event.data);
+        } else
+            result = this->_response.sendResponseMessage(this->_ident);
+
+        if (result == RCSEND_ERROR) {
+            Log::debug("Error has been occured while Sending to [%d].", this->_ident);
+            this->dispose();
+            co_return;
+        }
+        if (result == RCSEND_ALL || completion)
+            continue;
+        this->armTimeout(TK_Send, SEND_TIMEOUT);
+        if (this->_responseContext == NULL) {
+            this->_responseContext = this->_eventHandler.addEvent(
+                EF_WRITE,
+                this->_ident,
+                EventContext::EV_Response,
+                this
+            );
+            this->appendContextChain(this->_responseContext);
+        }
+        watched = true;
+        co_await this->_eventHandler.writable(this->_responseContext);
     }
-	return EventContext::ER_Continue;
+    if (this->_closed)
+        co_return;
+    if (watched)
+        this->_eventHandler.pauseEvent(EF_WRITE, this->_responseContext);
+    this->cancelTimeout(TK_Send);
+    if (this->_keepAlive == 0) {
+        this->dispose();
+        co_return;
+    }
+    this->armTimeout(TK_Idle, this->_request.isIdle() ? this->_keepAlive : TIMEOUT);
+}
+
+//  Stop the message being sent by the kernel, whose completion disposes of the
+//  connection closed.
+void Connection::cancelSend() {
+    if (this->_sending)
+        this->_eventHandler.disableEvent(EF_SENT, this->_sendContext);
 }
 
 // Clean-up process to destroy the Socket instance.
-// mark close attribute, and remove all kevents enrolled.
+// mark close attribute, and queue a task destroying it at the end of this loop
+// iteration, as events of this iteration may still refer it.
 //  - Return(none)
 void Connection::dispose() {
     if (_closed == true)
         return;
     Log::verbose("Socket instance closing. [%d]", this->_ident);
     _closed = true;
-	_eventHandler.addUserEvent(
-		this->_ident,
-        EventContext::EV_DisposeConn,
-        NULL
-	);
-}
-
-// Write reqeust body to CGI input(event driven)
-EventContext::EventResult Connection::eventCGIParamBody(EventContext& context) {
-	Request& request = this->_request;
-	std::string body = request.getReducedBody();
-    int PipeToCGI = context.getIdent();
-	size_t leftSize = body.length();
-    ssize_t writeResult = write(PipeToCGI, body.c_str(), leftSize > MAX_WRITEBUFFER ? MAX_WRITEBUFFER : leftSize);
-
-    switch (writeResult) {
-    case -1:
-        Log::warning("CGI body pass failed.");
-    case 0:
-        return EventContext::ER_Remove;
-    default:
-        request.reduceBody(writeResult);
-		body = request.getReducedBody();
-        if (body.length() == 0) {
-            return EventContext::ER_Remove;
+	_eventHandler.addTask(this->_ident, this->_generation, EventContext::EV_DisposeConn);
+}
+
+//  Take the CGI process of the request processed, run by completeRequest().
+//  - Parameters
+//      pid: The CGI process.
+//      input: The pipe to its standard input, non-blocking.
+//      output: The pipe from its standard output, non-blocking.
+//  - Return(None)
+void Connection::setCGI(pid_t pid, int input, int output) {
+    this->_cgiProcess = pid;
+    this->_cgiInput = input;
+    this->_cgiOutput = output;
+}
+
+//  Run the CGI process: write the request body to it while its output is read
+//  into the response, until the output ends, then await its exit. The body
+//  left unwritten then is dropped.
+//  - Return: The coroutine.
+Coroutine Connection::runCGI() {
+    int outputPipe[2] = { this->_cgiOutput, -1 };
+    EventContext* exitContext = this->_eventHandler.addProcessEvent(this->_cgiProcess, EventContext::EV_CGIExit, this);
+    EventContext* outputContext;
+
+    if (exitContext != NULL)
+        this->appendContextChain(exitContext);
+    outputContext = this->addKevent(EF_READ, this->_cgiOutput, EventContext::EV_CGIResponse, this, outputPipe);
+    this->_cgiOutput = -1;
+    this->_cgiWriter = this->passCGIInput();
+    this->_cgiWriter.start();
+
+    for (;;) {
+        const Event event = co_await this->_eventHandler.readable(outputContext);
+
+        if (this->_closed)
+            co_return;
+
+        const ReturnCaseOfRecv result = this->readCGIOutput(outputContext->getIdent(), (event.data > 0) ? event.data : 0);
+
+        if (result == RCRECV_SOME_LEFT)
+            this->_eventHandler.continueEvent(event);
+        else if (result != RCRECV_SOME)
+            break;
+    }
+    this->endCGIEvent(EF_READ, outputContext);
+    this->endCGIInput();
+    this->_cgiWriter = Coroutine();
+
+    co_await this->_eventHandler.childExit(exitContext);
+    if (this->_closed)
+        co_return;
+    if (exitContext != NULL)
+        this->endCGIEvent(EF_READ, exitContext);
+    this->_cgiProcess = -1;
+}
+
+//  Write the request body to the CGI process, awaiting its pipe whenever it is
+//  full, then close the pipe.
+//  - Return: The coroutine, run alongside runCGI().
+Coroutine Connection::passCGIInput() {
+    const std::string& body = this->_request.getBody();
+
+    while (this->_request.getBodyWritten() < body.length()) {
+        const std::size_t leftSize = body.length() - this->_request.getBodyWritten();
+        const ssize_t writeResult = write(this->_cgiInput, body.data() + this->_request.getBodyWritten(),
+            leftSize > MAX_WRITEBUFFER ? MAX_WRITEBUFFER : leftSize);
+
+        if (writeResult < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (this->_cgiInputContext == NULL) {
+                int inputPipe[2] = { -1, this->_cgiInput };
+
+                this->_cgiInputContext = this->addKevent(EF_WRITE, this->_cgiInput, EventContext::EV_CGIParamBody, this, inputPipe);
+            }
+            co_await this->_eventHandler.writable(this->_cgiInputContext);
+            if (this->_closed)
+                co_return;
+            continue;
+        }
+        if (writeResult <= 0) {
+            Log::warning("CGI body pass failed.");
+            break;
         }
-        return EventContext::ER_Remove;
-        // return EventContext::ER_Continue;
+        this->_request.reduceBody(writeResult);
     }
+    this->endCGIInput();
 }
 
-// Read CGI output and append to response (event driven)
-EventContext::EventResult Connection::eventCGIResponse(EventContext& context) {
+// Read CGI output and append to response.
+// Reads up to DRAIN_BUDGET bytes, sized by 'sizeHint' if known. It stops once
+// the pipe is shown empty, or goes on until read() would block in
+// edge-triggered mode.
+//  - Parameters
+//      pipeFromCGI: The pipe from CGI.
+//      sizeHint: The bytes available on the pipe if known, 0 otherwise.
+//  - Return
+//      RCRECV_ZERO, RCRECV_ERROR: The output has ended, or the pipe is broken.
+//      RCRECV_SOME: Read what the pipe had.
+//      RCRECV_SOME_LEFT: Stopped by the budget before draining the pipe.
+ReturnCaseOfRecv Connection::readCGIOutput(int pipeFromCGI, std::size_t sizeHint) {
     char buffer[BUF_SIZE];
-    int PipeFromCGI = context.getIdent();
-    ssize_t result = read(PipeFromCGI, buffer, BUF_SIZE - 1);
-
-    switch (result) {
-    case 0:
-        this->_eventHandler.addEvent(
-            EVFILT_WRITE,
-            this->_ident,
-            EventContext::EV_Response,
-            this
-        );
-        return EventContext::ER_Remove;
-    case -1:
-        Log::warning("CGI pipe has been broken while Respond.");
-        return EventContext::ER_Remove;
-    default:
-        buffer[result] = '\0';
-        this->appendResponseMessage(buffer);
-        return EventContext::ER_Continue;
+    const bool drain = this->_eventHandler.isEdgeTriggered();
+    std::size_t received = 0;
+
+    while (received < DRAIN_BUDGET) {
+        std::size_t readSize = (sizeHint > received) ? sizeHint - received : BUF_SIZE;
+        if (readSize > BUF_SIZE)
+            readSize = BUF_SIZE;
+        ssize_t result = read(pipeFromCGI, buffer, readSize);
+
+        switch (result) {
+        case 0:
+            return RCRECV_ZERO;
+        case -1:
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return RCRECV_SOME;
+            Log::warning("CGI pipe has been broken while Respond.");
+            return RCRECV_ERROR;
+        default:
+            this->_response.appendCGIOutput(buffer, result);
+            received += result;
+        }
+        if (!drain && (static_cast<std::size_t>(result) < readSize || (sizeHint > 0 && received >= sizeHint)))
+            return RCRECV_SOME;
     }
+    return RCRECV_SOME_LEFT;
+}
+
+//  Close the pipe to the CGI process, removing its write event if watched.
+void Connection::endCGIInput() {
+    if (this->_cgiInput == -1)
+        return;
+    if (this->_cgiInputContext != NULL)
+        this->endCGIEvent(EF_WRITE, this->_cgiInputContext);
+    else
+        close(this->_cgiInput);
+    this->_cgiInput = -1;
+    this->_cgiInputContext = NULL;
+}
+
+// The response built is complete: commit it behind the ones not sent yet, to
+// be sent by transmit().
+void Connection::commitResponse() {
+    this->_response.commitMessage(this->isKeepAlive());
+    this->_processing = false;
+    this->armTimeout(TK_Send, SEND_TIMEOUT);
+}
+
+//  Watch the socket of the client for requests with context, the EV_Request
+//  event, awaited by receiveRequest().
+//  - Parameters context: The EventContext of the read event.
+//  - Return(None)
+void Connection::setRequestContext(EventContext* context) {
+    this->_requestContext = context;
+    this->appendContextChain(context);
+}
+
+//  Take the request parsed to process it. Its response tells whether the
+//  connection is kept open after it.
+//  - Parameters keepAlive: Milliseconds to keep the connection open for the
+//      next request after the response, 0 to close it after the response.
+//  - Return(None)
+void Connection::takeRequest(long keepAlive) {
+    this->_processing = true;
+    ++this->_requestCount;
+    this->_keepAlive = keepAlive;
+}
+
+//  Parse the next request received behind the last one, as a pipelining
+//  client sends them without waiting for the responses.
+//  - Return: Whether a request has been parsed, to be processed.
+bool Connection::parseNextRequest() {
+    if (this->_closed || !this->isTakingRequest() || this->_request.isParsed())
+        return false;
+    if (this->_request.parseReceived() != RCRECV_PARSING_FINISH)
+        return false;
+    this->_parsedAt = this->_eventHandler.getClock().getMicroseconds();
+    return true;
+}
+
+//  Whether the connection has been idle at this call and the last one, so a
+//  client just accepted, or whose request is on its way, is not cut.
+//  - Return: Whether it stayed idle since the last call.
+bool Connection::stayedIdle() {
+    const bool idle = this->isIdle();
+    const bool stayed = idle && this->_idleChecked;
+
+    this->_idleChecked = idle;
+    return stayed;
 }
 
 void Connection::appendContextChain(EventContext* context) {
     this->_eventContextChain.push_back(context);
 }
 
+// Free the EventContexts of the connection. The events of CGI pipes and
+// processes still watched are removed, closing the pipes, as they refer to the
+// connection.
 void Connection::clearContextChain() {
     std::list<EventContext*>::iterator iter;
     for (iter = this->_eventContextChain.begin();
         iter != this->_eventContextChain.end();
         iter++) {
-            delete *iter;
+            const EventContext::EventType type = (*iter)->getEventType();
+
+            if (type == EventContext::EV_CGIParamBody || type == EventContext::EV_CGIResponse || type == EventContext::EV_CGIExit)
+                this->_eventHandler.removeEvent(type == EventContext::EV_CGIParamBody ? EF_WRITE : EF_READ, *iter);
+            else
+                this->_eventHandler.releaseContext(*iter);
         }
     this->_eventContextChain.clear();
 }
 
-// Add event in kevent(normal case)
+// The event of a CGI pipe or process is done: remove it, closing its pipe.
+//  - Parameters
+//      filter: The filter of the event.
+//      context: EventContext of the pipe or process.
+//  - Return(none)
+void Connection::endCGIEvent(int filter, EventContext* context) {
+    this->_eventContextChain.remove(context);
+    this->_eventHandler.removeEvent(filter, context);
+}
+
+// Add event in EventHandler(normal case)
 EventContext* Connection::addKevent(int filter, int fd, EventContext::EventType type, void* data) {
     return this->_eventHandler.addEvent(filter, fd, type, data);
 }
 
-// Add event in kevent(cgi case)
+// Add event in EventHandler(cgi case)
+// The event is kept in the chain until endCGIEvent(), to be removed with the
+// connection.
 EventContext* Connection::addKevent(int filter, int fd, EventContext::EventType type, void* data, int pipe[2]) {
-    return this->_eventHandler.addEvent(filter, fd, type, data, pipe);
+    EventContext* context = this->_eventHandler.addEvent(filter, fd, type, data, pipe);
+
+    this->appendContextChain(context);
+    return context;
 }
 
-// Creates new Connection and set for the attribute.
+// Open a socket listening on 'port' of every address.
+//  - Parameters
+//      - port: Port number to open
+//      - reusePort: Share the port with other listening sockets
+//      - options: The parameters of the 'listen' directive
+//  - Return: The socket, non-blocking and close-on-exec.
+int Connection::openListenSocket(port_t port, bool reusePort, const ListenOptions& options) {
+    const int ident = newSocket(reusePort);
+
+    try {
+        setListenOptions(ident, port, options);
+        bindSocket(ident, port);
+        listenSocket(ident, port, options);
+    } catch (...) {
+        close(ident);
+        throw;
+    }
+    return ident;
+}
+
+// Take over a listening socket opened by another process, like the binary
+// upgraded from, and set the parameters of the 'listen' directive on it. It
+// listens again for the backlog to take effect.
+//  - Parameters
+//      - ident: The listening socket
+//      - port: Port number it listens on
+//      - options: The parameters of the 'listen' directive
 //  - Return(none)
-void Connection::newSocket() {
+void Connection::adoptListenSocket(int ident, port_t port, const ListenOptions& options) {
+    setListenOptions(ident, port, options);
+    listenSocket(ident, port, options);
+}
+
+// Creates new socket and set for the attribute.
+// With 'reusePort', the kernel balances incoming connections across every
+// socket listening on the same port.
+//  - Parameters
+//      - reusePort: Set SO_REUSEPORT (SO_REUSEPORT_LB where available).
+//  - Return: The socket.
+int Connection::newSocket(bool reusePort) {
     int     newConnection = socket(PF_INET, SOCK_STREAM, 0);
     int     enable = 1;
 
@@ -218,10 +676,96 @@ void Connection::newSocket() {
         throw Connection::MAKESOCKETFAIL();
     }
     if (0 > setsockopt(newConnection, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))) {
+        close(newConnection);
+        throw Connection::SETUPSOCKETOPTFAIL();
+    }
+#if defined(SO_REUSEPORT_LB)
+    if (reusePort && 0 > setsockopt(newConnection, SOL_SOCKET, SO_REUSEPORT_LB, &enable, sizeof(int))) {
+#else
+    if (reusePort && 0 > setsockopt(newConnection, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int))) {
+#endif
+        close(newConnection);
         throw Connection::SETUPSOCKETOPTFAIL();
     }
     // Log::verbose("Connection ( %d ) has been setted to Reusable.", newConnection);
-    this->_ident = newConnection;
+    return newConnection;
+}
+
+// Set the parameters of the 'listen' directive on the socket, but the backlog
+// and the accept filter, which are set by listenSocket().
+// The kernel may refuse some, like busy polling without CAP_NET_ADMIN or
+// buffers beyond net.core.wmem_max, which only leaves the socket without them.
+//  - Parameters
+//      - ident: The socket
+//      - port: Port number to open
+//      - options: The parameters of the 'listen' directive.
+//  - Return(none)
+void Connection::setListenOptions(int ident, port_t port, const ListenOptions& options) {
+    if (options.busyPoll > 0)
+        setBusyPoll(ident, port, options.busyPoll);
+    if (options.noDelay)
+        setSocketOption(ident, port, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+    if (options.sendBuffer > 0)
+        setSocketOption(ident, port, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", options.sendBuffer);
+    if (options.receiveBuffer > 0)
+        setSocketOption(ident, port, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", options.receiveBuffer);
+    if (options.notSentLowat > 0) {
+#if defined(TCP_NOTSENT_LOWAT)
+        setSocketOption(ident, port, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", options.notSentLowat);
+#else
+        Log::warning("notsent_lowat on port %d: no TCP_NOTSENT_LOWAT on this system", port);
+#endif
+    }
+    if (options.fastOpen > 0) {
+#if defined(TCP_FASTOPEN) && defined(__APPLE__)
+        setSocketOption(ident, port, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", 1);
+#elif defined(TCP_FASTOPEN)
+        setSocketOption(ident, port, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", options.fastOpen);
+#else
+        Log::warning("fastopen on port %d: no TCP_FASTOPEN on this system", port);
+#endif
+    }
+    if (options.deferred) {
+#if defined(TCP_DEFER_ACCEPT)
+        setSocketOption(ident, port, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", DEFER_ACCEPT_TIMEOUT);
+#elif !defined(SO_ACCEPTFILTER)
+        Log::warning("deferred on port %d: no deferred accept on this system", port);
+#endif
+    }
+}
+
+// Set busy polling on the socket.
+//  - Parameters
+//      - ident: The socket
+//      - port: Port number to open
+//      - busyPoll: Microseconds of busy polling.
+//  - Return(none)
+void Connection::setBusyPoll(int ident, port_t port, long busyPoll) {
+#if defined(SO_BUSY_POLL)
+    setSocketOption(ident, port, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", busyPoll);
+# if defined(SO_PREFER_BUSY_POLL)
+    setSocketOption(ident, port, SOL_SOCKET, SO_PREFER_BUSY_POLL, "SO_PREFER_BUSY_POLL", 1);
+# endif
+#else
+    (void)ident;
+    (void)busyPoll;
+    Log::warning("busy_poll on port %d: no socket busy polling on this system", port);
+#endif
+}
+
+// Set an int socket option, logging a warning if the kernel refuses it.
+//  - Parameters
+//      - ident: The socket
+//      - port: Port number to open
+//      - level, name: The option, as of setsockopt().
+//      - optionName: The name of the option in the log.
+//      - value: The value of the option.
+//  - Return(none)
+void Connection::setSocketOption(int ident, port_t port, int level, int name, const char* optionName, long value) {
+    int intValue = static_cast<int>(value);
+
+    if (0 > setsockopt(ident, level, name, &intValue, sizeof(int)))
+        Log::warning("%s on port %d: %s", optionName, port, std::strerror(errno));
 }
 
 // Set-up addr_in structure to bind the socket.
@@ -236,36 +780,38 @@ static void setAddrStruct(int port, sockaddr_in& addr_in) {
 
 // Bind socket to the designated port.
 //  - Return(none)
-void Connection::bindSocket() {
+void Connection::bindSocket(int ident, port_t port) {
     sockaddr*   addr;
     sockaddr_in addr_in;
-    setAddrStruct(this->_hostPort, addr_in);
+    setAddrStruct(port, addr_in);
     addr = reinterpret_cast<sockaddr*>(&addr_in);
-    if (0 > bind(this->_ident, addr, sizeof(*addr))) {
+    if (0 > bind(ident, addr, sizeof(*addr))) {
         throw Connection::BINDSOCKETERROR();
     }
 }
 
-// Listen to the socket for incoming messages.
+// Listen to the socket for incoming messages, with the backlog of the 'listen'
+// directive. Where deferred accept is an accept filter, it is set once the
+// socket listens.
 //  - Return(none)
-void Connection::listenSocket() {
-    if (0 > listen(_ident, LISTEN_BACKLOG)) {
+void Connection::listenSocket(int ident, port_t port, const ListenOptions& options) {
+    if (0 > listen(ident, (options.backlog > 0) ? static_cast<int>(options.backlog) : LISTEN_BACKLOG)) {
         throw Connection::LISTENSOCKETERROR();
     }
-    if (fcntl(this->_ident, F_SETFL, O_NONBLOCK) == -1)
-        throw Connection::LISTENSOCKETERROR();
-}
+#if defined(SO_ACCEPTFILTER) && !defined(TCP_DEFER_ACCEPT)
+    if (options.deferred) {
+        struct accept_filter_arg filter;
 
-EventContext::EventResult Connection::passParsedRequest() {
-    EventContext* context;
-
-	context = _eventHandler.addUserEvent(
-		this->_ident,
-        EventContext::EV_ProcessRequest,
-        this
-	);
-    this->appendContextChain(context);
-	return EventContext::ER_Done;
+        std::memset(&filter, 0, sizeof(filter));
+        std::strcpy(filter.af_name, "dataready");
+        if (0 > setsockopt(ident, SOL_SOCKET, SO_ACCEPTFILTER, &filter, sizeof(filter)))
+            Log::warning("SO_ACCEPTFILTER on port %d: %s", port, std::strerror(errno));
+    }
+#else
+    (void)port;
+#endif
+    if (fcntl(ident, F_SETFL, O_NONBLOCK) == -1 || fcntl(ident, F_SETFD, FD_CLOEXEC) == -1)
+        throw Connection::LISTENSOCKETERROR();
 }
 
 // for CGI input parameter
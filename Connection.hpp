@@ -2,7 +2,6 @@
 #define CONNECTION_HPP_
 
 #include <string>
-#include <sys/event.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -11,10 +10,12 @@
 #include <sstream>
 #include <list>
 #include "Log.hpp"
+#include "Coroutine.hpp"
 #include "EventHandler.hpp"
 #include "VirtualServer.hpp"
 #include "Request.hpp"
 #include "Response.hpp"
+#include "CompletionHandler.hpp"
 
 #define TCP_MTU 1500
 
@@ -22,43 +23,150 @@ class VirtualServer;
 
 typedef unsigned short port_t;
 
+//  ListenOptions are the parameters of a 'listen' directive after its port,
+//  set on the listening socket. Virtual servers on a port share its socket, so
+//  theirs are merged, the larger value of each winning. Socket options set on
+//  the listening socket are inherited by the clients accepted on Linux.
+//  - Member variables
+//      busyPoll: Microseconds of busy polling. ('busy_poll=' parameter, 0 for none)
+//          Sets SO_BUSY_POLL and SO_PREFER_BUSY_POLL, inherited by the clients
+//          accepted, and makes the event loops poll before sleeping.
+//      backlog: The length of the accept queue. ('backlog=', LISTEN_BACKLOG by default)
+//      deferred: Wake up on a client only once it has sent data. ('deferred')
+//          Sets TCP_DEFER_ACCEPT, or the "dataready" SO_ACCEPTFILTER.
+//      fastOpen: The queue of TCP Fast Open connections. ('fastopen=', 0 for none)
+//      noDelay: Send small segments at once. ('nodelay', TCP_NODELAY)
+//      sendBuffer: SO_SNDBUF in bytes. ('sndbuf=', 0 for the default)
+//      receiveBuffer: SO_RCVBUF in bytes. ('rcvbuf=', 0 for the default)
+//      notSentLowat: TCP_NOTSENT_LOWAT in bytes. ('notsent_lowat=', 0 for the default)
+struct ListenOptions {
+    long busyPoll;
+    long backlog;
+    bool deferred;
+    long fastOpen;
+    bool noDelay;
+    long sendBuffer;
+    long receiveBuffer;
+    long notSentLowat;
+
+    ListenOptions()
+    : busyPoll(0)
+    , backlog(0)
+    , deferred(false)
+    , fastOpen(0)
+    , noDelay(false)
+    , sendBuffer(0)
+    , receiveBuffer(0)
+    , notSentLowat(0) { };
+};
+
 //  General coonection handler, from generation communication.
 //   - Member Variables
 //      _client
 //      _ident
-//      _addr
+//      _remoteAddr: the address of client, formatted only by getAddr().
 //      _port
 //      _request: store request message and parse it.
 //      -response: store response message and send it to client.
+//      _processing: a request has been taken to process, until its response is complete.
+//      _receiving: receiveRequest() awaits the socket.
+//      _receiveEnded: the kernel has received the end of stream, or an error.
+//      _requestCount: the requests taken on the connection.
+//      _keepAlive: milliseconds the connection is kept open for the next request
+//          after the response to the one taken, 0 to close it after the response.
+//      _parsedAt: when the last request was parsed, in microseconds of the
+//          loop clock, to measure its queue delay.
+//      _idleChecked: it was idle at the last stayedIdle().
+//      _timeouts: timeouts of client per TimeoutKind.
+//      _generation: the generation of its slot in the connection table.
+//      _sendContext: the EventContext of the messages sent by a completion based poller.
+//      _sending: a message of the output is being sent by the kernel, which reads
+//          the output until it completes.
+//      _fileJob: the FileJob of the request processed, run by completeRequest().
+//      _cgiProcess: the CGI process of the request processed.
+//      _cgiInput, _cgiOutput: the pipes to and from it, -1 once owned by an
+//          EventContext or closed.
+//      _cgiInputContext: the write event of _cgiInput, once it is awaited.
+//      _coroutine: the coroutine serving the connection, run by run().
+//      _cgiWriter: the coroutine writing the request body to the CGI process.
 //
 //      _targetVirtualServer: the target to process request.
 //   - Methods
-class Connection {
+//      receiveRequest: Await the next request, parsed once it returns.
+//      completeRequest: Await the file job or the CGI process of the request
+//          processed, and commit its response.
+//      transmit: Send the responses committed, then wait for the next request
+//          or close the connection.
+//  A client connection is served by a coroutine awaiting them in turn, whose
+//  frame is destroyed with the connection.
+class Connection : public CompletionHandler {
 public:
-    Connection(port_t port, EventHandler& evHandler);
+    //  TimeoutKind is the kind of timeouts which a client connection has.
+    //  - Constants
+    //      TK_Idle: No request has been processed for TIMEOUT.
+    //      TK_Send: The response has not progressed for SEND_TIMEOUT.
+    enum TimeoutKind {
+        TK_Idle,
+        TK_Send,
+        TK_Count,
+    };
+
+    Connection(port_t port, EventHandler& evHandler, bool reusePort, const ListenOptions& options);
+    Connection(int ident, port_t port, EventHandler& evHandler);
     ~Connection();
 
     bool isclient() { return this->_client; };
     int getIdent() { return this->_ident; };
-    std::string getAddr() { return this->_addr; };
+    std::string getAddr() const;
+    port_t getRemotePort() const { return ntohs(this->_remoteAddr.sin_port); };
     port_t getPort() { return this->_hostPort; };
     const Request& getRequest() const { return this->_request; };
     const Response& getResponse() const { return this->_response; };
     bool isClosed() { return this->_closed; };
+    bool isIdle() const { return !this->_processing && !this->_response.hasOutput() && this->_request.isIdle(); };
+    bool isTakingRequest() const {
+        return !this->_processing && !this->_response.isOutputFull() && (this->_requestCount == 0 || this->_keepAlive > 0);
+    };
+    void setProcessing(bool processing) { this->_processing = processing; };
+    void takeRequest(long keepAlive);
+    bool parseNextRequest();
+    unsigned long getRequestCount() const { return this->_requestCount; };
+    long getParsedTime() const { return this->_parsedAt; };
+    bool isKeepAlive() const { return this->_keepAlive > 0; };
+    bool stayedIdle();
     VirtualServer* getTargetVirtualServer() { return this->_targetVirtualServer; };
     void setTargetVirtualServer(VirtualServer* targetVirtualServer) { this->_targetVirtualServer = targetVirtualServer; };
     const std::string& getPortString() { return this->_portString; };
+    unsigned int getGeneration() { return this->_generation; };
+    void setGeneration(unsigned int generation) { this->_generation = generation; };
+    const LoopClock& getClock() { return this->_eventHandler.getClock(); };
 
-    Connection* acceptClient();
-    EventContext::EventResult eventReceive();
-    EventContext::EventResult eventTransmit();
+    void run(Coroutine coroutine);
+    Connection* acceptClient(ObjectPool<Connection>& pool, RequestBuffers& buffers);
+    Connection* adoptClient(int clientfd, ObjectPool<Connection>& pool, RequestBuffers& buffers);
+    static int openListenSocket(port_t port, bool reusePort, const ListenOptions& options);
+    static void adoptListenSocket(int ident, port_t port, const ListenOptions& options);
+    Coroutine receiveRequest();
+    Coroutine completeRequest(FileIOPool& fileIOPool);
+    Coroutine transmit();
+    virtual void completeReceive(const char* data, intptr_t result);
+    bool isSending() const { return this->_sending; };
+    void cancelSend();
     void dispose();
     void clearRequestMessage();
     void resetRequestStatus() { this->_request.resetStatus(); };
+    void takeRequestBody(std::string& body) { this->_request.takeBody(body); };
     void clearResponseMessage();
     void appendResponseMessage(const std::string& message);
-    EventContext::EventResult eventCGIParamBody(EventContext& context);
-    EventContext::EventResult eventCGIResponse(EventContext& context);
+    void appendResponseMessage(const char* message);
+    void setResponseBody(std::string& body);
+    void setResponseFile(int fd, off_t size);
+    void setFileJob(FileJob* job) { this->_fileJob = job; };
+    void setCGI(pid_t pid, int input, int output);
+    void commitResponse();
+    void setRequestContext(EventContext* context);
+    void armTimeout(TimeoutKind kind, long milliseconds);
+    void cancelTimeout(TimeoutKind kind);
     void appendContextChain(EventContext* context);
     void clearContextChain();
     EventContext* addKevent(int filter, int fd, EventContext::EventType type, void* data); // INFO unuse function
@@ -68,42 +176,58 @@ public:
 
     class MAKESOCKETFAIL: public std::exception {
     public:
-        virtual const char* what() const throw() {
+        virtual const char* what() const noexcept {
             return "socket() fail error";
         }
     };
     class SETUPSOCKETOPTFAIL: public std::exception {
     public:
-        virtual const char* what() const throw() {
+        virtual const char* what() const noexcept {
             return "setsocketopt() faile error";
         }
     };
     class BINDSOCKETERROR: public std::exception {
     public:
-        virtual const char* what() const throw() {
+        virtual const char* what() const noexcept {
             return "bind() fail error";
         }
     };
     class LISTENSOCKETERROR: public std::exception {
     public:
-        virtual const char* what() const throw() {
+        virtual const char* what() const noexcept {
             return "listen() fail error!!";
         }
     };
 
-    void initResponseBodyBySize(std::string::size_type size) { this->_response.initBodyBySize(size); };
-    void memcpyResponseMessage(char* buf, ssize_t size) { this->_response.memcpyMessage(buf, size); };
-    bool isResponseReadAllFile() { return this->_response.isReadAllFile(); };
-
 private:
     bool _client;
     int _ident;
     port_t _hostPort;
-    std::string _addr;
+    sockaddr_in _remoteAddr;
     Request _request;
     Response _response;
 	EventHandler& _eventHandler;
     bool _closed;
+    bool _processing;
+    bool _receiving;
+    bool _receiveEnded;
+    unsigned long _requestCount;
+    long _keepAlive;
+    long _parsedAt;
+    bool _idleChecked;
+    EventContext* _requestContext;
+    EventContext* _responseContext;
+    EventContext* _sendContext;
+    bool _sending;
+    FileJob* _fileJob;
+    pid_t _cgiProcess;
+    int _cgiInput;
+    int _cgiOutput;
+    EventContext* _cgiInputContext;
+    Coroutine _coroutine;
+    Coroutine _cgiWriter;
+    TimerWheel::Timer _timeouts[TK_Count];
+    unsigned int _generation;
 
 	std::list<EventContext*> _eventContextChain;
     // timeout event에서 참조하여 객체 및 이벤트 정리 [v]
@@ -113,12 +237,20 @@ private:
 
     std::string _portString;
 
-    Connection(int ident, std::string addr, port_t port, EventHandler& evHandler);
+    Connection(int ident, const sockaddr_in& remoteAddr, port_t port, EventHandler& evHandler, RequestBuffers& buffers);
 
-    void newSocket();
-    void bindSocket();
-    void listenSocket();
-    EventContext::EventResult passParsedRequest();
+    Connection* newClient(int clientfd, const sockaddr_in& remoteaddr, ObjectPool<Connection>& pool, RequestBuffers& buffers);
+    Coroutine runCGI();
+    Coroutine passCGIInput();
+    ReturnCaseOfRecv readCGIOutput(int pipeFromCGI, std::size_t sizeHint);
+    void endCGIInput();
+    void endCGIEvent(int filter, EventContext* context);
+    static int newSocket(bool reusePort);
+    static void setListenOptions(int ident, port_t port, const ListenOptions& options);
+    static void setBusyPoll(int ident, port_t port, long busyPoll);
+    static void setSocketOption(int ident, port_t port, int level, int name, const char* optionName, long value);
+    static void bindSocket(int ident, port_t port);
+    static void listenSocket(int ident, port_t port, const ListenOptions& options);
 };
 
 //  Clear request message.
@@ -142,4 +274,43 @@ inline void Connection::appendResponseMessage(const std::string& message) {
     this->_response.appendMessage(message);
 }
 
+//  Append NUL-terminated message to response.
+//  - Parameters message: message to append.
+//  - Return(None)
+inline void Connection::appendResponseMessage(const char* message) {
+    this->_response.appendMessage(message);
+}
+
+//  Take body over as the body of response, leaving it empty.
+//  - Parameters body: The body of response.
+//  - Return(None)
+inline void Connection::setResponseBody(std::string& body) {
+    this->_response.setBody(body);
+}
+
+//  Take the file fd over as the body of response, sent by sendfile().
+//  - Parameters
+//      fd: The file, closed by the response.
+//      size: The bytes of the file to send.
+//  - Return(None)
+inline void Connection::setResponseFile(int fd, off_t size) {
+    this->_response.setFile(fd, size);
+}
+
+//  Arm the timeout of kind. Arming it again restarts it.
+//  - Parameters
+//      kind: The kind of timeout.
+//      milliseconds: Time until the timeout expires.
+//  - Return(None)
+inline void Connection::armTimeout(TimeoutKind kind, long milliseconds) {
+    this->_eventHandler.addTimeoutEvent(this->_timeouts[kind], milliseconds);
+}
+
+//  Disarm the timeout of kind.
+//  - Parameters kind: The kind of timeout.
+//  - Return(None)
+inline void Connection::cancelTimeout(TimeoutKind kind) {
+    this->_eventHandler.deleteTimeoutEvent(this->_timeouts[kind]);
+}
+
 #endif  // CONNECTION_HPP_
@@ -0,0 +1,51 @@
+#include <sys/resource.h>
+#include <algorithm>
+#include "ConnectionTable.hpp"
+#include "constant.hpp"
+
+// Constructor of ConnectionTable.
+// Allocates a slot per fd allowed by RLIMIT_NOFILE, CONNECTION_TABLE_PREALLOC at most.
+ConnectionTable::ConnectionTable()
+: _count(0) {
+    struct rlimit limit;
+    std::size_t size = CONNECTION_TABLE_PREALLOC;
+    Slot empty;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        size = std::min(size, static_cast<std::size_t>(limit.rlim_cur));
+    empty.connection = NULL;
+    empty.generation = 0;
+    this->_slots.assign(size, empty);
+}
+
+// Put the Connection at fd, growing the table to hold fd if needed.
+//  - Parameters
+//      fd: The socket of connection.
+//      connection: The Connection.
+//  - Return: The generation of the slot, to find it with later.
+unsigned int ConnectionTable::insert(int fd, Connection* connection) {
+    const std::size_t index = static_cast<std::size_t>(fd);
+
+    if (index >= this->_slots.size()) {
+        Slot empty;
+
+        empty.connection = NULL;
+        empty.generation = 0;
+        this->_slots.resize(std::max(index + 1, this->_slots.size() * 2), empty);
+    }
+    if (this->_slots[index].connection == NULL)
+        ++this->_count;
+    this->_slots[index].connection = connection;
+    return this->_slots[index].generation;
+}
+
+// Remove the Connection at fd. References of its generation become stale.
+//  - Parameters fd: The socket of connection.
+//  - Return(None)
+void ConnectionTable::erase(int fd) {
+    if (this->find(fd) == NULL)
+        return;
+    this->_slots[fd].connection = NULL;
+    ++this->_slots[fd].generation;
+    --this->_count;
+}
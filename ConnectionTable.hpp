@@ -0,0 +1,71 @@
+#ifndef CONNECTIONTABLE_HPP_
+#define CONNECTIONTABLE_HPP_
+
+#include <cstddef>
+#include <vector>
+
+class Connection;
+
+//  ConnectionTable maps the sockets of an event loop to their Connection with a
+//  dense array indexed by fd, as the kernel hands out the lowest free fd.
+//  The array is sized from RLIMIT_NOFILE, CONNECTION_TABLE_PREALLOC slots at
+//  most, and grown on demand.
+//  Every slot counts its generation, bumped when its Connection is erased, so a
+//  reference kept as (fd, generation) across loop iterations is found stale
+//  once the fd is closed, even if it is reused by another Connection.
+//  - Member variables
+//      _slots: Connection and generation per fd.
+//      _count: the number of Connections in the table.
+//  - Methods
+//      insert: Put 'connection' at 'fd' and return the generation of the slot.
+//      find: The Connection at 'fd', NULL if none or of another generation.
+//      erase: Remove the Connection at 'fd' and bump the generation of the slot.
+//      at: The Connection at index 'fd' of the array, for iteration by capacity().
+class ConnectionTable {
+public:
+    ConnectionTable();
+
+    std::size_t size() const { return this->_count; };
+    std::size_t capacity() const { return this->_slots.size(); };
+    Connection* at(std::size_t fd) const { return this->_slots[fd].connection; };
+
+    unsigned int insert(int fd, Connection* connection);
+    Connection* find(int fd) const;
+    Connection* find(int fd, unsigned int generation) const;
+    void erase(int fd);
+
+private:
+    struct Slot {
+        Connection* connection;
+        unsigned int generation;
+    };
+
+    std::vector<Slot> _slots;
+    std::size_t _count;
+
+    ConnectionTable(const ConnectionTable&);
+    ConnectionTable& operator=(const ConnectionTable&);
+};
+
+//  The Connection at fd.
+//  - Parameters fd: The socket.
+//  - Return: The Connection, NULL if none.
+inline Connection* ConnectionTable::find(int fd) const {
+    if (fd < 0 || static_cast<std::size_t>(fd) >= this->_slots.size())
+        return NULL;
+    return this->_slots[fd].connection;
+}
+
+//  The Connection at fd, if it is still of generation.
+//  - Parameters
+//      fd: The socket.
+//      generation: The generation returned by insert().
+//  - Return: The Connection, NULL if none or stale.
+inline Connection* ConnectionTable::find(int fd, unsigned int generation) const {
+    if (fd < 0 || static_cast<std::size_t>(fd) >= this->_slots.size()
+        || this->_slots[fd].generation != generation)
+        return NULL;
+    return this->_slots[fd].connection;
+}
+
+#endif  // CONNECTIONTABLE_HPP_
@@ -0,0 +1,69 @@
+#include <utility>
+#include "Coroutine.hpp"
+#include "Log.hpp"
+
+//  Move constructor of Coroutine. 'other' is left without a frame.
+Coroutine::Coroutine(Coroutine&& other) noexcept
+: _handle(std::exchange(other._handle, nullptr)) { }
+
+//  Take the frame of 'other' over, destroying the one held.
+Coroutine& Coroutine::operator=(Coroutine&& other) noexcept {
+    if (this != &other) {
+        if (this->_handle)
+            this->_handle.destroy();
+        this->_handle = std::exchange(other._handle, nullptr);
+    }
+    return *this;
+}
+
+//  Destructor of Coroutine. The frame is destroyed, suspended or returned.
+Coroutine::~Coroutine() {
+    if (this->_handle)
+        this->_handle.destroy();
+}
+
+//  Run the coroutine until it first suspends. An exception leaving it is
+//  logged by unhandled_exception(), not thrown from here.
+//  - Parameters(None)
+//  - Return(None)
+void Coroutine::start() {
+    this->_handle.resume();
+}
+
+//  Run the coroutine awaited, to resume 'awaiting' once it has returned.
+//  - Parameters awaiting: The coroutine awaiting it.
+//  - Return: The coroutine to run now.
+std::coroutine_handle<> Coroutine::await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    this->_handle.promise().continuation = awaiting;
+    return this->_handle;
+}
+
+//  Resume the awaiting coroutine, throwing the exception which left the one
+//  awaited, if any.
+void Coroutine::await_resume() {
+    if (this->_handle.promise().exception)
+        std::rethrow_exception(this->_handle.promise().exception);
+}
+
+//  Go on with the coroutine awaiting the one returned, or back to what resumed
+//  it if none does.
+std::coroutine_handle<> Coroutine::FinalAwaiter::await_suspend(Handle handle) noexcept {
+    const std::coroutine_handle<> continuation = handle.promise().continuation;
+
+    return continuation ? continuation : std::noop_coroutine();
+}
+
+//  Keep the exception for the coroutine awaiting, or log it if none does, as
+//  what resumed the coroutine is the event loop. It is then left returned.
+void Coroutine::promise_type::unhandled_exception() {
+    this->exception = std::current_exception();
+    if (this->continuation)
+        return;
+    try {
+        std::rethrow_exception(this->exception);
+    } catch (const std::exception& excep) {
+        Log::error("Coroutine: uncaught exception: %s", excep.what());
+    } catch (...) {
+        Log::error("Coroutine: uncaught exception");
+    }
+}
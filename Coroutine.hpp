@@ -0,0 +1,69 @@
+#ifndef COROUTINE_HPP_
+#define COROUTINE_HPP_
+
+#include <coroutine>
+#include <exception>
+
+//  Coroutine is a function run by an event loop, which suspends at each
+//  co_await until what it awaits is done, like an event of the EventHandler,
+//  and is resumed by the loop then. It starts suspended: the first one is run
+//  by start(), and one awaited by another by that co_await, which resumes the
+//  awaiting one once it has returned.
+//  An exception leaving it is thrown again to the coroutine awaiting it, or
+//  logged if none does, so it never reaches the event loop resuming it.
+//  Its frame is owned by the Coroutine, and destroyed with it along with the
+//  frames of the Coroutines it awaits. Whatever may resume it must then be
+//  dropped, like the EventContexts it awaits.
+//  - Methods
+//      start: Run the coroutine until it first suspends.
+//      isDone: Whether it has returned.
+class Coroutine {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    //  FinalAwaiter resumes the coroutine awaiting the one returning, if any.
+    struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; };
+        std::coroutine_handle<> await_suspend(Handle handle) noexcept;
+        void await_resume() const noexcept { };
+    };
+
+    //  promise_type is the state of the coroutine kept in its frame.
+    //  - Member variables
+    //      continuation: The coroutine awaiting it, resumed once it returns.
+    //      exception: The exception which left it, thrown again to continuation.
+    //          Kept even if none awaits, once it has been logged.
+    struct promise_type {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        Coroutine get_return_object() { return Coroutine(Handle::from_promise(*this)); };
+        std::suspend_always initial_suspend() const noexcept { return std::suspend_always(); };
+        FinalAwaiter final_suspend() const noexcept { return FinalAwaiter(); };
+        void return_void() const { };
+        void unhandled_exception();
+    };
+
+    Coroutine() : _handle(nullptr) { };
+    Coroutine(Coroutine&& other) noexcept;
+    Coroutine& operator=(Coroutine&& other) noexcept;
+    ~Coroutine();
+
+    void start();
+    bool isDone() const { return !this->_handle || this->_handle.done(); };
+
+    bool await_ready() const noexcept { return false; };
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept;
+    void await_resume();
+
+private:
+    Handle _handle;
+
+    explicit Coroutine(Handle handle) : _handle(handle) { };
+
+    Coroutine(const Coroutine&) = delete;
+    Coroutine& operator=(const Coroutine&) = delete;
+};
+
+#endif  // COROUTINE_HPP_
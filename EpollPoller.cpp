@@ -0,0 +1,239 @@
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "EpollPoller.hpp"
+
+Poller* Poller::create() {
+    return new EpollPoller();
+}
+
+EpollPoller::EpollPoller()
+: _epoll(epoll_create1(EPOLL_CLOEXEC)) {
+    if (_epoll < 0)
+        throw std::logic_error("Cannot create epoll.");
+}
+
+EpollPoller::~EpollPoller() {
+    close(_epoll);
+}
+
+// Watch the condition of fd.
+// epoll sets EPOLLET per fd, so both conditions of fd are edge-triggered once
+// either is added with 'edgeTriggered'.
+//  - Parameters
+//      filter: EF_READ or EF_WRITE
+//      fd: FD number to watch
+//      udata: user data delivered with the event
+//      edgeTriggered: set EPOLLET on fd
+//  - Return(none)
+void EpollPoller::add(int filter, int fd, void* udata, bool edgeTriggered) {
+    InterestMap::iterator iter = _interests.find(fd);
+
+    if (iter == _interests.end()) {
+        Interest interest = { NULL, NULL, true, true, false, false, 0 };
+        iter = _interests.insert(std::make_pair(fd, interest)).first;
+    }
+    setInterest(iter->second, filter, udata);
+    if (edgeTriggered)
+        iter->second.edgeTriggered = true;
+    if (filter == EF_READ)
+        iter->second.readEnabled = true;
+    else
+        iter->second.writeEnabled = true;
+    this->markDirty(fd, iter->second);
+}
+
+// Stop watching the condition of fd.
+//  - Parameters
+//      filter: EF_READ or EF_WRITE
+//      fd: FD number to stop watching
+//  - Return(none)
+void EpollPoller::remove(int filter, int fd) {
+    Interest* const interest = this->findInterest(fd);
+
+    if (interest == NULL)
+        return;
+    setInterest(*interest, filter, NULL);
+    this->markDirty(fd, *interest);
+}
+
+// Resume watching the condition of fd.
+void EpollPoller::enable(int filter, int fd) {
+    Interest* const interest = this->findInterest(fd);
+
+    if (interest == NULL)
+        return;
+    if (filter == EF_READ)
+        interest->readEnabled = true;
+    else
+        interest->writeEnabled = true;
+    this->markDirty(fd, *interest);
+}
+
+// Pause watching the condition of fd.
+void EpollPoller::disable(int filter, int fd) {
+    Interest* const interest = this->findInterest(fd);
+
+    if (interest == NULL)
+        return;
+    if (filter == EF_READ)
+        interest->readEnabled = false;
+    else
+        interest->writeEnabled = false;
+    this->markDirty(fd, *interest);
+}
+
+// Drop both conditions of fd right now, so that fd number can be reused cleanly.
+// CGI children may share the file, so closing it does not always unregister it.
+void EpollPoller::forget(int fd) {
+    InterestMap::iterator iter = _interests.find(fd);
+
+    if (iter == _interests.end())
+        return;
+    if (_regularFiles.erase(fd) == 0 && iter->second.registered != 0)
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, fd, NULL);
+    _interests.erase(iter);
+}
+
+// Apply queued changes, wait for events and split them into Event per filter.
+//  - Return: the number of events appended, -1 on error.
+int EpollPoller::wait(std::vector<Event>& eventlist, int maxEvent, long timeout) {
+    const std::vector<Event>::size_type sizeBefore = eventlist.size();
+
+    this->applyChanges();
+
+    _readyList.resize(maxEvent);
+    ++_syscallCount;
+    const int count = epoll_wait(_epoll, &_readyList[0], maxEvent, _regularFiles.empty() ? timeout : 0);
+    if (count < 0)
+        return -1;
+
+    for (int i = 0; i < count; ++i) {
+        const int fd = _readyList[i].data.fd;
+        const InterestMap::const_iterator iter = _interests.find(fd);
+
+        if (iter != _interests.end())
+            this->appendInterestEvents(eventlist, fd, iter->second, _readyList[i].events);
+    }
+    for (std::set<int>::const_iterator iter = _regularFiles.begin(); iter != _regularFiles.end(); ++iter)
+        this->appendInterestEvents(eventlist, *iter, _interests[*iter], EPOLLIN | EPOLLOUT);
+    return eventlist.size() - sizeBefore;
+}
+
+EpollPoller::Interest* EpollPoller::findInterest(int fd) {
+    InterestMap::iterator iter = _interests.find(fd);
+
+    if (iter == _interests.end())
+        return NULL;
+    return &iter->second;
+}
+
+void EpollPoller::markDirty(int fd, Interest& interest) {
+    if (interest.dirty)
+        return;
+    interest.dirty = true;
+    _dirtyFDs.push_back(fd);
+}
+
+void EpollPoller::applyChanges() {
+    for (std::vector<int>::const_iterator iter = _dirtyFDs.begin(); iter != _dirtyFDs.end(); ++iter)
+        this->applyInterest(*iter);
+    _dirtyFDs.clear();
+}
+
+// Apply final interest of fd to epoll.
+// epoll refuses regular files with EPERM. Those are always ready as kqueue reports.
+// A failed interest is dropped, as kqueue drops a failed change.
+void EpollPoller::applyInterest(int fd) {
+    const InterestMap::iterator iter = _interests.find(fd);
+    if (iter == _interests.end() || !iter->second.dirty)
+        return;
+
+    Interest& interest = iter->second;
+    const uint32_t events = eventsOf(interest);
+
+    interest.dirty = false;
+    if (_regularFiles.find(fd) != _regularFiles.end()) {
+        if (interest.read == NULL && interest.write == NULL) {
+            _regularFiles.erase(fd);
+            _interests.erase(iter);
+        }
+        return;
+    }
+    if (events == interest.registered) {
+        if (interest.read == NULL && interest.write == NULL)
+            _interests.erase(iter);
+        return;
+    }
+
+    int error;
+    if (events == 0)
+        error = this->controlInterest(EPOLL_CTL_DEL, fd, 0);
+    else if (interest.registered == 0) {
+        error = this->controlInterest(EPOLL_CTL_ADD, fd, events);
+        if (error == EEXIST)
+            error = this->controlInterest(EPOLL_CTL_MOD, fd, events);
+    }
+    else {
+        error = this->controlInterest(EPOLL_CTL_MOD, fd, events);
+        if (error == ENOENT)
+            error = this->controlInterest(EPOLL_CTL_ADD, fd, events);
+    }
+    interest.registered = events;
+    if (error == EPERM)
+        _regularFiles.insert(fd);
+    else if ((error != 0 && events != 0) || (interest.read == NULL && interest.write == NULL))
+        _interests.erase(iter);
+}
+
+//  - Return: 0 on success, errno otherwise.
+int EpollPoller::controlInterest(int operation, int fd, uint32_t events) {
+    struct epoll_event ev;
+
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    ++_syscallCount;
+    if (epoll_ctl(_epoll, operation, fd, &ev) < 0)
+        return errno;
+    return 0;
+}
+
+void EpollPoller::appendInterestEvents(std::vector<Event>& eventlist, int fd, const Interest& interest, uint32_t events) {
+    Event event;
+
+    event.ident = fd;
+    event.data = 0;
+    event.buffer = NULL;
+    if (interest.read != NULL && interest.readEnabled
+        && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        event.filter = EF_READ;
+        event.udata = interest.read;
+        eventlist.push_back(event);
+    }
+    if (interest.write != NULL && interest.writeEnabled
+        && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+        event.filter = EF_WRITE;
+        event.udata = interest.write;
+        eventlist.push_back(event);
+    }
+}
+
+void EpollPoller::setInterest(Interest& interest, int filter, void* udata) {
+    if (filter == EF_READ)
+        interest.read = udata;
+    else
+        interest.write = udata;
+}
+
+uint32_t EpollPoller::eventsOf(const Interest& interest) {
+    uint32_t events = 0;
+
+    if (interest.read != NULL && interest.readEnabled)
+        events |= EPOLLIN | EPOLLRDHUP;
+    if (interest.write != NULL && interest.writeEnabled)
+        events |= EPOLLOUT;
+    if (events != 0 && interest.edgeTriggered)
+        events |= EPOLLET;
+    return events;
+}
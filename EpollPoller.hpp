@@ -0,0 +1,62 @@
+#ifndef EPOLLPOLLER_HPP_
+#define EPOLLPOLLER_HPP_
+
+#include <sys/epoll.h>
+#include <map>
+#include <set>
+#include <vector>
+#include "Poller.hpp"
+
+//  Poller backend using epoll. (Linux)
+//  epoll has a single registration per fd, so read/write interests of a fd are
+//  merged here and split again when the fd becomes ready.
+//  Changes only mark the fd dirty. The final interest of each dirty fd is applied
+//  with at most one epoll_ctl() right before epoll_wait().
+//  - Member variables
+//      _epoll: FD number of epoll instance.
+//      _interests: registered read/write user data per fd.
+//      _dirtyFDs: fds whose interest changed since last wait().
+//      _regularFiles: fds which epoll refuses (regular files), always ready.
+//      _readyList: buffer to receive triggered epoll events.
+class EpollPoller : public Poller {
+public:
+    EpollPoller();
+    virtual ~EpollPoller();
+
+    virtual void add(int filter, int fd, void* udata, bool edgeTriggered);
+    virtual void remove(int filter, int fd);
+    virtual void enable(int filter, int fd);
+    virtual void disable(int filter, int fd);
+    virtual void forget(int fd);
+    virtual int wait(std::vector<Event>& eventlist, int maxEvent, long timeout);
+
+private:
+    struct Interest {
+        void* read;
+        void* write;
+        bool readEnabled;
+        bool writeEnabled;
+        bool dirty;
+        bool edgeTriggered;
+        uint32_t registered;
+    };
+    typedef std::map<int, Interest> InterestMap;
+
+    const int _epoll;
+    InterestMap _interests;
+    std::vector<int> _dirtyFDs;
+    std::set<int> _regularFiles;
+    std::vector<struct epoll_event> _readyList;
+
+    Interest* findInterest(int fd);
+    void markDirty(int fd, Interest& interest);
+    void applyChanges();
+    void applyInterest(int fd);
+    int controlInterest(int operation, int fd, uint32_t events);
+    void appendInterestEvents(std::vector<Event>& eventlist, int fd, const Interest& interest, uint32_t events);
+
+    static void setInterest(Interest& interest, int filter, void* udata);
+    static uint32_t eventsOf(const Interest& interest);
+};
+
+#endif  // EPOLLPOLLER_HPP_
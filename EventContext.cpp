@@ -3,10 +3,14 @@
 EventContext::EventContext(int fd, EventType type, void* data)
 : _eventIdent(fd)
 , _eventType(type)
-, _data(data) {
+, _data(data)
+, _released(false)
+, _awaiter(NULL)
+, _pending(false)
+, _paused(false) {
 	this->setPipe(-1, -1);
 }
-// Convert event type(enum -> string) 
+// Convert event type(enum -> string)
 std::string EventContext::eventTypeToString(EventType type) {
 	switch (type) {
 	case EV_Accept:
@@ -23,16 +27,49 @@ std::string EventContext::eventTypeToString(EventType type) {
 		return "EV_CGIParamBody";
 	case EV_CGIResponse:
 		return "EV_CGIResponse";
+	case EV_CGIExit:
+		return "EV_CGIExit";
     case EV_SetVirtualServerErrorPage:
         return "EV_SetVirtualServerErrorPage";
-    case EV_GETResponse:
-        return "EV_GETResponse";
-    case EV_POSTResponse:
-        return "EV_POSTResponse";
+    case EV_FileIOComplete:
+        return "EV_FileIOComplete";
+	case EV_Signal:
+		return "EV_Signal";
+	case EV_Shutdown:
+		return "EV_Shutdown";
+	case EV_Count:
+		break;
 	}
+	return "";
 }
 
 void EventContext::setPipe(int readPipe, int writePipe) {
 	_pipe[0] = readPipe;
 	_pipe[1] = writePipe;
-}
\ No newline at end of file
+}
+
+// Take the coroutine awaiting the next event, to resume it.
+//  - Return: Its awaiter, NULL if none awaits.
+EventAwaiter* EventContext::takeAwaiter() {
+	EventAwaiter* awaiter = _awaiter;
+
+	_awaiter = NULL;
+	return awaiter;
+}
+
+// Take the event which came while none awaited it.
+//  - Parameters event: Set to the event, if any.
+//  - Return: Whether one was kept.
+bool EventContext::takePendingEvent(Event& event) {
+	if (!_pending)
+		return false;
+	_pending = false;
+	event = _pendingEvent;
+	return true;
+}
+
+// Keep an event none awaited, replacing the one kept before.
+void EventContext::setPendingEvent(const Event& event) {
+	_pending = true;
+	_pendingEvent = event;
+}
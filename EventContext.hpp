@@ -2,7 +2,25 @@
 #define EVENTCONTEXT_HPP_
 
 #include <string>
+#include "Poller.hpp"
 
+class EventAwaiter;
+
+//  EventContext is a watch of an EventHandler, delivered with its events. The
+//  coroutine awaiting its next event, if any, is resumed with it.
+//  An event which comes while none awaits it is kept for the next one, and the
+//  watch paused until then, so a level-triggered poller does not report it
+//  again and again.
+//  - Member variables
+//      _eventIdent: the fd watched.
+//      _eventType: what the fd is to its owner, and the kind of its dispatches
+//          in the loop metrics.
+//      _pipe: the ends of a pipe the context owns, closed as it is removed.
+//      _data: the owner.
+//      _released: released by EventHandler::releaseContext().
+//      _awaiter: the coroutine awaiting its next event.
+//      _pending: an event came while none awaited it, kept in _pendingEvent.
+//      _paused: the watch is paused until a coroutine awaits it.
 class EventContext {
 public:
 	enum EventType {
@@ -12,35 +30,44 @@ public:
 		EV_ProcessRequest,
 		EV_CGIParamBody,
 		EV_CGIResponse,
-        EV_GETResponse,
-        EV_POSTResponse,
+		EV_CGIExit,
+        EV_FileIOComplete,
 		EV_Response,
 		EV_DisposeConn,
-	};
-	enum EventResult {
-		ER_Done,
-		ER_Remove,
-		ER_Continue,
-		ER_NA,
+		EV_Signal,
+		EV_Shutdown,
+		EV_Count,
 	};
 
 	EventContext(int fd, EventType type, void* data);
 
 	int getIdent() { return _eventIdent; };
 	EventType getEventType() { return _eventType; };
-	std::string eventTypeToString(EventType type);
+	static std::string eventTypeToString(EventType type);
 	std::string getEventTypeToString() { return this->eventTypeToString(_eventType); };
 	void* getData() { return _data; };
 	int getReadPipe() { return _pipe[0]; };
 	int getWritePipe() { return _pipe[1]; };
-	// void setData(void* data) { };
 	void setPipe(int readPipe, int writePipe);
+	bool isReleased() { return _released; };
+	void setReleased() { _released = true; };
+	EventAwaiter* takeAwaiter();
+	void setAwaiter(EventAwaiter* awaiter) { _awaiter = awaiter; };
+	bool takePendingEvent(Event& event);
+	void setPendingEvent(const Event& event);
+	bool isPaused() { return _paused; };
+	void setPaused(bool paused) { _paused = paused; };
 
 private:
 	int _eventIdent;
 	EventType	_eventType;
 	int _pipe[2];
 	void* _data;
+	bool _released;
+	EventAwaiter* _awaiter;
+	bool _pending;
+	Event _pendingEvent;
+	bool _paused;
 };
 
 #endif
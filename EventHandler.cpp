@@ -1,118 +1,476 @@
+#include <algorithm>
+#include <cstring>
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
 #include "EventHandler.hpp"
 #include "constant.hpp"
 
 EventHandler::EventHandler()
-: _kqueue(kqueue())
-, _maxEvent(MaxEventNumber)
-, _connectionDeleted(false) {
-	if (_kqueue < 0)
-		throw std::logic_error("Cannot create EventHandler.");
+: _poller(Poller::create())
+, _maxEvent(DEFAULT_MAX_EVENTS)
+, _minEvent(MinEventNumber)
+, _lowWaitCount(0)
+, _edgeTriggered(false)
+, _busyPoll(0)
+, _timerWheel(TIMER_RESOLUTION, _clock.getMilliseconds())
+, _contextPool(POOL_SLAB_SIZE, CONTEXT_POOL_PREALLOC) {
+	_stats.iterations = 0;
+	_stats.events = 0;
+	_stats.fullBatches = 0;
+	_stats.maxEventsPerWait = 0;
+	_stats.batchSize = _minEvent;
+	_stats.busyPolls = 0;
+	_stats.busyPollHits = 0;
 }
 
 EventHandler::~EventHandler() {
-	close(_kqueue);
+	delete _poller;
 }
 
-// Add new event on Kqueue
+// Set the most events taken from a wait. ('max_events' directive)
+// The batch starts from the smaller of it and MinEventNumber.
 //  - Parameters
-//      kqueue: FD number of Kqueue
-//      filter: filter value for Kevent
-//      udata: user data (optional)
+//      maxEvent: The most events taken from a wait, 1 at least.
 //  - Return(none)
+void EventHandler::setMaxEvent(int maxEvent) {
+	_maxEvent = maxEvent;
+	_minEvent = std::min(static_cast<int>(MinEventNumber), maxEvent);
+	_stats.batchSize = _minEvent;
+	_lowWaitCount = 0;
+}
+
+// Add new event on the poller
+//  - Parameters
+//      filter: filter value for the event
+//      fd: FD number to watch
+//      type: type of EventContext
+//      data: user data (optional)
+//  - Return: EventContext registered with the event
 EventContext* EventHandler::addEvent(int filter, int fd, EventContext::EventType type, void* data) {
-	struct kevent ev;
-	EventContext* context = new EventContext(fd, type ,data);
+	EventContext* context = this->newContext(fd, type, data);
 
-    EV_SET(&ev, fd, filter, EV_ADD | EV_ENABLE, 0, 0, context);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0) {
-		delete context;
-        throw std::runtime_error("Event add Failure.");
+	try {
+		_poller->add(this->watchFilter(filter, type), fd, context, this->isDrainedEvent(filter, type));
+	} catch (const std::runtime_error&) {
+		this->releaseContext(context);
+		throw;
 	}
 	return context;
 }
-// Add new event on Kqueue(CGI case)
+// Make an EventContext watched by no event yet, like that of the messages sent
+// by send(). It is freed with releaseContext().
+//  - Parameters
+//      fd: FD number of the context
+//      type: type of EventContext
+//      data: user data (optional)
+//  - Return: the EventContext
+EventContext* EventHandler::addContext(int fd, EventContext::EventType type, void* data) {
+	return this->newContext(fd, type, data);
+}
+
+// Watch the exit of the child process 'pid', awaited by childExit(). On Linux
+// its pidfd is watched for EF_READ, and owned by the context; elsewhere the
+// process itself for EF_EXIT. The pidfd is opened close-on-exec.
+//  - Parameters
+//      pid: The child process.
+//      type: type of EventContext
+//      data: user data (optional)
+//  - Return: EventContext registered with the event, NULL if the process has
+//      exited already, or cannot be watched.
+EventContext* EventHandler::addProcessEvent(pid_t pid, EventContext::EventType type, void* data) {
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	const int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	int pipe[2] = { pidfd, -1 };
+
+	if (pidfd < 0)
+		return NULL;
+	try {
+		return this->addEvent(EF_READ, pidfd, type, data, pipe);
+	} catch (const std::runtime_error&) {
+		close(pidfd);
+		throw;
+	}
+#elif defined(__linux__)
+	(void)pid;
+	(void)type;
+	(void)data;
+	return NULL;
+#else
+	return this->addEvent(EF_EXIT, pid, type, data);
+#endif
+}
+
+// Add new event on the poller(CGI case)
 EventContext* EventHandler::addEvent(int filter, int fd, EventContext::EventType type, void* data, int pipe[2]) {
-	struct kevent ev;
-	EventContext* context = new EventContext(fd, type ,data);
+	EventContext* context = this->newContext(fd, type, data);
 
 	context->setPipe(pipe[0], pipe[1]);
-    EV_SET(&ev, fd, filter, EV_ADD | EV_ENABLE, 0, 0, context);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0) {
-		delete context;
-        throw std::runtime_error("Event add Failure.");
+	try {
+		_poller->add(filter, fd, context, this->isDrainedEvent(filter, type));
+	} catch (const std::runtime_error&) {
+		this->releaseContext(context);
+		throw;
 	}
 	return context;
 }
 
-// Remove existing event on Kqueue
+// Remove existing event on the poller
+// CGI pipes, pidfds and files owned by the event are closed after removal.
 //  - Parameters
-//      kqueue: FD number of Kqueue
-//      filter: filter value for Kevent to remove
-//      udata: user data (optional)
+//      filter: filter value for the event to remove
+//      context: EventContext registered with the event
 //  - Return(none)
 void EventHandler::removeEvent(int filter, EventContext* context) {
-	struct kevent ev;
 	EventContext::EventType eventType = context->getEventType();
 	int fd = context->getIdent();
 
-	if (eventType == EventContext::EV_CGIParamBody ||
-		eventType == EventContext::EV_CGIResponse) {
-        close(context->getReadPipe());
-        close(context->getWritePipe());
+	if (eventType == EventContext::EV_CGIExit && context->getReadPipe() == -1)
+		_poller->remove(EF_EXIT, fd);
+	else if (eventType == EventContext::EV_CGIParamBody ||
+		eventType == EventContext::EV_CGIResponse ||
+		eventType == EventContext::EV_CGIExit) {
+		_poller->forget(fd);
+        if (context->getReadPipe() != -1)
+            close(context->getReadPipe());
+        if (context->getWritePipe() != -1)
+            close(context->getWritePipe());
 		Log::verbose("CGI pipe closed. [%s] [%d] [%d]", context->getEventTypeToString().c_str(), context->getReadPipe(), context->getWritePipe());
-	} else {
-		EV_SET(&ev, fd, filter, EV_DELETE, 0, 0, context);
-		if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0)
-			throw std::runtime_error("RemoveEvent Failed.");
+	} else if (eventType == EventContext::EV_SetVirtualServerErrorPage) {
+		_poller->forget(fd);
+		close(fd);
+	} else
+		_poller->remove(this->watchFilter(filter, eventType), fd);
+	this->releaseContext(context);
+}
+
+// Enable the event disabled by removeEvent()
+//  - Parameters
+//      filter: filter value for the event to enable
+//      context: EventContext registered with the event
+//  - Return(none)
+void EventHandler::enableEvent(int filter, EventContext* context) {
+	_poller->enable(this->watchFilter(filter, context->getEventType()), context->getIdent());
+}
+
+// Pause the event, keeping it registered, until enableEvent()
+//  - Parameters
+//      filter: filter value for the event to disable
+//      context: EventContext registered with the event
+//  - Return(none)
+void EventHandler::disableEvent(int filter, EventContext* context) {
+	_poller->disable(this->watchFilter(filter, context->getEventType()), context->getIdent());
+}
+
+// Pause the event until a coroutine awaits it again, which enables it.
+//  - Parameters
+//      filter: filter value for the event to pause
+//      context: EventContext registered with the event
+//  - Return(none)
+void EventHandler::pauseEvent(int filter, EventContext* context) {
+	if (context == NULL || context->isPaused())
+		return;
+	this->disableEvent(filter, context);
+	context->setPaused(true);
+}
+
+// Send the message on the socket of context, done by the poller and reported
+// as EF_SENT. Only with a completion based poller. Awaited through send().
+//  - Parameters
+//      context: EventContext the EF_SENT event is delivered with
+//      message: the message, untouched until then
+//  - Return(none)
+void EventHandler::submitSend(EventContext* context, struct msghdr* message) {
+	_poller->send(context->getIdent(), message, context);
+}
+
+// Await the exit of the process watched by context, from addProcessEvent().
+//  - Parameters context: EventContext of the process, NULL if it has exited.
+//  - Return: The awaiter.
+EventAwaiter EventHandler::childExit(EventContext* context) {
+#if defined(__linux__)
+	return EventAwaiter(*this, context, EF_READ);
+#else
+	return EventAwaiter(*this, context, EF_EXIT);
+#endif
+}
+
+// Resume the coroutine awaiting the event. An event none awaits is kept in its
+// context, and the watch paused unless it is edge-triggered, as a level-triggered
+// poller would report it again and again. The bytes of EF_RECEIVED have been
+// taken already, so it is dropped instead.
+//  - Parameters event: the event, of a context not released.
+//  - Return(none)
+void EventHandler::resume(const Event& event) {
+	EventContext* context = static_cast<EventContext*>(event.udata);
+	EventAwaiter* awaiter = context->takeAwaiter();
+
+	if (awaiter != NULL) {
+		awaiter->resume(event);
+		return;
 	}
-    if (context->getEventType() != EventContext::EV_Request)
-        delete context;
+	if (event.filter == EF_RECEIVED)
+		return;
+	context->setPendingEvent(event);
+	if (context->isPaused() || this->isDrainedEvent(event.filter, context->getEventType()))
+		return;
+	_poller->disable(event.filter, context->getIdent());
+	context->setPaused(true);
+}
+
+// Drop every event watched on fd. Must be called before fd is closed.
+//  - Parameters
+//      fd: FD number to be closed
+//  - Return(none)
+void EventHandler::clearEvents(int fd) {
+	_poller->forget(fd);
 }
 
-// Add custom event on Kqueue (triggered just for 1 time)
+// Queue a task to run at the end of this loop iteration
 //  - Parameters
-//      context: EventContext for event
+//      ident: socket of the connection
+//      generation: generation of the connection in the connection table
+//      type: EV_ProcessRequest or EV_DisposeConn
+//      waiter: EV_ProcessRequest: the coroutine to resume
 //  - Return(none)
-EventContext* EventHandler::addUserEvent(int fd, EventContext::EventType type, void* data) {
-	struct kevent ev;
-	EventContext* context = new EventContext(fd, type ,data);
+void EventHandler::addTask(int ident, unsigned int generation, EventContext::EventType type, std::coroutine_handle<> waiter) {
+	Task task;
 
-    EV_SET(&ev, fd, EVFILT_USER, EV_ADD | EV_ONESHOT, NOTE_TRIGGER, 0, context);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0)
-        throw std::runtime_error("AddEvent(Oneshot flagged) Failed.");
-	return context;
+	task.type = type;
+	task.ident = ident;
+	task.generation = generation;
+	task.waiter = waiter;
+	_tasks.push_back(task);
 }
-// Check a number of event in kqueue
-int EventHandler::checkEvent(struct kevent* eventlist) {
-	return kevent(this->_kqueue, NULL, 0, eventlist, _maxEvent, NULL);
+
+// Take the task queued first
+//  - Parameters
+//      task: the task taken, to be skipped if its connection is gone
+//  - Return: false if no task is queued
+bool EventHandler::takeTask(Task& task) {
+	if (_tasks.empty())
+		return false;
+	task = _tasks.front();
+	_tasks.pop_front();
+	return true;
 }
 
-// Add a Timeout event
-void EventHandler::addTimeoutEvent(EventContext* context) {
-    struct kevent ev;
-	int fd = context->getIdent();
+// Free the EventContext returned by addEvent().
+// It is marked released and given back on the next checkEvent(), so the events
+// of it left in the list being dispatched or to continue are found stale.
+//  - Parameters
+//      context: EventContext to free (NULL is ignored)
+//  - Return(none)
+void EventHandler::releaseContext(EventContext* context) {
+	if (context == NULL || context->isReleased())
+		return;
+	context->setReleased();
+	_releasedContexts.push_back(context);
+}
 
-    EV_SET(&ev, fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, TIMEOUT, context);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0)
-        throw std::runtime_error("AddEvent(timeout) Failed.");
+// Give the contexts released back to the pool, dropping their events to
+// continue first.
+void EventHandler::destroyReleasedContexts() {
+	if (_releasedContexts.empty())
+		return;
+	_postedEvents.erase(std::remove_if(_postedEvents.begin(), _postedEvents.end(), EventHandler::isStale), _postedEvents.end());
+	for (std::vector<EventContext*>::iterator iter = _releasedContexts.begin(); iter != _releasedContexts.end(); ++iter)
+		_contextPool.destroy(*iter);
+	_releasedContexts.clear();
+}
+
+// Drive the event again on next check, as its handler stopped before draining
+// the fd. Events watched level-triggered are reported again by the poller.
+//  - Parameters
+//      event: the event whose handler stopped by its budget
+//  - Return(none)
+void EventHandler::continueEvent(const Event& event) {
+	EventContext* context = static_cast<EventContext*>(event.udata);
+
+	if (!this->isDrainedEvent(event.filter, context->getEventType()))
+		return;
+
+	Event posted = event;
+
+	posted.data = 0;
+	_postedEvents.push_back(posted);
+}
+
+// Check a number of event in the poller
+// The poller sleeps until the next timeout at most, or does not sleep with
+// events to continue or tasks queued. Events to continue and expired timeouts
+// follow the events of the poller. The clock is updated once on wakeup. The
+// contexts released while dispatching the last list are given back first.
+//  - Return: the number of events, -1 on error.
+int EventHandler::checkEvent(std::vector<Event>& eventlist) {
+	this->destroyReleasedContexts();
+	eventlist.clear();
+	const long timeout = (_postedEvents.empty() && _tasks.empty()) ? _timerWheel.nextTimeout(_clock.getMilliseconds()) : 0;
+	const int count = this->wait(eventlist, timeout);
+
+	_clock.update();
+
+	if (count >= 0)
+		this->adaptBatchSize(count);
+	eventlist.insert(eventlist.end(), _postedEvents.begin(), _postedEvents.end());
+	_postedEvents.clear();
+	this->appendTimeoutEvents(eventlist);
+	if (count < 0 && eventlist.empty())
+		return -1;
+	return eventlist.size();
+}
+
+// Wait for events on the poller. A wait which could sleep polls without blocking
+// first, until events come or the busy poll time or 'timeout' runs out, and
+// sleeps for the rest of 'timeout' only then.
+//  - Parameters
+//      eventlist: The events are appended to it.
+//      timeout: milliseconds to wait at most, -1 for no limit.
+//  - Return: The number of events, -1 on error.
+int EventHandler::wait(std::vector<Event>& eventlist, long timeout) {
+	if (_busyPoll <= 0 || timeout == 0)
+		return _poller->wait(eventlist, _stats.batchSize, timeout);
+
+	const long start = LoopClock::readMicroseconds();
+	const long spin = (timeout < 0) ? _busyPoll : std::min(_busyPoll, timeout * 1000);
+	long elapsed = 0;
+
+	do {
+		const int count = _poller->wait(eventlist, _stats.batchSize, 0);
+
+		++_stats.busyPolls;
+		if (count != 0) {
+			if (count > 0)
+				++_stats.busyPollHits;
+			return count;
+		}
+		elapsed = LoopClock::readMicroseconds() - start;
+	} while (elapsed < spin);
+	if (timeout > 0)
+		timeout = std::max(0L, timeout - elapsed / 1000);
+	return _poller->wait(eventlist, _stats.batchSize, timeout);
+}
+
+// Whether the event is watched edge-triggered, to be drained by its handler.
+bool EventHandler::isDrainedEvent(int filter, EventContext::EventType type) {
+	return _edgeTriggered && filter == EF_READ
+		&& (type == EventContext::EV_Request || type == EventContext::EV_CGIResponse);
+}
+
+// The filter the event is watched with on the poller. With a completion based
+// poller, the reads of listening and client sockets are its accepts and
+// receives, and their handlers take the result.
+int EventHandler::watchFilter(int filter, EventContext::EventType type) {
+	if (filter != EF_READ || !_poller->isCompletionBased())
+		return filter;
+	if (type == EventContext::EV_Accept)
+		return EF_ACCEPTED;
+	if (type == EventContext::EV_Request)
+		return EF_RECEIVED;
+	return filter;
+}
+
+// Build an EventContext on the storage of the pool.
+EventContext* EventHandler::newContext(int fd, EventContext::EventType type, void* data) {
+	return new (_contextPool.allocate()) EventContext(fd, type, data);
+}
+
+// Count a wait which took 'count' events and resize the batch for next wait.
+// A full batch means more events are left ready, so the batch is doubled at once.
+// It is halved only after a streak of waits using less than a quarter of it.
+void EventHandler::adaptBatchSize(int count) {
+	++_stats.iterations;
+	_stats.events += count;
+	_stats.maxEventsPerWait = std::max(_stats.maxEventsPerWait, count);
+	if (count >= _stats.batchSize) {
+		++_stats.fullBatches;
+		_lowWaitCount = 0;
+		if (_stats.batchSize < _maxEvent) {
+			_stats.batchSize = std::min(_stats.batchSize * 2, _maxEvent);
+			Log::verbose("Event batch size grown to %d", _stats.batchSize);
+		}
+	} else if (count < _stats.batchSize / 4 && _stats.batchSize > _minEvent) {
+		if (++_lowWaitCount >= ShrinkStreak) {
+			_lowWaitCount = 0;
+			_stats.batchSize = std::max(_stats.batchSize / 2, _minEvent);
+			Log::verbose("Event batch size shrunk to %d", _stats.batchSize);
+		}
+	} else
+		_lowWaitCount = 0;
+}
+
+// Arm a timeout. Adding an armed timeout again restarts it.
+//  - Parameters
+//      timer: The timeout, set with ident, kind and user data delivered.
+//      milliseconds: Time until the timeout expires.
+//  - Return(none)
+void EventHandler::addTimeoutEvent(TimerWheel::Timer& timer, long milliseconds) {
+	_timerWheel.arm(timer, milliseconds, _clock.getMilliseconds());
+}
+
+// Disarm a timeout
+void EventHandler::deleteTimeoutEvent(TimerWheel::Timer& timer) {
+	_timerWheel.cancel(timer);
+}
+
+// Deliver timeouts expired as EF_TIMER events.
+void EventHandler::appendTimeoutEvents(std::vector<Event>& eventlist) {
+	_timerWheel.advance(_clock.getMilliseconds(), _expiredTimers);
+	for (std::vector<TimerWheel::Timer*>::const_iterator iter = _expiredTimers.begin();
+		iter != _expiredTimers.end(); ++iter) {
+		Event event;
+
+		event.ident = (*iter)->getIdent();
+		event.filter = EF_TIMER;
+		event.data = (*iter)->getKind();
+		event.udata = (*iter)->getUData();
+		event.buffer = NULL;
+		eventlist.push_back(event);
+	}
+	_expiredTimers.clear();
+}
+
+EventAwaiter::EventAwaiter(EventHandler& eventHandler, EventContext* context, int filter, struct msghdr* message)
+: _eventHandler(eventHandler)
+, _context(context)
+, _filter(filter)
+, _message(message) {
+	std::memset(&_event, 0, sizeof(_event));
+}
+
+// Whether the event has come already, to go on without suspending.
+bool EventAwaiter::await_ready() {
+	if (_context == NULL)
+		return true;
+	return _message == NULL && _context->takePendingEvent(_event);
+}
+
+// Wait for the event: send the message, or enable the watch paused, and let
+// the context resume 'handle' with its next event.
+void EventAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	_handle = handle;
+	if (_message != NULL)
+		_eventHandler.submitSend(_context, _message);
+	else if (_context->isPaused()) {
+		_eventHandler.enableEvent(_filter, _context);
+		_context->setPaused(false);
+	}
+	_context->setAwaiter(this);
+}
+
+// Resume the coroutine with the event. The awaiter may be gone once it returns.
+void EventAwaiter::resume(const Event& event) {
+	_event = event;
+	_handle.resume();
 }
-// Add an event to reset a timeout event
-void EventHandler::resetTimeoutEvent(EventContext* context) {
-    struct kevent ev;
-	int fd = context->getIdent();
 
-    EV_SET(&ev, fd, EVFILT_TIMER, EV_DELETE, 0, TIMEOUT, context);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0)
-        throw std::runtime_error("AddEvent(timeout reset) Failed.");
-    EV_SET(&ev, fd, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, TIMEOUT, context);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0)
-        throw std::runtime_error("AddEvent(timeout reset) Failed.");
+// Let the waiter of the job be resumed once it has been run.
+void FileJobAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	_job->waiter = handle;
+	_pool.submit(_job);
 }
-// Add an event to delete a timeout event
-void EventHandler::deleteTimeoutEvent(int fd) {
-    struct kevent ev;
 
-    EV_SET(&ev, fd, EVFILT_TIMER, EV_DELETE, 0, TIMEOUT, 0);
-    if (kevent(_kqueue, &ev, 1, 0, 0, 0) < 0)
-        throw std::runtime_error("AddEvent(timeout delete) Failed.");
+// Resume the coroutine at the end of the loop iteration.
+void TaskAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	_eventHandler.addTask(_ident, _generation, EventContext::EV_ProcessRequest, handle);
 }
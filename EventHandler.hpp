@@ -2,11 +2,109 @@
 #define EVENTHANDLER_HPP_
 
 #include <unistd.h>
-#include <sys/event.h>
+#include <sys/types.h>
+#include <vector>
+#include <deque>
 #include <exception>
+#include <coroutine>
 #include "Log.hpp"
+#include "Poller.hpp"
+#include "LoopClock.hpp"
+#include "TimerWheel.hpp"
+#include "ObjectPool.hpp"
 #include "EventContext.hpp"
+#include "FileIOPool.hpp"
 
+class EventHandler;
+
+//  EventAwaiter suspends a coroutine until the next event of an EventContext,
+//  which resumes it and is the result of its co_await. An event which came
+//  while none awaited it is taken at once, and a watch paused since is enabled
+//  again. With a message, the message is sent first, and the coroutine resumed
+//  by its EF_SENT.
+//  Awaiting a NULL context is done at once, with an empty event.
+class EventAwaiter {
+public:
+	EventAwaiter(EventHandler& eventHandler, EventContext* context, int filter, struct msghdr* message = NULL);
+
+	bool await_ready();
+	void await_suspend(std::coroutine_handle<> handle);
+	Event await_resume() const { return _event; };
+	void resume(const Event& event);
+
+private:
+	EventHandler& _eventHandler;
+	EventContext* _context;
+	int _filter;
+	struct msghdr* _message;
+	std::coroutine_handle<> _handle;
+	Event _event;
+};
+
+//  FileJobAwaiter submits a FileJob to its pool and suspends the coroutine
+//  until the job has been run, when the event loop resumes the waiter of it.
+class FileJobAwaiter {
+public:
+	FileJobAwaiter(FileIOPool& pool, FileJob* job) : _pool(pool), _job(job) { };
+
+	bool await_ready() const { return false; };
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() const { };
+
+private:
+	FileIOPool& _pool;
+	FileJob* _job;
+};
+
+//  TaskAwaiter suspends a coroutine until the end of the loop iteration, where
+//  it is resumed as a Task of its connection.
+class TaskAwaiter {
+public:
+	TaskAwaiter(EventHandler& eventHandler, int ident, unsigned int generation)
+	: _eventHandler(eventHandler), _ident(ident), _generation(generation) { };
+
+	bool await_ready() const { return false; };
+	void await_suspend(std::coroutine_handle<> handle);
+	void await_resume() const { };
+
+private:
+	EventHandler& _eventHandler;
+	int _ident;
+	unsigned int _generation;
+};
+
+//  EventHandler dispatches the events of a Poller with the EventContext of each.
+//  Timeouts are kept on a TimerWheel here rather than in the kernel. The wait of
+//  the poller is bounded by the next timeout and expired timers are delivered as
+//  EF_TIMER events, with the kind of timeout as data. Their time is the LoopClock
+//  updated on each wakeup, which is shared with the handlers through getClock().
+//  The number of events taken from a wait adapts to the load: it doubles when a
+//  wait fills the batch, and halves after ShrinkStreak waits filling less than a
+//  quarter of it, between MinEventNumber and the configured maximum.
+//  EventContexts are allocated from a pool of this event loop and must be freed
+//  with releaseContext(). A context released is only marked so, and given back
+//  to the pool on the next checkEvent(), so the events of it left in the list
+//  being dispatched are found stale by isStale() and must be skipped. The loop
+//  calls endDispatch() once it stops dispatching.
+//  In edge-triggered mode, reads of client sockets and CGI outputs are watched
+//  edge-triggered. Their handlers drain the fd, and one stopped by its budget
+//  is driven again through continueEvent(), as the poller won't report it.
+//  Work for this thread itself, like processing a request or closing a
+//  connection, is queued as a Task in userspace and run at the end of the loop
+//  iteration, rather than notified through the kernel.
+//  The owners of the events are coroutines, which co_await the next event of a
+//  context: readable(), writable(), fileRead() of a FileJob, childExit() of a
+//  CGI process, or defer() to the end of the loop iteration. The loop resumes
+//  them with resume(). An event none awaits is kept in its context, and its
+//  watch paused unless it is edge-triggered, until a coroutine awaits it.
+//  With a completion based poller, the client sockets are accepted, read and
+//  written by the kernel: the read events of listening and client sockets are
+//  delivered as EF_ACCEPTED and EF_RECEIVED with their results, and send()
+//  reports EF_SENT. The bytes of EF_RECEIVED are taken before the coroutine
+//  is resumed, so one none awaits is dropped rather than kept.
+//  With busy polling, a wait which could sleep first polls the poller without
+//  blocking for up to the busy poll time, trading a core for the latency of the
+//  sleep and wakeup.
 class EventHandler {
 public:
 	enum {
@@ -14,29 +112,119 @@ public:
 		CGIResponse,
 	};
 
+	//  LoopStats counts the waits of the event loop to tune the batch size.
+	//  - Member variables
+	//      iterations: The number of waits.
+	//      events: The number of events taken from the poller.
+	//      fullBatches: The number of waits which filled the batch.
+	//      maxEventsPerWait: The most events taken from a wait.
+	//      batchSize: The current number of events taken from a wait at most.
+	//      busyPolls: The number of polls without blocking while busy polling.
+	//      busyPollHits: The number of waits which found events busy polling.
+	struct LoopStats {
+		unsigned long iterations;
+		unsigned long events;
+		unsigned long fullBatches;
+		int maxEventsPerWait;
+		int batchSize;
+		unsigned long busyPolls;
+		unsigned long busyPollHits;
+	};
+
+	//  Task is a work deferred to the end of the loop iteration.
+	//  - Member variables
+	//      type: EV_ProcessRequest or EV_DisposeConn.
+	//      ident: The socket of the connection.
+	//      generation: The generation of the connection in the connection table,
+	//          by which a task of a connection closed since is found stale.
+	//      waiter: EV_ProcessRequest: The coroutine of the connection to resume.
+	struct Task {
+		EventContext::EventType type;
+		int ident;
+		unsigned int generation;
+		std::coroutine_handle<> waiter;
+	};
+
 	EventHandler();
 	~EventHandler();
 
-	int getKqueue() { return _kqueue; };
 	int getMaxEvent() { return _maxEvent; };
-	bool isConnectionDeleted() { return _connectionDeleted; };
-	void setConnectionDeleted(bool set) { _connectionDeleted = set; };
+	void setMaxEvent(int maxEvent);
+	bool isEdgeTriggered() { return _edgeTriggered; };
+	void setEdgeTriggered(bool set) { _edgeTriggered = set; };
+	long getBusyPoll() { return _busyPoll; };
+	void setBusyPoll(long microseconds) { _busyPoll = microseconds; };
+	const LoopStats& getLoopStats() { return _stats; };
+	const PoolStats& getContextPoolStats() { return _contextPool.getStats(); };
+	unsigned long getSyscallCount() { return _poller->getSyscallCount(); };
+	bool isCompletionBased() { return _poller->isCompletionBased(); };
+	const LoopClock& getClock() { return _clock; };
 
 	EventContext* addEvent(int filter, int fd, EventContext::EventType type, void* data);
 	EventContext* addEvent(int filter, int fd, EventContext::EventType type, void* data, int pipe[2]);
+	EventContext* addContext(int fd, EventContext::EventType type, void* data);
+	EventContext* addProcessEvent(pid_t pid, EventContext::EventType type, void* data);
 	void removeEvent(int filter, EventContext* context);
-	EventContext* addUserEvent(int fd, EventContext::EventType type, void* data);
-	int checkEvent(struct kevent* eventlist);
-    void addTimeoutEvent(EventContext* context);
-    void resetTimeoutEvent(EventContext* context);
-    void deleteTimeoutEvent(int fd);
+	void enableEvent(int filter, EventContext* context);
+	void disableEvent(int filter, EventContext* context);
+	void pauseEvent(int filter, EventContext* context);
+	void clearEvents(int fd);
+	EventAwaiter readable(EventContext* context) { return EventAwaiter(*this, context, EF_READ); };
+	EventAwaiter writable(EventContext* context) { return EventAwaiter(*this, context, EF_WRITE); };
+	EventAwaiter send(EventContext* context, struct msghdr* message) { return EventAwaiter(*this, context, EF_SENT, message); };
+	EventAwaiter childExit(EventContext* context);
+	FileJobAwaiter fileRead(FileIOPool& pool, FileJob* job) { return FileJobAwaiter(pool, job); };
+	TaskAwaiter defer(int ident, unsigned int generation) { return TaskAwaiter(*this, ident, generation); };
+	void resume(const Event& event);
+	void submitSend(EventContext* context, struct msghdr* message);
+	void addTask(int ident, unsigned int generation, EventContext::EventType type,
+		std::coroutine_handle<> waiter = std::coroutine_handle<>());
+	std::size_t countTasks() { return _tasks.size(); };
+	bool takeTask(Task& task);
+	void releaseContext(EventContext* context);
+	static bool isStale(const Event& event);
+	void continueEvent(const Event& event);
+	int checkEvent(std::vector<Event>& eventlist);
+	void endDispatch() { this->destroyReleasedContexts(); };
+    void addTimeoutEvent(TimerWheel::Timer& timer, long milliseconds);
+    void deleteTimeoutEvent(TimerWheel::Timer& timer);
 
 private:
-	const int _kqueue;
-	const int _maxEvent;
-	bool _connectionDeleted;
+	Poller* const _poller;
+	int _maxEvent;
+	int _minEvent;
+	int _lowWaitCount;
+	LoopStats _stats;
+	bool _edgeTriggered;
+	long _busyPoll;
+	std::deque<Task> _tasks;
+	std::vector<Event> _postedEvents;
+	std::vector<EventContext*> _releasedContexts;
+	LoopClock _clock;
+	TimerWheel _timerWheel;
+	std::vector<TimerWheel::Timer*> _expiredTimers;
+	ObjectPool<EventContext> _contextPool;
 
-	enum { MaxEventNumber = 20 };
+	enum {
+		MinEventNumber = 20,
+		ShrinkStreak = 64,
+	};
+
+	bool isDrainedEvent(int filter, EventContext::EventType type);
+	int watchFilter(int filter, EventContext::EventType type);
+	EventContext* newContext(int fd, EventContext::EventType type, void* data);
+	void destroyReleasedContexts();
+	int wait(std::vector<Event>& eventlist, long timeout);
+	void adaptBatchSize(int count);
+	void appendTimeoutEvents(std::vector<Event>& eventlist);
+
+	EventHandler(const EventHandler&);
+	EventHandler& operator=(const EventHandler&);
 };
 
+// Whether the event is of a context released since it was taken, to be skipped.
+inline bool EventHandler::isStale(const Event& event) {
+	return event.filter != EF_TIMER && static_cast<EventContext*>(event.udata)->isReleased();
+}
+
 #endif
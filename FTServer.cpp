@@ -1,24 +1,192 @@
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <deque>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "FTServer.hpp"
 #include "VirtualServer.hpp"
 #include "Request.hpp"
+#include "constant.hpp"
+
+// SIGUSR1 received, to export the loop metrics on demand.
+static volatile sig_atomic_t metricsRequests = 0;
+
+static void requestLoopMetrics(int signal) {
+    (void)signal;
+    metricsRequests = metricsRequests + 1;
+}
+
+// SIGTERM or SIGINT received by the master process.
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int signal) {
+    (void)signal;
+    stopRequested = 1;
+}
+
+// SIGUSR2 received, to upgrade the binary, and SIGQUIT, to drain.
+static volatile sig_atomic_t upgradeRequested = 0;
+static volatile sig_atomic_t drainRequested = 0;
+
+// Written by the signal handlers to wake event loop 0 up.
+static int signalPipe[2] = { -1, -1 };
+
+// Written once as the drain starts and never read, so it stays readable for
+// every other event loop.
+static int shutdownPipe[2] = { -1, -1 };
+
+extern char** environ;
+
+// Wake event loop 0 up from a signal handler, if it runs.
+static void wakeMainLoop() {
+    const int savedErrno = errno;
+    const char byte = 0;
+
+    if (signalPipe[1] != -1) {
+        const ssize_t written = write(signalPipe[1], &byte, 1);
+        (void)written;
+    }
+    errno = savedErrno;
+}
+
+static void requestUpgrade(int signal) {
+    (void)signal;
+    upgradeRequested = 1;
+    wakeMainLoop();
+}
+
+static void requestDrain(int signal) {
+    (void)signal;
+    drainRequested = 1;
+    wakeMainLoop();
+}
+
+// Open a non-blocking, close-on-exec pipe.
+//  - Parameters fds: The ends of the pipe, left -1 on failure.
+//  - Return: Whether the pipe is open.
+static bool openNonBlockingPipe(int fds[2]) {
+    int opened[2];
+
+    if (pipe(opened) == -1)
+        return false;
+    for (int i = 0; i < 2; ++i) {
+        if (fcntl(opened[i], F_SETFL, O_NONBLOCK) == -1 || fcntl(opened[i], F_SETFD, FD_CLOEXEC) == -1) {
+            close(opened[0]);
+            close(opened[1]);
+            return false;
+        }
+    }
+    fds[0] = opened[0];
+    fds[1] = opened[1];
+    return true;
+}
+
+// Take the listening sockets passed by the binary upgraded from, as "port:fd"
+// separated by ';' in LISTEN_FDS_ENV, which is then removed from the
+// environment so CGI scripts and workers do not see it.
+//  - Parameters fds: The sockets are appended by port.
+//  - Return(none)
+static void takeInheritedListenFDs(std::map<port_t, std::deque<int> >& fds) {
+    const char* value = std::getenv(LISTEN_FDS_ENV.c_str());
+
+    if (value == NULL)
+        return;
+
+    std::stringstream ss(value);
+    std::string entry;
+
+    while (std::getline(ss, entry, ';')) {
+        const std::string::size_type colon = entry.find(':');
+        const int port = std::atoi(entry.substr(0, colon).c_str());
+        const int fd = (colon == std::string::npos) ? -1 : std::atoi(entry.c_str() + colon + 1);
+
+        if (port < 1 || port > USHRT_MAX || fd < 0) {
+            Log::warning("invalid %s entry: %s", LISTEN_FDS_ENV.c_str(), entry.c_str());
+            continue;
+        }
+        fds[static_cast<port_t>(port)].push_back(fd);
+    }
+    unsetenv(LISTEN_FDS_ENV.c_str());
+}
+
+// Pin the calling process to the 'slot'-th CPU it may run on, wrapping around.
+//  - Parameters slot: The slot of the worker process.
+//  - Return(none)
+static void pinWorkerProcess(int slot) {
+#ifdef __linux__
+    cpu_set_t allowed;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+        Log::warning("Worker process %d: sched_getaffinity() failed", slot);
+        return;
+    }
+    int nth = slot % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed) || nth-- > 0)
+            continue;
+
+        cpu_set_t pinned;
+
+        CPU_ZERO(&pinned);
+        CPU_SET(cpu, &pinned);
+        if (sched_setaffinity(0, sizeof(pinned), &pinned) == -1)
+            Log::warning("Worker process %d: sched_setaffinity() failed", slot);
+        else
+            Log::info("Worker process %d pinned to CPU %d", slot, cpu);
+        return;
+    }
+#else
+    Log::warning("Worker process %d: no CPU affinity on this system", slot);
+#endif
+}
 
 // default constructor of FTServer
 //  - Parameters(None)
 FTServer::FTServer() :
 _alive(true),
-_eventHandler(EventHandler()) {
+_processedRequestCount(0),
+_workerThreads(DEFAULT_WORKER_THREADS),
+_workerProcesses(DEFAULT_WORKER_PROCESSES),
+_workerCPUAffinity(true),
+_workerProcess(false),
+_shutdownTimeout(DEFAULT_SHUTDOWN_TIMEOUT),
+_keepAliveTimeout(DEFAULT_KEEPALIVE_TIMEOUT * 1000L),
+_keepAliveRequests(DEFAULT_KEEPALIVE_REQUESTS),
+_workerConnections(0),
+_overloadTarget(0),
+_overloadInterval(DEFAULT_OVERLOAD_INTERVAL * 1000L),
+_clientHeaderBufferSize(DEFAULT_CLIENT_HEADER_BUFFER_SIZE),
+_largeHeaderBuffers(DEFAULT_LARGE_HEADER_BUFFERS),
+_largeHeaderBufferSize(DEFAULT_LARGE_HEADER_BUFFER_SIZE),
+_clientBodyBufferSize(DEFAULT_CLIENT_BODY_BUFFER_SIZE),
+_maxEvents(DEFAULT_MAX_EVENTS),
+_acceptBatch(DEFAULT_ACCEPT_BATCH),
+_edgeTriggered(false),
+_fileIOThreads(DEFAULT_FILE_IO_THREADS),
+_stallThreshold(DEFAULT_STALL_THRESHOLD * 1000L),
+_loopIndex(0),
+_connectionPool(POOL_SLAB_SIZE, CONNECTION_POOL_PREALLOC),
+_metrics(_eventHandler.getClock().getSeconds()),
+_nextMetricsExport(0),
+_metricsRequestsSeen(0),
+_draining(false),
+_drainDeadline(0),
+_clientCount(0),
+_acceptPaused(false) {
+    this->_drainTimer.set(-1, 0, this);
     Log::verbose("A FTServer has been generated.");
 }
 
 // Destructor of FTServer
 //  - Parameters(None)
 FTServer::~FTServer() {
-    for (ConnectionMapIter   connectionIter = _mConnection.begin();
-        connectionIter != _mConnection.end();
-        connectionIter++) {
-        delete connectionIter->second;
-    }
+    for (std::size_t fd = 0; fd < _connections.capacity(); ++fd)
+        _connectionPool.destroy(_connections.at(fd));
     for (VirtualServerConfigIter itr = _defaultConfigs.begin();
         itr != _defaultConfigs.end();
         ++itr) {
@@ -29,10 +197,36 @@ FTServer::~FTServer() {
         itr++) {
         delete *itr;
     }
+    // Without worker processes, the sockets are closed by their Connections.
+    if (this->_workerProcesses > 0)
+        for (std::vector<std::map<port_t, int> >::iterator slot = _listenSlots.begin(); slot != _listenSlots.end(); ++slot)
+            for (std::map<port_t, int>::iterator itr = slot->begin(); itr != slot->end(); ++itr)
+                close(itr->second);
     Log::verbose("All Connections has been deleted.");
     // close(_kqueue);
 }
 
+//  Keep how this binary was run, to run it again on upgrade. The binary is
+//  resolved now, as the working directory or argv[0] may not lead to it later.
+//  - Parameters
+//      argc, argv: The arguments of main().
+//  - Return(None)
+void FTServer::setCommandLine(int argc, char** argv) {
+    char resolved[PATH_MAX];
+
+    this->_commandLine.assign(argv, argv + argc);
+#ifdef __linux__
+    if (realpath("/proc/self/exe", resolved) != NULL) {
+        this->_executable = resolved;
+        return;
+    }
+#endif
+    if (argc > 0 && realpath(argv[0], resolved) != NULL)
+        this->_executable = resolved;
+    else
+        Log::warning("The binary is not found: upgrade disabled");
+}
+
 // 전달받은 config file을 파싱
 //  - Parameters
 //      - filePath: config file이 존재하고 있는 경로
@@ -45,7 +239,7 @@ void FTServer::initParseConfig(std::string filePath) {
     VirtualServerConfig        *sc;
     std::set<ServerConfigKey> checkDuplicate;
     
-    fs.open(filePath);
+    fs.open(filePath.c_str());
     if (fs.is_open()) {
         while (getline(fs, confLine)) {
             ss << confLine;
@@ -79,7 +273,147 @@ void FTServer::initParseConfig(std::string filePath) {
                     delete sc;
                     continue;
                 }
+                this->parseListenOptions(tConfigs.find("listen")->second);
                 this->_defaultConfigs.push_back(sc);
+            } else if (token == "worker_threads") {
+                std::string value;
+                ss >> value;
+                this->_workerThreads = std::atoi(value.c_str());
+                if (this->_workerThreads < 1) {
+                    Log::error("invalid worker_threads value: %s", value.c_str());
+                    this->_workerThreads = DEFAULT_WORKER_THREADS;
+                }
+            } else if (token == "worker_processes") {
+                std::string value;
+                ss >> value;
+                value = value.substr(0, value.find(';'));
+                if (value == "auto")
+                    this->_workerProcesses = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+                else
+                    this->_workerProcesses = std::atoi(value.c_str());
+                if (this->_workerProcesses < 0 || (this->_workerProcesses == 0 && value != "0")) {
+                    Log::error("invalid worker_processes value: %s", value.c_str());
+                    this->_workerProcesses = DEFAULT_WORKER_PROCESSES;
+                }
+            } else if (token == "worker_cpu_affinity") {
+                std::string value;
+                ss >> value;
+                value = value.substr(0, value.find(';'));
+                if (value == "on" || value == "off")
+                    this->_workerCPUAffinity = (value == "on");
+                else
+                    Log::error("invalid worker_cpu_affinity value: %s", value.c_str());
+            } else if (token == "shutdown_timeout") {
+                std::string value;
+                ss >> value;
+                this->_shutdownTimeout = std::atoi(value.c_str());
+                if (this->_shutdownTimeout < 0 || (this->_shutdownTimeout == 0 && value.substr(0, value.find(';')) != "0")) {
+                    Log::error("invalid shutdown_timeout value: %s", value.c_str());
+                    this->_shutdownTimeout = DEFAULT_SHUTDOWN_TIMEOUT;
+                }
+            } else if (token == "keepalive_timeout") {
+                std::string value;
+                ss >> value;
+                const int timeout = std::atoi(value.c_str());
+                if (timeout < 0 || (timeout == 0 && value.substr(0, value.find(';')) != "0"))
+                    Log::error("invalid keepalive_timeout value: %s", value.c_str());
+                else
+                    this->_keepAliveTimeout = timeout * 1000L;
+            } else if (token == "keepalive_requests") {
+                std::string value;
+                ss >> value;
+                const long requests = std::atol(value.c_str());
+                if (requests < 1)
+                    Log::error("invalid keepalive_requests value: %s", value.c_str());
+                else
+                    this->_keepAliveRequests = requests;
+            } else if (token == "worker_connections") {
+                std::string value;
+                ss >> value;
+                const long connections = std::atol(value.c_str());
+                if (connections < 1)
+                    Log::error("invalid worker_connections value: %s", value.c_str());
+                else
+                    this->_workerConnections = connections;
+            } else if (token == "overload_target" || token == "overload_interval") {
+                std::string value;
+                ss >> value;
+                const int milliseconds = std::atoi(value.c_str());
+                if (milliseconds < 0 || (milliseconds == 0 && (token == "overload_interval" || value.substr(0, value.find(';')) != "0")))
+                    Log::error("invalid %s value: %s", token.c_str(), value.c_str());
+                else if (token == "overload_target")
+                    this->_overloadTarget = milliseconds * 1000L;
+                else
+                    this->_overloadInterval = milliseconds * 1000L;
+            } else if (token == "client_header_buffer_size" || token == "client_body_buffer_size") {
+                std::string value;
+                ss >> value;
+                value = value.substr(0, value.find(';'));
+                long size;
+                if (!parseSize(value.c_str(), size))
+                    Log::error("invalid %s value: %s", token.c_str(), value.c_str());
+                else if (token == "client_header_buffer_size")
+                    this->_clientHeaderBufferSize = size;
+                else
+                    this->_clientBodyBufferSize = size;
+            } else if (token == "large_client_header_buffers") {
+                std::string number;
+                std::string value;
+                ss >> number >> value;
+                value = value.substr(0, value.find(';'));
+                char* end;
+                const long buffers = std::strtol(number.c_str(), &end, 10);
+                long size;
+                if (buffers < 1 || buffers > INT_MAX || *end != '\0' || !parseSize(value.c_str(), size))
+                    Log::error("invalid large_client_header_buffers value: %s %s", number.c_str(), value.c_str());
+                else {
+                    this->_largeHeaderBuffers = buffers;
+                    this->_largeHeaderBufferSize = size;
+                }
+            } else if (token == "max_events") {
+                std::string value;
+                ss >> value;
+                this->_maxEvents = std::atoi(value.c_str());
+                if (this->_maxEvents < 1) {
+                    Log::error("invalid max_events value: %s", value.c_str());
+                    this->_maxEvents = DEFAULT_MAX_EVENTS;
+                }
+            } else if (token == "accept_batch") {
+                std::string value;
+                ss >> value;
+                this->_acceptBatch = std::atoi(value.c_str());
+                if (this->_acceptBatch < 1) {
+                    Log::error("invalid accept_batch value: %s", value.c_str());
+                    this->_acceptBatch = DEFAULT_ACCEPT_BATCH;
+                }
+            } else if (token == "edge_triggered") {
+                std::string value;
+                ss >> value;
+                value = value.substr(0, value.find(';'));
+                if (value == "on" || value == "off")
+                    this->_edgeTriggered = (value == "on");
+                else
+                    Log::error("invalid edge_triggered value: %s", value.c_str());
+            } else if (token == "loop_metrics_file") {
+                std::string value;
+                ss >> value;
+                this->_metricsFile = value.substr(0, value.find(';'));
+            } else if (token == "loop_stall_threshold") {
+                std::string value;
+                ss >> value;
+                const int threshold = std::atoi(value.c_str());
+                if (threshold < 1)
+                    Log::error("invalid loop_stall_threshold value: %s", value.c_str());
+                else
+                    this->_stallThreshold = threshold * 1000L;
+            } else if (token == "file_io_threads") {
+                std::string value;
+                ss >> value;
+                this->_fileIOThreads = std::atoi(value.c_str());
+                if (this->_fileIOThreads < 1) {
+                    Log::error("invalid file_io_threads value: %s", value.c_str());
+                    this->_fileIOThreads = DEFAULT_FILE_IO_THREADS;
+                }
             } else
                 Log::error("token and server directive don't match");
             ss.clear();
@@ -90,9 +424,159 @@ void FTServer::initParseConfig(std::string filePath) {
     this->printParseResult();
 }
 
+//  Parse the parameters of a 'listen' directive after its port, merged into the
+//  ListenOptions of the port.
+//  - Parameters values: The values of the directive, the port first.
+//  - Return(None)
+void FTServer::parseListenOptions(const std::vector<std::string>& values) {
+    const port_t port = static_cast<port_t>(std::atoi(values.front().c_str()));
+    ListenOptions& options = this->_listenOptions[port];
+
+    for (std::vector<std::string>::size_type i = 1; i < values.size(); ++i) {
+        const std::string& value = values[i];
+
+        if (value == "deferred")
+            options.deferred = true;
+        else if (value == "nodelay")
+            options.noDelay = true;
+        else if (!(parseListenValue(value, "busy_poll=", options.busyPoll)
+            || parseListenValue(value, "backlog=", options.backlog)
+            || parseListenValue(value, "fastopen=", options.fastOpen)
+            || parseListenValue(value, "sndbuf=", options.sendBuffer)
+            || parseListenValue(value, "rcvbuf=", options.receiveBuffer)
+            || parseListenValue(value, "notsent_lowat=", options.notSentLowat)))
+            Log::error("invalid listen parameter: %s", value.c_str());
+    }
+}
+
+//  Parse a 'name=value' parameter of a 'listen' directive, a size as by
+//  parseSize(). The larger of it and option is kept.
+//  - Parameters
+//      parameter: The parameter.
+//      name: The name of the parameter with '='.
+//      option: The option of the parameter.
+//  - Return: Whether parameter is named name, even if its value is invalid.
+bool FTServer::parseListenValue(const std::string& parameter, const char* name, long& option) {
+    const std::string::size_type nameLength = std::strlen(name);
+    long value;
+
+    if (parameter.compare(0, nameLength, name) != 0)
+        return false;
+    if (!parseSize(parameter.c_str() + nameLength, value))
+        Log::error("invalid %.*s value: %s", static_cast<int>(nameLength - 1), name, parameter.c_str());
+    else
+        option = std::max(option, value);
+    return true;
+}
+
+//  Parse a size, a positive number with an optional 'k' or 'm' suffix.
+//  - Parameters
+//      value: The string to parse.
+//      size: Set to the size in bytes, if valid.
+//  - Return: Whether value is a size up to INT_MAX.
+bool FTServer::parseSize(const char* value, long& size) {
+    char* end;
+    const long number = std::strtol(value, &end, 10);
+    long unit = 1;
+
+    if (*end == 'k' || *end == 'K')
+        unit = 1024;
+    else if (*end == 'm' || *end == 'M')
+        unit = 1024 * 1024;
+    if (unit > 1)
+        ++end;
+    if (number < 1 || number > INT_MAX / unit || *end != '\0')
+        return false;
+    size = number * unit;
+    return true;
+}
+
 //  Initialize server manager from server config set.
+//  The master process only opens the listening sockets of its workers.
 void FTServer::init() {
-    this->initializeVirtualServers();
+    this->openListenSlots();
+    if (this->_workerProcesses > 0)
+        return;
+    this->_inheritedListenFDs = this->_listenSlots[0];
+    this->initializeReactor(this->_defaultConfigs);
+}
+
+//  Copy the settings parsed by 'master' to this server of a worker.
+//  - Parameters master: The FTServer which parsed the config.
+//  - Return(None)
+void FTServer::copySettings(const FTServer& master) {
+    this->_workerThreads = master._workerThreads;
+    this->_maxEvents = master._maxEvents;
+    this->_acceptBatch = master._acceptBatch;
+    this->_edgeTriggered = master._edgeTriggered;
+    this->_fileIOThreads = master._fileIOThreads;
+    this->_shutdownTimeout = master._shutdownTimeout;
+    this->_keepAliveTimeout = master._keepAliveTimeout;
+    this->_keepAliveRequests = master._keepAliveRequests;
+    this->_workerConnections = master._workerConnections;
+    this->_overloadTarget = master._overloadTarget;
+    this->_overloadInterval = master._overloadInterval;
+    this->_clientHeaderBufferSize = master._clientHeaderBufferSize;
+    this->_largeHeaderBuffers = master._largeHeaderBuffers;
+    this->_largeHeaderBufferSize = master._largeHeaderBufferSize;
+    this->_clientBodyBufferSize = master._clientBodyBufferSize;
+    this->_metricsFile = master._metricsFile;
+    this->_stallThreshold = master._stallThreshold;
+    this->_listenOptions = master._listenOptions;
+}
+
+//  Open the listening sockets of every event loop, a set per slot, the loops of
+//  a worker process in consecutive slots. They share the ports with
+//  SO_REUSEPORT if more than one event loop runs.
+//  The sockets passed by the binary upgraded from are taken first. If fewer
+//  were passed for a port than there are loops, the last one is shared by the
+//  rest, as a socket of the port may not be opened beside one without
+//  SO_REUSEPORT. Those left over are closed.
+//  - Return(None)
+void FTServer::openListenSlots() {
+    const int slots = std::max(this->_workerProcesses, 1) * this->_workerThreads;
+    const bool reusePort = slots > 1;
+    std::map<port_t, std::deque<int> > inherited;
+    std::map<port_t, int> lastInherited;
+
+    takeInheritedListenFDs(inherited);
+    this->_listenSlots.resize(slots);
+    for (int slot = 0; slot < slots; ++slot) {
+        for (std::map<port_t, ListenOptions>::const_iterator itr = this->_listenOptions.begin();
+            itr != this->_listenOptions.end(); ++itr) {
+            std::deque<int>& fds = inherited[itr->first];
+            const std::map<port_t, int>::const_iterator last = lastInherited.find(itr->first);
+            int fd;
+
+            if (!fds.empty()) {
+                fd = fds.front();
+                fds.pop_front();
+                Connection::adoptListenSocket(fd, itr->first, itr->second);
+                lastInherited[itr->first] = fd;
+            } else if (last != lastInherited.end()) {
+                fd = fcntl(last->second, F_DUPFD_CLOEXEC, 0);
+                if (fd == -1)
+                    throw Connection::LISTENSOCKETERROR();
+            } else
+                fd = Connection::openListenSocket(itr->first, reusePort, itr->second);
+            this->_listenSlots[slot][itr->first] = fd;
+        }
+    }
+    for (std::map<port_t, std::deque<int> >::iterator itr = inherited.begin(); itr != inherited.end(); ++itr) {
+        for (std::deque<int>::iterator fd = itr->second.begin(); fd != itr->second.end(); ++fd) {
+            Log::warning("Inherited listening socket %d of port %d is not used", *fd, itr->first);
+            close(*fd);
+        }
+    }
+}
+
+//  Initialize virtual servers and listening sockets of this event loop.
+//  - Parameters configs: The parsed configs. Only read, as workers share them.
+//  - Return(None)
+void FTServer::initializeReactor(const VirtualServerConfigVec& configs) {
+    this->_eventHandler.setMaxEvent(this->_maxEvents);
+    this->_eventHandler.setEdgeTriggered(this->_edgeTriggered);
+    this->initializeVirtualServers(configs);
 
     std::set<port_t>     portsOpen;
     for (VirtualServerVec::iterator itr = this->_vVirtualServers.begin();
@@ -100,11 +584,15 @@ void FTServer::init() {
         portsOpen.insert((*itr)->getPortNumber());
     }
     this->initializeConnection(portsOpen);
+    this->_fileIOPool.start(this->_fileIOThreads);
+    this->_fileIOWatch = this->completeFileJobs(
+        this->_eventHandler.addEvent(EF_READ, this->_fileIOPool.getWakeupFD(), EventContext::EV_FileIOComplete, this));
+    this->_fileIOWatch.start();
 }
 
 //  Initialize all virtual servers from virtual server config set.
-void FTServer::initializeVirtualServers() {
-    for (VirtualServerConfigIter itr = this->_defaultConfigs.begin(); itr != this->_defaultConfigs.end(); itr++) {
+void FTServer::initializeVirtualServers(const VirtualServerConfigVec& configs) {
+    for (VirtualServerConfigVec::const_iterator itr = configs.begin(); itr != configs.end(); itr++) {
         VirtualServer* newVirtualServer = this->makeVirtualServer(*itr);
         this->_vVirtualServers.push_back(newVirtualServer);
         this->_defaultVirtualServers.insert(std::pair<port_t, VirtualServer *>(newVirtualServer->getPortNumber(), newVirtualServer));
@@ -119,12 +607,14 @@ VirtualServer*    FTServer::makeVirtualServer(VirtualServerConfig* virtualServer
 
     std::stringstream ss;
     std::size_t cmbs;
-    if (config["server_name"].empty())
-        newVirtualServer = new VirtualServer(static_cast<port_t>(std::atoi(config["listen"].front().c_str())),
-                            "");
+    // find() instead of operator[], which inserts into the config shared by workers.
+    const directiveContainer::const_iterator listen = config.find("listen");
+    const directiveContainer::const_iterator serverName = config.find("server_name");
+    const port_t port = static_cast<port_t>(std::atoi(listen->second.front().c_str()));
+    if (serverName == config.end() || serverName->second.empty())
+        newVirtualServer = new VirtualServer(port, "");
     else
-        newVirtualServer = new VirtualServer(static_cast<port_t>(std::atoi(config["listen"].front().c_str())),
-                            config["server_name"].front());
+        newVirtualServer = new VirtualServer(port, serverName->second.front());
 
     for (directiveContainer::iterator itr = config.begin(); itr != config.end(); itr++) {
         if (!itr->first.compare("listen") || !itr->first.compare("server_name"))
@@ -177,97 +667,283 @@ VirtualServer*    FTServer::makeVirtualServer(VirtualServerConfig* virtualServer
 }
 
 // Prepares sockets as descripted by the server configuration.
+// An event loop takes the sockets of its slot, opened before it started.
+// The event loop busy polls for the longest 'busy_poll' of its ports.
 //  - Parameter
 //  - Return(none)
 void FTServer::initializeConnection(std::set<port_t>& ports) {
+    long busyPoll = 0;
+
+    this->_shedder.configure(this->_overloadTarget, this->_overloadInterval);
+    this->_requestBuffers.configure(this->_clientHeaderBufferSize, this->_largeHeaderBuffers,
+        this->_largeHeaderBufferSize, this->_clientBodyBufferSize);
     for (std::set<port_t>::iterator itr = ports.begin(); itr != ports.end(); itr++) {
-        Connection* newConnection = new Connection(*itr, _eventHandler);
-        this->_mConnection.insert(std::make_pair(newConnection->getIdent(), newConnection));
-        _eventHandler.addEvent(
-            EVFILT_READ,
+        const std::map<port_t, ListenOptions>::const_iterator found = this->_listenOptions.find(*itr);
+        const ListenOptions options = (found != this->_listenOptions.end()) ? found->second : ListenOptions();
+        const std::map<port_t, int>::const_iterator inherited = this->_inheritedListenFDs.find(*itr);
+        void* storage = _connectionPool.allocate();
+        Connection* newConnection;
+
+        busyPoll = std::max(busyPoll, options.busyPoll);
+        try {
+            if (inherited != this->_inheritedListenFDs.end())
+                newConnection = new (storage) Connection(inherited->second, *itr, _eventHandler);
+            else
+                newConnection = new (storage) Connection(*itr, _eventHandler, this->_workerThreads > 1, options);
+        } catch (...) {
+            _connectionPool.deallocate(storage);
+            throw;
+        }
+        newConnection->setGeneration(this->_connections.insert(newConnection->getIdent(), newConnection));
+        this->_acceptContexts.push_back(_eventHandler.addEvent(
+            EF_READ,
             newConnection->getIdent(),
             EventContext::EV_Accept,
             this
-        );
+        ));
+        newConnection->appendContextChain(this->_acceptContexts.back());
+        newConnection->run(this->acceptClients(newConnection, this->_acceptContexts.back()));
     }
+    _eventHandler.setBusyPoll(busyPoll);
 }
 
-// Accept the client from the server socket.
+// Accept the clients pending on the server socket, 'accept_batch' at most, so
+// a burst of clients does not starve established connections. The listening
+// socket is watched level-triggered, so the rest is reported again.
+// With 'worker_connections' clients, accepting pauses until one is closed; the
+// clients left queued on the socket meanwhile wait there.
 //  - Parameter
 //      socket: server socket which made a handshake with the incoming client.
 //  - Return(none)
 void FTServer::eventAcceptConnection(Connection* connection) {
-    Connection* newConnection = connection->acceptClient();
+    for (int accepted = 0; accepted < this->_acceptBatch; ++accepted) {
+        if (this->_workerConnections > 0 && this->_clientCount >= this->_workerConnections) {
+            this->pauseAccept();
+            return;
+        }
+
+        Connection* newConnection = connection->acceptClient(_connectionPool, _requestBuffers);
+
+        if (newConnection == NULL)
+            return;
+        this->addClient(newConnection);
+    }
+}
+
+// Take the client accepted by a completion based poller on the server socket.
+// Clients accepted before a pause or a removal of the accept are delivered
+// still: taken while paused, closed by the poller once removed.
+//  - Parameter
+//      ident: server socket on which the client has been accepted.
+//      result: the client socket, or -errno.
+//  - Return(none)
+void FTServer::eventAcceptCompletion(int ident, intptr_t result) {
+    Connection* connection = _connections.find(ident);
+
+    if (result < 0) {
+        Log::warning("accept() on [%d] failed: %s", ident, std::strerror(-result));
+        return;
+    }
+    if (connection == NULL || connection->isClosed()) {
+        close(result);
+        return;
+    }
+
+    Connection* newConnection = connection->adoptClient(result, _connectionPool, _requestBuffers);
+
+    if (newConnection == NULL)
+        return;
+    this->addClient(newConnection);
+    if (this->_workerConnections > 0 && this->_clientCount >= this->_workerConnections)
+        this->pauseAccept();
+}
+
+// Register a client accepted, and serve it by serveClient().
+//  - Parameter
+//      newConnection: the Connection of the client.
+//  - Return(none)
+void FTServer::addClient(Connection* newConnection) {
     EventContext* context;
 
-    this->_mConnection.insert(std::make_pair(newConnection->getIdent(), newConnection));
+    ++this->_clientCount;
+    newConnection->setGeneration(this->_connections.insert(newConnection->getIdent(), newConnection));
     context = _eventHandler.addEvent(
-        EVFILT_READ,
+        EF_READ,
         newConnection->getIdent(),
         EventContext::EV_Request,
         newConnection
     );
-    newConnection->appendContextChain(context);
-    _eventHandler.addTimeoutEvent(context);
-    Log::verbose("Client Accepted: [%s]", newConnection->getAddr().c_str());
+    newConnection->setRequestContext(context);
+    newConnection->armTimeout(Connection::TK_Idle, TIMEOUT);
+    Log::verbose("Client Accepted: [%d]", newConnection->getIdent());
+    newConnection->run(this->serveClient(newConnection));
+}
+
+// Accept the clients of a listening socket on each of its events, as long as
+// it is open. An accept failing is logged, and the next event awaited.
+//  - Parameter
+//      connection: the Connection of the listening socket.
+//      context: the EventContext of its read event.
+//  - Return: the coroutine.
+Coroutine FTServer::acceptClients(Connection* connection, EventContext* context) {
+    for (;;) {
+        const Event event = co_await _eventHandler.readable(context);
+
+        try {
+            if (event.filter == EF_ACCEPTED)
+                this->eventAcceptCompletion(connection->getIdent(), event.data);
+            else
+                this->eventAcceptConnection(connection);
+        } catch (const std::exception& excep) {
+            Log::warning("Accepting on [%d] failed: %s", connection->getIdent(), excep.what());
+        }
+    }
 }
 
-// Just returns an connection associated with the accepted ident
-void FTServer::eventAcceptConnection(int ident) {
-    return this->eventAcceptConnection(_mConnection[ident]);
+// Stop watching the listening sockets, as 'worker_connections' are open.
+//  - Return(none)
+void FTServer::pauseAccept() {
+    if (this->_acceptPaused)
+        return;
+    this->_acceptPaused = true;
+    for (std::vector<EventContext*>::iterator iter = this->_acceptContexts.begin(); iter != this->_acceptContexts.end(); ++iter)
+        _eventHandler.disableEvent(EF_READ, *iter);
+    Log::info("Event loop %d: worker_connections (%lu) reached, accepting paused", this->_loopIndex, this->_workerConnections);
 }
 
-void FTServer::eventProcessRequest(EventContext* context) {
-    Connection* connection = static_cast<Connection*>(context->getData());
-    if (connection->isClosed())
+// Watch the listening sockets again, as a client has been closed.
+//  - Return(none)
+void FTServer::resumeAccept() {
+    if (!this->_acceptPaused)
         return;
-    VirtualServer& matchingServer = getTargetVirtualServer(*connection);
-    connection->setTargetVirtualServer(&matchingServer);
+    this->_acceptPaused = false;
+    for (std::vector<EventContext*>::iterator iter = this->_acceptContexts.begin(); iter != this->_acceptContexts.end(); ++iter)
+        _eventHandler.enableEvent(EF_READ, *iter);
+}
+
+// Serve the client, until the connection is closed: await a request, process
+// it at the end of the loop iteration with the requests pipelined behind it,
+// and send their responses together. A request processed asynchronously is
+// awaited before the next one is parsed.
+// An error processing a request closes the connection.
+//  - Parameter
+//      connection: the Connection of the client.
+//  - Return: the coroutine, run by the connection.
+Coroutine FTServer::serveClient(Connection* connection) {
+    try {
+        while (!connection->isClosed()) {
+            co_await connection->receiveRequest();
+            if (connection->isClosed())
+                break;
+            co_await _eventHandler.defer(connection->getIdent(), connection->getGeneration());
+            do {
+                switch (this->processRequest(*connection)) {
+                    case VirtualServer::RC_ERROR:
+                        connection->setProcessing(false);
+                        break;
+                    case VirtualServer::RC_SUCCESS:
+                        connection->commitResponse();
+                        break;
+                    case VirtualServer::RC_IN_PROGRESS:
+                        co_await connection->completeRequest(this->_fileIOPool);
+                        break;
+                }
+            } while (connection->parseNextRequest());
+            co_await connection->transmit();
+        }
+    } catch (const std::exception& excep) {
+        Log::warning("Serving [%d] failed: %s", connection->getIdent(), excep.what());
+        connection->dispose();
+    }
+}
+
+// Take the request parsed on the connection and process it.
+// Under overload, as told by _shedder from the queue delay of the request, the
+// request is refused with 503 instead.
+//  - Parameter
+//      connection: the Connection of the client.
+//  - Return: the result of VirtualServer::processRequest().
+VirtualServer::ReturnCode FTServer::processRequest(Connection& connection) {
+    const long now = LoopClock::readMicroseconds();
+    VirtualServer& matchingServer = getTargetVirtualServer(connection);
     VirtualServer::ReturnCode result;
 
-    _eventHandler.resetTimeoutEvent(context);
-    result = matchingServer.processRequest(*connection, this->_eventHandler);
-    connection->resetRequestStatus();
-    switch (result) {
-        case VirtualServer::RC_ERROR:
-            break;
-        case VirtualServer::RC_SUCCESS:
-            _eventHandler.addEvent(
-                EVFILT_WRITE,
-                context->getIdent(),
-                EventContext::EV_Response,
-                connection
-            );
+    connection.setTargetVirtualServer(&matchingServer);
+    connection.armTimeout(Connection::TK_Idle, TIMEOUT);
+    connection.takeRequest(this->getKeepAliveTime(connection));
+    ++_processedRequestCount;
+    if (this->_shedder.admit(now, now - connection.getParsedTime()))
+        result = matchingServer.processRequest(connection, this->_fileIOPool);
+    else
+        result = matchingServer.set503Response(connection);
+    connection.resetRequestStatus();
+    return result;
+}
+
+// The time to keep a connection open for its next request after the response to
+// the request taken now, 0 to close it after the response: when the client does
+// not let it persist, the request could not be framed, 'keepalive_requests'
+// have been served on it, or the event loop is draining.
+//  - Parameters connection: The client connection taking a request.
+//  - Return: Milliseconds of keep-alive, 0 for none.
+long FTServer::getKeepAliveTime(Connection& connection) const {
+    const Request& request = connection.getRequest();
+
+    if (this->_draining || request.isParsingFail() || request.isLengthRequired())
+        return 0;
+    if (connection.getRequestCount() + 1 >= this->_keepAliveRequests || !request.isKeepAlive())
+        return 0;
+    return this->_keepAliveTimeout;
+}
+
+// Run the tasks queued until now. Tasks queued by them run on next iteration,
+// whose wait does not sleep. A task whose connection has been disposed since is
+// skipped, as the generation of its fd has changed, and so is the coroutine of
+// a connection closed.
+//  - Parameters since: The end of the last dispatch, updated by each task.
+//  - Return(none)
+void FTServer::runDeferredTasks(long& since) {
+    std::size_t count = _eventHandler.countTasks();
+    EventHandler::Task task;
+
+    while (count-- > 0 && _eventHandler.takeTask(task)) {
+        Connection* connection = _connections.find(task.ident, task.generation);
+
+        if (connection == NULL)
+            continue;
+        switch (task.type) {
+        case EventContext::EV_ProcessRequest:
+            if (!connection->isClosed() && task.waiter)
+                task.waiter.resume();
             break;
-        case VirtualServer::RC_IN_PROGRESS:
+        case EventContext::EV_DisposeConn:
+            this->disposeConnection(connection);
             break;
         default:
-            assert(false);
+            ;
+        }
+        this->recordDispatch(task.type, task.ident, since);
     }
 }
 
 // Close the certain socket and destroy the instance.
+// The output of a connection being sent by the kernel is still read by it, so
+// the send is cancelled and the connection disposed of once it completes.
 //  - Parameter
-//      ident: socket FD number to kill.
+//      connection: the Connection to kill, found in the table.
 //  - Return(none)
-void FTServer::handleUserFlaggedEvent(struct kevent event) {
-	EventContext* context = (EventContext*)event.udata;
+void FTServer::disposeConnection(Connection* connection) {
+    const bool client = connection->isclient();
 
-    if (event.filter != EVFILT_USER)
+    if (connection->isSending()) {
+        connection->cancelSend();
         return;
-	switch (context->getEventType()) {
-	case EventContext::EV_ProcessRequest:
-        this->eventProcessRequest(context);
-		break;
-	case EventContext::EV_DisposeConn:
-        _eventHandler.setConnectionDeleted(true);
-		delete this->_mConnection[event.ident];
-		this->_mConnection.erase(event.ident);
-	    delete context;
-	default:
-		;
-	}
-	// delete context;
+    }
+
+    this->_connections.erase(connection->getIdent());
+    _connectionPool.destroy(connection);
+    if (client && --this->_clientCount < this->_workerConnections)
+        this->resumeAccept();
 }
 
 //  Return appropriate server to process client connection.
@@ -288,137 +964,636 @@ VirtualServer& FTServer::getTargetVirtualServer(Connection& clientConnection) {
     return *this->_defaultVirtualServers[static_cast<port_t>(clientConnection.getPort())];
 }
 
-// Main loop procedure of ServerManager.
-// Do multiflexing job using Kqueue.
+// Start 'worker_threads' - 1 worker threads, then run the event loop of this
+// thread as well. SIGUSR1 is handled from here on, to export the loop metrics,
+// SIGQUIT to drain and SIGUSR2 to upgrade, except in a worker process, whose
+// master upgrades. The handlers wake event loop 0 up through signalPipe.
+// CGI processes are reaped by the kernel as they exit (SA_NOCLDWAIT), as their
+// status is never used. SIGPIPE is ignored, as a client or a CGI process gone
+// is told by EPIPE to the coroutine writing to it, which may be the first to
+// notice it.
 //  - Return(none)
 void FTServer::run() {
-    struct kevent events[_eventHandler.getMaxEvent()];
+    if (this->_workerProcesses > 0) {
+        this->runMaster();
+        return;
+    }
+
+    std::vector<pthread_t> workers;
+    // Sized before the workers start, so their arguments never move.
+    std::vector<WorkerStart> starts(this->_workerThreads);
+    struct sigaction action;
+
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = requestLoopMetrics;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    if (!openNonBlockingPipe(signalPipe) || !openNonBlockingPipe(shutdownPipe))
+        Log::warning("pipe() failed: SIGQUIT and SIGUSR2 are not handled");
+    else {
+        action.sa_handler = requestDrain;
+        sigaction(SIGQUIT, &action, NULL);
+        action.sa_handler = this->_workerProcess ? SIG_IGN : requestUpgrade;
+        sigaction(SIGUSR2, &action, NULL);
+        if (upgradeRequested != 0 || drainRequested != 0)
+            wakeMainLoop();
+    }
+    action.sa_handler = SIG_DFL;
+    action.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    action.sa_flags = 0;
+    sigaction(SIGPIPE, &action, NULL);
+    for (int i = 1; i < this->_workerThreads; ++i) {
+        pthread_t worker;
+        starts[i].master = this;
+        starts[i].loopIndex = i;
+        if (pthread_create(&worker, NULL, FTServer::runWorker, &starts[i]) != 0) {
+            Log::warning("pthread_create() failed: running %d thread(s)", i);
+            // Nobody would accept on the sockets of the loops not started.
+            for (; i < this->_workerThreads; ++i)
+                for (std::map<port_t, int>::iterator itr = this->_listenSlots[i].begin();
+                    itr != this->_listenSlots[i].end(); ++itr)
+                    close(itr->second);
+            break;
+        }
+        workers.push_back(worker);
+    }
+    this->runEventLoop();
+    for (std::vector<pthread_t>::iterator itr = workers.begin(); itr != workers.end(); ++itr)
+        pthread_join(*itr, NULL);
+}
+
+// Run the master process: fork a worker process per slot and wait for them,
+// forking a worker again in the slot of one which died, until SIGTERM or
+// SIGINT stops them, or SIGQUIT drains them. On SIGUSR2 the binary is run again
+// first, then the workers are drained. The signals interrupt waitpid(), as they
+// are handled without SA_RESTART.
+//  - Return(none)
+void FTServer::runMaster() {
+    struct sigaction action;
+    WorkerProcess none;
+
+    std::memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = requestStop;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    action.sa_handler = requestLoopMetrics;
+    sigaction(SIGUSR1, &action, NULL);
+    action.sa_handler = requestDrain;
+    sigaction(SIGQUIT, &action, NULL);
+    action.sa_handler = requestUpgrade;
+    sigaction(SIGUSR2, &action, NULL);
+    none.pid = -1;
+    none.started = 0;
+    this->_workers.assign(this->_workerProcesses, none);
+    this->_metricsRequestsSeen = metricsRequests;
+    while (stopRequested == 0 && drainRequested == 0) {
+        bool missing = false;
+
+        for (int slot = 0; slot < this->_workerProcesses && stopRequested == 0 && drainRequested == 0; ++slot) {
+            if (this->_workers[slot].pid == -1)
+                this->spawnWorkerProcess(slot);
+            missing = missing || this->_workers[slot].pid == -1;
+        }
+
+        int status;
+        const pid_t pid = waitpid(-1, &status, missing ? WNOHANG : 0);
+
+        if (this->_metricsRequestsSeen != metricsRequests) {
+            this->_metricsRequestsSeen = metricsRequests;
+            this->signalWorkerProcesses(SIGUSR1);
+        }
+        if (upgradeRequested != 0) {
+            upgradeRequested = 0;
+            if (this->spawnUpgrade())
+                drainRequested = 1;
+        }
+        if (pid > 0)
+            this->reapWorkerProcess(pid, status);
+        else if (missing && stopRequested == 0 && drainRequested == 0)
+            sleep(WORKER_RESPAWN_DELAY);
+    }
+    if (stopRequested == 0) {
+        Log::info("Master process: draining %d worker process(es)", this->_workerProcesses);
+        this->signalWorkerProcesses(SIGQUIT);
+        for (int slot = 0; slot < this->_workerProcesses && stopRequested == 0; ) {
+            const pid_t worker = this->_workers[slot].pid;
+            int status;
+
+            if (worker == -1)
+                ++slot;
+            else if (waitpid(worker, &status, 0) == worker)
+                this->reapWorkerProcess(worker, status);
+        }
+    }
+    Log::info("Master process: stopping %d worker process(es)", this->_workerProcesses);
+    this->signalWorkerProcesses(SIGTERM);
+    for (std::vector<WorkerProcess>::iterator itr = this->_workers.begin(); itr != this->_workers.end(); ++itr)
+        if (itr->pid != -1)
+            waitpid(itr->pid, NULL, 0);
+}
+
+// Fork the worker process of a slot. One forked again soon after its start is
+// delayed by WORKER_RESPAWN_DELAY, so a worker failing at once is not forked in
+// a tight loop.
+//  - Parameters slot: The slot of the worker process.
+//  - Return(none)
+void FTServer::spawnWorkerProcess(int slot) {
+    WorkerProcess& worker = this->_workers[slot];
+
+    if (worker.started != 0 && std::time(NULL) - worker.started < WORKER_RESPAWN_DELAY)
+        sleep(WORKER_RESPAWN_DELAY);
+    worker.started = std::time(NULL);
+    worker.pid = fork();
+    if (worker.pid == 0)
+        this->runWorkerProcess(slot);
+    if (worker.pid == -1)
+        Log::error("Master process: fork() failed for worker process %d", slot);
+    else
+        Log::info("Master process: worker process %d started as pid %d", slot, worker.pid);
+}
+
+// Body of a worker process, which never returns. It closes the sockets of the
+// other slots, is pinned to its CPU, and serves on the sockets of its slots, a
+// slot per thread, with an FTServer of its own, taking the configs over.
+//  - Parameters slot: The slot of the worker process.
+//  - Return(none)
+void FTServer::runWorkerProcess(int slot) {
+    struct sigaction action;
+    const int first = slot * this->_workerThreads;
+    int status = EXIT_SUCCESS;
+
+    std::memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    upgradeRequested = 0;
+    for (int other = 0; other < static_cast<int>(this->_listenSlots.size()); ++other) {
+        if (other >= first && other < first + this->_workerThreads)
+            continue;
+        for (std::map<port_t, int>::iterator itr = this->_listenSlots[other].begin();
+            itr != this->_listenSlots[other].end(); ++itr)
+            close(itr->second);
+    }
+    if (this->_workerCPUAffinity)
+        pinWorkerProcess(slot);
+    try {
+        FTServer worker;
+        worker.copySettings(*this);
+        worker._workerProcess = true;
+        worker._listenSlots.assign(this->_listenSlots.begin() + first,
+            this->_listenSlots.begin() + first + this->_workerThreads);
+        worker._inheritedListenFDs = worker._listenSlots[0];
+        worker._defaultConfigs.swap(this->_defaultConfigs);
+        worker.initializeReactor(worker._defaultConfigs);
+        worker.run();
+    }
+    catch (const std::exception& excep) {
+        Log::error("Worker process %d: Fatal Error [%s]", slot, excep.what());
+        status = EXIT_FAILURE;
+    }
+    std::exit(status);
+}
+
+// Log the end of a worker process and free its slot to fork it again.
+//  - Parameters
+//      pid: The worker process.
+//      status: Its status from waitpid().
+//  - Return(none)
+void FTServer::reapWorkerProcess(pid_t pid, int status) {
+    for (int slot = 0; slot < this->_workerProcesses; ++slot) {
+        if (this->_workers[slot].pid != pid)
+            continue;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+            Log::info("Master process: worker process %d (pid %d) exited", slot, pid);
+        else if (WIFSIGNALED(status))
+            Log::error("Master process: worker process %d (pid %d) killed by signal %d", slot, pid, WTERMSIG(status));
+        else
+            Log::error("Master process: worker process %d (pid %d) exited with %d", slot, pid, WEXITSTATUS(status));
+        this->_workers[slot].pid = -1;
+        return;
+    }
+}
+
+// Send a signal to every worker process running.
+//  - Parameters signal: The signal.
+//  - Return(none)
+void FTServer::signalWorkerProcesses(int signal) {
+    for (std::vector<WorkerProcess>::iterator itr = this->_workers.begin(); itr != this->_workers.end(); ++itr)
+        if (itr->pid != -1)
+            kill(itr->pid, signal);
+}
+
+// Entry of worker thread. Builds a FTServer of its own from the configs of the
+// main FTServer, on the listening sockets of its slot, and runs its event loop.
+//  - Parameters data: The WorkerStart, with the main FTServer.
+//  - Return: NULL.
+void* FTServer::runWorker(void* data) {
+    const WorkerStart& start = *static_cast<WorkerStart*>(data);
+    const FTServer& master = *start.master;
+
+    try {
+        FTServer worker;
+        worker._loopIndex = start.loopIndex;
+        worker.copySettings(master);
+        worker._inheritedListenFDs = master._listenSlots[start.loopIndex];
+        worker.initializeReactor(master._defaultConfigs);
+        worker.runEventLoop();
+    }
+    catch (const std::exception& excep) {
+        Log::error("Worker thread: Fatal Error [%s]", excep.what());
+    }
+    return NULL;
+}
+
+// Main loop procedure of ServerManager.
+// Do multiflexing job using EventHandler, until drained.
+// Event loop 0 watches signalPipe, the others shutdownPipe.
+// The time blocked in checkEvent() and taken by every dispatch is measured by
+// chaining 'since' from the wakeup through events and tasks.
+//  - Return(none)
+void FTServer::runEventLoop() {
+    std::vector<Event> events;
     int numbers = 0;
+    long since = LoopClock::readMicroseconds();
 
+    if (this->_loopIndex == 0 && signalPipe[0] != -1)
+        this->_signalWatch = this->watchSignals(_eventHandler.addEvent(EF_READ, signalPipe[0], EventContext::EV_Signal, this));
+    else if (this->_loopIndex != 0 && shutdownPipe[0] != -1)
+        this->_signalWatch = this->awaitShutdown(_eventHandler.addEvent(EF_READ, shutdownPipe[0], EventContext::EV_Shutdown, this));
+    if (!this->_signalWatch.isDone())
+        this->_signalWatch.start();
+    this->_metricsRequestsSeen = metricsRequests;
+    this->_metrics.reset(_eventHandler.getClock().getSeconds());
+    this->_nextMetricsExport = _eventHandler.getClock().getSeconds() + LOOP_METRICS_INTERVAL;
     while (_alive == true) {
     try {
         numbers = _eventHandler.checkEvent(events);
+        this->_metrics.recordWakeup(_eventHandler.getClock().getMicroseconds() - since, numbers);
+        since = _eventHandler.getClock().getMicroseconds();
+        if (this->_metricsRequestsSeen != metricsRequests
+            || (!this->_metricsFile.empty() && _eventHandler.getClock().getSeconds() >= this->_nextMetricsExport)) {
+            this->exportLoopMetrics();
+            since = LoopClock::readMicroseconds();
+        }
         if (numbers < 0) {
-            Log::warning("kevent polling error");
+            if (errno != EINTR)
+                Log::warning("event polling error");
             continue;
         }
+        if (_eventHandler.getLoopStats().iterations % LOOP_STATS_INTERVAL == 0)
+            this->printLoopStats();
         for (int i = 0; i < numbers; i++) {
-            this->handleUserFlaggedEvent(events[i]);
-            this->runEachEvent(events[i]);
-            if (_eventHandler.isConnectionDeleted()) {
-                _eventHandler.setConnectionDeleted(false);
+            if (EventHandler::isStale(events[i]))
                 continue;
-            }
+            this->runTimedEvent(events[i], since);
         }
+        this->runDeferredTasks(since);
     }
-    catch (const std::runtime_error& excep) {
+    catch (const std::exception& excep) {
         Log::warning("runtime error: %s", excep.what());
     }
     }
+    _eventHandler.endDispatch();
 }
 
-// Defines how to handle certain event, depands on EventContext
+// Print the statistics of the event loop, to tune 'max_events'.
+void FTServer::printLoopStats() {
+    const EventHandler::LoopStats& stats = _eventHandler.getLoopStats();
+
+    Log::verbose("Event loop: %lu waits, %.2f events per wait (max %d), %lu full batches, batch size %d/%d",
+        stats.iterations,
+        stats.iterations ? static_cast<double>(stats.events) / stats.iterations : 0.0,
+        stats.maxEventsPerWait,
+        stats.fullBatches,
+        stats.batchSize,
+        _eventHandler.getMaxEvent());
+    if (_eventHandler.getBusyPoll() > 0)
+        Log::verbose("Busy polling: %lu polls, %lu waits found events",
+            stats.busyPolls, stats.busyPollHits);
+    this->printPoolStats("Connection", _connectionPool.getStats());
+    this->printPoolStats("EventContext", _eventHandler.getContextPoolStats());
+    this->printPoolStats("Header buffer", _requestBuffers.header.getStats());
+    this->printPoolStats("Large header buffer", _requestBuffers.largeHeader.getStats());
+    this->printPoolStats("Body buffer", _requestBuffers.body.getStats());
+}
+
+// Print the occupancy of a pool of this event loop, for capacity planning.
+void FTServer::printPoolStats(const char* name, const PoolStats& stats) {
+    Log::verbose("%s pool: %lu in use (peak %lu) of %lu in %lu slab(s)",
+        name,
+        static_cast<unsigned long>(stats.inUse),
+        static_cast<unsigned long>(stats.peak),
+        static_cast<unsigned long>(stats.capacity),
+        static_cast<unsigned long>(stats.slabs));
+}
+
+// Process a single event and record the time it took.
+// Its kind is taken first, as the handler may free the EventContext.
+//  - Parameters
+//      event: event to process
+//      since: The end of the last dispatch, updated.
+//  - Return(none)
+void FTServer::runTimedEvent(const Event& event, long& since) {
+    const int kind = (event.filter == EF_TIMER)
+        ? static_cast<int>(LoopMetrics::TimeoutDispatch)
+        : static_cast<EventContext*>(event.udata)->getEventType();
+
+    this->runEachEvent(event);
+    this->recordDispatch(kind, event.ident, since);
+}
+
+// Record a dispatch which ended now, and log it as a stall if it took longer
+// than 'loop_stall_threshold'.
 //  - Parameters
-//      context: Eventcontext for triggered event
-//      filter: filter for triggered event
-//  - Returns
-//      Result flag of handled event
-EventContext::EventResult FTServer::driveThisEvent(EventContext* context, int filter) {
-    if (filter == EVFILT_TIMER)
-        return eventTimeout(context);
-
-    Connection* connection = static_cast<Connection*>(context->getData());
-	switch (context->getEventType()) {
-	case EventContext::EV_Accept:
-		this->eventAcceptConnection(context->getIdent());
-		return EventContext::ER_Continue;
-	case EventContext::EV_Request:
-		return connection->eventReceive();
-	case EventContext::EV_Response:
-		return connection->eventTransmit();
-	case EventContext::EV_CGIParamBody:
-        return connection->eventCGIParamBody(*context);
-	case EventContext::EV_CGIResponse:
-        return connection->eventCGIResponse(*context);
-    case EventContext::EV_SetVirtualServerErrorPage:
-        return this->eventSetVirtualServerErrorPage(*context);
-    case EventContext::EV_GETResponse:
-        return this->eventGETResponse(*context);
-    case EventContext::EV_POSTResponse:
-        return this->eventPOSTResponse(*context);
-	default:
-		;
-    }
-	return EventContext::ER_NA;
-}
-
-// Process a single event
+//      kind: EventType of the event or task, or TimeoutDispatch.
+//      ident: The fd of the event or task.
+//      since: The end of the last dispatch, updated to now.
+//  - Return(none)
+void FTServer::recordDispatch(int kind, int ident, long& since) {
+    const long now = LoopClock::readMicroseconds();
+    const long elapsed = now - since;
+
+    since = now;
+    this->_metrics.recordDispatch(kind, elapsed);
+    if (elapsed >= this->_stallThreshold)
+        Log::warning("Event loop %d stalled: %s on fd %d took %ld us",
+            this->_loopIndex, LoopMetrics::getKindName(kind).c_str(), ident, elapsed);
+}
+
+// Export the loop metrics of the period and start a new one. The report is
+// appended to 'loop_metrics_file' by _fileIOPool, or logged without it.
+//  - Return(none)
+void FTServer::exportLoopMetrics() {
+    const time_t now = _eventHandler.getClock().getSeconds();
+    std::string report;
+
+    this->_metricsRequestsSeen = metricsRequests;
+    this->_nextMetricsExport = now + LOOP_METRICS_INTERVAL;
+    this->_metrics.format(this->_loopIndex, now, _eventHandler.getSyscallCount(), this->_processedRequestCount, report);
+    this->_metrics.reset(now);
+    if (this->_metricsFile.empty()) {
+        Log::info("Loop metrics of %s", report.c_str());
+        return;
+    }
+
+    FileJob* job = this->_fileIOPool.newJob(FileJob::FJ_Append, -1, 0, this->_metricsFile);
+
+    job->body.swap(report);
+    this->_fileIOPool.submit(job);
+}
+
+// Process a single event: resume the coroutine awaiting it. The bytes of
+// EF_RECEIVED are taken by the connection first.
 //  - Parameters
 //      event: event to process
 //  - Return ( None )
-void FTServer::runEachEvent(struct kevent event) {
+void FTServer::runEachEvent(const Event& event) {
     EventContext* context = (EventContext*)event.udata;
-	int filter = event.filter;
-	int eventResult;
 
-    if (filter == EVFILT_USER)
+    if (event.filter == EF_TIMER) {
+        this->eventTimeout(event);
         return ;
+    }
+    if (event.filter == EF_RECEIVED)
+        static_cast<CompletionHandler*>(static_cast<Connection*>(context->getData()))->completeReceive(event.buffer, event.data);
+    _eventHandler.resume(event);
+}
+
+//  Resume the connections awaiting the file jobs run by _fileIOPool, on each
+//  wakeup of it.
+//  A job of a connection closed since is dropped, found stale by its generation.
+//  An error is logged, and the next wakeup awaited.
+//  - Parameters context: the EventContext of the wakeup fd.
+//  - Return: the coroutine.
+Coroutine FTServer::completeFileJobs(EventContext* context) {
+    for (;;) {
+        co_await _eventHandler.readable(context);
+        try {
+            this->_fileIOPool.takeCompleted(this->_completedFileJobs);
+            for (std::vector<FileJob*>::iterator iter = this->_completedFileJobs.begin();
+                iter != this->_completedFileJobs.end(); ++iter) {
+                Connection* connection = this->_connections.find((*iter)->ident, (*iter)->generation);
+
+                if (connection != NULL && !connection->isClosed() && (*iter)->waiter)
+                    (*iter)->waiter.resume();
+                else if ((*iter)->operation == FileJob::FJ_Append && (*iter)->result == FileJob::FR_Error)
+                    Log::warning("Appending to %s failed: %s", (*iter)->path.c_str(), std::strerror((*iter)->error));
+                this->_fileIOPool.releaseJob(*iter);
+            }
+        } catch (const std::exception& excep) {
+            Log::warning("Completing the file jobs failed: %s", excep.what());
+        }
+        this->_completedFileJobs.clear();
+    }
+}
+
+//  Handle the signals written to signalPipe, on loop 0.
+//  - Parameters context: the EventContext of signalPipe.
+//  - Return: the coroutine.
+Coroutine FTServer::watchSignals(EventContext* context) {
+    for (;;) {
+        co_await _eventHandler.readable(context);
+        try {
+            this->eventSignal();
+        } catch (const std::exception& excep) {
+            Log::warning("Handling a signal failed: %s", excep.what());
+        }
+    }
+}
+
+//  Drain once loop 0 writes shutdownPipe, on the other loops.
+//  - Parameters context: the EventContext of shutdownPipe.
+//  - Return: the coroutine.
+Coroutine FTServer::awaitShutdown(EventContext* context) {
+    co_await _eventHandler.readable(context);
+    try {
+        this->startDrain();
+    } catch (const std::exception& excep) {
+        Log::warning("Draining failed: %s", excep.what());
+    }
+    _eventHandler.removeEvent(EF_READ, context);
+}
 
-	eventResult = this->driveThisEvent(context, filter);
+//  event function called when a timeout of client connection expired, or the
+//  drain is checked again.
+//  - Parameters event: EF_TIMER event, with the connection, or this FTServer
+//      for _drainTimer, as user data and the kind of timeout as data.
+//  - Return(none)
+void FTServer::eventTimeout(const Event& event) {
+    if (event.udata == this) {
+        this->drainConnections();
+        return;
+    }
+
+    Connection* connection = this->_connections.find(event.ident);
 
-	switch (eventResult) {
-	case EventContext::ER_Done:
-	case EventContext::ER_Continue:
-		break ;
-	case EventContext::ER_NA:
-		Log::debug("EventContext is not applicalble. (%d): %s", context->getIdent(), context->getEventTypeToString().c_str());
-	case EventContext::ER_Remove:
-		_eventHandler.removeEvent(filter, context);
-	}
+    // The connection may have been replaced by another on the same fd.
+    if (connection == NULL || connection != event.udata)
+        return;
+    Log::verbose("Timeout(%ld) of Connection [%d]", static_cast<long>(event.data), event.ident);
+    connection->dispose();
 }
 
-//  event function reading a file and setting error page.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult FTServer::eventSetVirtualServerErrorPage(EventContext& context) {
-    std::pair<const std::string&, VirtualServer&>* data = static_cast<std::pair<const std::string&, VirtualServer&>*>(context.getData());
-    VirtualServer& virtualServer = data->second;
+//  event function called on loop 0 when a signal handler wrote signalPipe.
+//  On SIGUSR2 the binary is run again and, if it started, this server drains.
+//  On SIGQUIT the other loops are woken up through shutdownPipe and drain too.
+//  - Return(none)
+void FTServer::eventSignal() {
+    char buffer[64];
+
+    while (read(signalPipe[0], buffer, sizeof(buffer)) > 0)
+        continue;
+    if (upgradeRequested != 0) {
+        upgradeRequested = 0;
+        if (!this->_draining && this->spawnUpgrade())
+            drainRequested = 1;
+    }
+    if (drainRequested != 0 && !this->_draining) {
+        const char byte = 0;
 
-    return virtualServer.eventSetVirtualServerErrorPage(context);
+        Log::info("Draining connections for %d s at most", this->_shutdownTimeout);
+        if (write(shutdownPipe[1], &byte, 1) == -1)
+            Log::warning("Waking the event loops up failed");
+        this->startDrain();
+    }
 }
 
-//  event function reading a file and responding of GET request.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult FTServer::eventGETResponse(EventContext& context) {
-    Connection* clientConnection = static_cast<Connection*>(context.getData());
-    VirtualServer* targetVirtualServer = clientConnection->getTargetVirtualServer();
+//  Stop accepting and close the connections of this event loop as they become
+//  idle. The listening sockets are closed, and the clients queued on them are
+//  accepted by another process sharing them, if any. With a completion based
+//  poller, the accepts are cancelled but the listening sockets kept until the
+//  loop stops, as the clients the kernel accepted before the cancel are still
+//  delivered on them, to be served.
+//  - Return(none)
+void FTServer::startDrain() {
+    if (this->_draining)
+        return;
+    this->_draining = true;
+    this->_drainDeadline = _eventHandler.getClock().getMilliseconds() + this->_shutdownTimeout * 1000L;
+    if (_eventHandler.isCompletionBased()) {
+        for (std::vector<EventContext*>::iterator iter = this->_acceptContexts.begin(); iter != this->_acceptContexts.end(); ++iter)
+            _eventHandler.disableEvent(EF_READ, *iter);
+    }
+    this->_acceptContexts.clear();
+    this->_acceptPaused = false;
+    if (!_eventHandler.isCompletionBased()) {
+        for (std::size_t fd = 0; fd < this->_connections.capacity(); ++fd) {
+            Connection* connection = this->_connections.at(fd);
 
-    return targetVirtualServer->eventGETResponse(context, this->_eventHandler);
+            if (connection != NULL && !connection->isclient())
+                connection->dispose();
+        }
+    }
+    this->drainConnections();
 }
 
-//  event function writing a file and responding of POST request.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult FTServer::eventPOSTResponse(EventContext& context) {
-    Connection* clientConnection = static_cast<Connection*>(context.getData());
-    VirtualServer* targetVirtualServer = clientConnection->getTargetVirtualServer();
+//  Close the connections idle since the last check, and stop the event loop if
+//  none is left or 'shutdown_timeout' has expired. Otherwise check again after
+//  DRAIN_CHECK_INTERVAL.
+//  - Return(none)
+void FTServer::drainConnections() {
+    unsigned long busy = 0;
+
+    for (std::size_t fd = 0; fd < this->_connections.capacity(); ++fd) {
+        Connection* connection = this->_connections.at(fd);
 
-    return targetVirtualServer->eventPOSTResponse(context, this->_eventHandler);
+        if (connection == NULL || connection->isClosed() || !connection->isclient())
+            continue;
+        if (connection->stayedIdle())
+            connection->dispose();
+        else
+            ++busy;
+    }
+    if (busy > 0 && _eventHandler.getClock().getMilliseconds() < this->_drainDeadline) {
+        _eventHandler.addTimeoutEvent(this->_drainTimer, DRAIN_CHECK_INTERVAL);
+        return;
+    }
+    if (busy > 0)
+        Log::warning("Event loop %d: shutdown_timeout expired with %lu busy connection(s)", this->_loopIndex, busy);
+    this->_alive = false;
 }
 
-//  event function called when client connection exceeded request timeout.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult FTServer::eventTimeout(EventContext* context) {
-    Connection* const timeoutedClientConnection = this->_mConnection[context->getIdent()];
+//  Run the binary again with every listening socket passed in LISTEN_FDS_ENV,
+//  and wait until it has been executed. The other descriptors are closed on
+//  exec, as every descriptor of the server is opened close-on-exec.
+//  - Return: Whether the binary has been executed.
+bool FTServer::spawnUpgrade() {
+    std::string listenFDs;
+    std::vector<int> passed;
+    std::vector<std::string> environment;
+    std::vector<char*> argv;
+    std::vector<char*> envp;
+    int status[2];
+    char entry[32];
+
+    if (this->_executable.empty()) {
+        Log::error("Upgrade: the binary is not known");
+        return false;
+    }
+    for (std::vector<std::map<port_t, int> >::const_iterator slot = this->_listenSlots.begin();
+        slot != this->_listenSlots.end(); ++slot) {
+        for (std::map<port_t, int>::const_iterator itr = slot->begin(); itr != slot->end(); ++itr) {
+            std::snprintf(entry, sizeof(entry), "%s%u:%d", listenFDs.empty() ? "" : ";", itr->first, itr->second);
+            listenFDs += entry;
+            passed.push_back(itr->second);
+        }
+    }
+    for (char** env = environ; *env != NULL; ++env)
+        if (std::strncmp(*env, (LISTEN_FDS_ENV + "=").c_str(), LISTEN_FDS_ENV.size() + 1) != 0)
+            environment.push_back(*env);
+    environment.push_back(LISTEN_FDS_ENV + "=" + listenFDs);
+    for (std::vector<std::string>::iterator itr = this->_commandLine.begin(); itr != this->_commandLine.end(); ++itr)
+        argv.push_back(const_cast<char*>(itr->c_str()));
+    argv.push_back(NULL);
+    for (std::vector<std::string>::iterator itr = environment.begin(); itr != environment.end(); ++itr)
+        envp.push_back(const_cast<char*>(itr->c_str()));
+    envp.push_back(NULL);
+
+    if (pipe(status) == -1) {
+        Log::error("Upgrade: pipe() failed");
+        return false;
+    }
+    fcntl(status[0], F_SETFD, FD_CLOEXEC);
+    fcntl(status[1], F_SETFD, FD_CLOEXEC);
+
+    const pid_t pid = fork();
 
-    if (timeoutedClientConnection == NULL)
-        return EventContext::ER_Done;
-    timeoutedClientConnection->dispose();
-    // remove all chained context / event
+    if (pid == 0) {
+        for (std::vector<int>::iterator fd = passed.begin(); fd != passed.end(); ++fd)
+            fcntl(*fd, F_SETFD, 0);
+        execve(this->_executable.c_str(), &argv[0], &envp[0]);
 
-    return EventContext::ER_Done;
+        const int error = errno;
+        const ssize_t written = write(status[1], &error, sizeof(error));
+
+        (void)written;
+        _exit(127);
+    }
+    close(status[1]);
+    if (pid == -1) {
+        close(status[0]);
+        Log::error("Upgrade: fork() failed");
+        return false;
+    }
+
+    int error = 0;
+    ssize_t result;
+
+    do
+        result = read(status[0], &error, sizeof(error));
+    while (result == -1 && errno == EINTR);
+    close(status[0]);
+    if (result > 0) {
+        Log::error("Upgrade: executing %s failed: %s", this->_executable.c_str(), std::strerror(error));
+        return false;
+    }
+    Log::info("Upgrade: %s started as pid %d", this->_executable.c_str(), pid);
+    return true;
 }
 
 // just print a result of configuration file
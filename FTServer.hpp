@@ -6,17 +6,22 @@
 #include <map>
 #include <set>
 #include <exception>
-#include <sys/event.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <csignal>
 #include <utility>
 #include "Log.hpp"
 #include "VirtualServer.hpp"
 #include "Connection.hpp"
 #include "VirtualServerConfig.hpp"
 #include "EventHandler.hpp"
+#include "ConnectionTable.hpp"
+#include "LoopMetrics.hpp"
+#include "LoadShedder.hpp"
 
 // NOTE port, server_name only one
 // vector<string>? for multiple server name
@@ -32,57 +37,220 @@ struct ServerConfigKey {
 //  - Member variables  
 //      _defaultConfigs: config file에서 파싱해서 정리한 config 컨테이너(vector), 서버마다 속성값 다르기에 구분
 //      _vVirtualServers: 
-//      _mConnection
+//      _connections: the Connections of listening and client sockets by fd.
 //      _kqueue
 //      _alive
+//      _processedRequestCount: the number of requests processed, exported with the
+//          poller syscalls in the loop metrics to measure syscalls per request.
+//      _workerThreads: the number of threads running an event loop. ('worker_threads' directive)
+//      _workerProcesses: the number of worker processes, 0 to serve in this process. ('worker_processes' directive)
+//      _workerCPUAffinity: pin each worker process to a CPU. ('worker_cpu_affinity' directive)
+//      _workerProcess: this is a worker process forked by a master.
+//      _shutdownTimeout: seconds to drain the connections for. ('shutdown_timeout' directive)
+//      _keepAliveTimeout: milliseconds an idle client connection is kept open, 0 to close
+//          each after its response. ('keepalive_timeout' directive, in seconds)
+//      _keepAliveRequests: the most requests served on a client connection. ('keepalive_requests' directive)
+//      _workerConnections: the most client connections of an event loop, 0 for
+//          no limit. ('worker_connections' directive)
+//      _overloadTarget: microseconds of queue delay beyond which requests are
+//          refused under overload, 0 to refuse none. ('overload_target' directive, in ms)
+//      _overloadInterval: microseconds of the interval of _shedder. ('overload_interval' directive, in ms)
+//      _clientHeaderBufferSize: the size of the first block of a header section.
+//          ('client_header_buffer_size' directive)
+//      _largeHeaderBuffers, _largeHeaderBufferSize: the number and size of the blocks
+//          of the rest of a header section. ('large_client_header_buffers' directive)
+//      _clientBodyBufferSize: the size of the blocks of a body. ('client_body_buffer_size' directive)
+//      _commandLine, _executable: how this binary was run, to run it again on upgrade.
+//      _maxEvents: the most events taken from a wait of each event loop. ('max_events' directive)
+//      _acceptBatch: the most clients accepted per event of a listening socket. ('accept_batch' directive)
+//      _edgeTriggered: drain sockets and CGI outputs watched edge-triggered. ('edge_triggered' directive)
+//      _fileIOThreads: the number of threads running filesystem work per event loop. ('file_io_threads' directive)
+//      _metricsFile: the file the loop metrics are appended to. ('loop_metrics_file' directive)
+//      _stallThreshold: microseconds of a dispatch logged as a stall. ('loop_stall_threshold' directive, in ms)
+//      _loopIndex: the event loop, 0 for the main thread.
+//      _listenOptions: the parameters of 'listen' directives by port.
+//      _listenSlots: the listening sockets by port, per event loop, opened by
+//          the master or the main thread for every loop.
+//      _inheritedListenFDs: the listening sockets of this event loop, by port.
+//      _workers: master: the worker process of each slot.
+//      _draining: the event loop accepts no more and closes idle connections.
+//      _drainDeadline: when the drain gives up on busy connections.
+//      _drainTimer: the timeout checking the drain.
+//      _clientCount: the client connections open.
+//      _acceptContexts: the EventContexts of the listening sockets.
+//      _acceptPaused: the listening sockets are not watched, as
+//          'worker_connections' are open.
+//      _shedder: decides which requests to refuse under overload.
+//      _requestBuffers: the blocks the requests of the event loop are received into.
+//      _connectionPool: storage of the Connections in _connections.
+//      _fileIOPool: the threads running the filesystem work of requests.
+//      _completedFileJobs: the jobs taken from _fileIOPool, reused per wakeup.
+//      _fileIOWatch: the coroutine resuming the connections awaiting file jobs.
+//      _signalWatch: the coroutine awaiting signalPipe, or shutdownPipe.
+//      _metrics: histograms of wait and dispatch times of the event loop.
+//      _nextMetricsExport: when the metrics are exported next, with _metricsFile.
+//      _metricsRequestsSeen: SIGUSR1 received, of which the metrics were exported.
 //  - Methods
 //      init: Read and parse configuration file to initialize server. 
+//      run: Start worker threads and run the event loop of this thread, or run
+//          the master process with 'worker_processes'.
+//
+//  Every listening socket is opened before the event loops start, a slot per
+//  loop, and sockets passed by a binary upgraded from (LISTEN_FDS_ENV) are
+//  taken first. On SIGUSR2 the binary is run again with every listening socket
+//  passed that way, and this server drains as on SIGQUIT: the loops stop
+//  accepting, close connections as they become idle and stop when none is
+//  left, or after 'shutdown_timeout'. The connections queued on the sockets
+//  are left to the new binary, as the sockets stay open there.
+//
+//  The loop metrics are exported every LOOP_METRICS_INTERVAL seconds to
+//  'loop_metrics_file' if set, and on SIGUSR1 to it or to the log. Every event
+//  loop exports its own on its next wakeup.
+//
+//  With 'worker_threads' > 1, every worker thread owns a FTServer built from the
+//  configs parsed by the main one: its own EventHandler, connection table,
+//  VirtualServers and SO_REUSEPORT listening sockets. The parsed configs are the
+//  only data shared between threads and they are read-only once run() starts.
+//
+//  With 'worker_processes', this process is the master. init() opens a set of
+//  listening sockets per worker process, and run() forks the workers and waits
+//  for them. A worker builds its FTServer on the sockets of its slot, which the
+//  master keeps open, so a worker which dies is forked again in its place
+//  without dropping the connections queued on them. SIGTERM and SIGINT stop
+//  the workers, SIGQUIT drains them, and SIGUSR1 is passed on to them. On
+//  SIGUSR2 the master upgrades the binary, then drains the workers.
 class FTServer {
 public:
     FTServer();
     ~FTServer();
 
     void init();
-    void initializeVirtualServers();
+    void setCommandLine(int argc, char** argv);
     void initParseConfig(std::string configfile);
     void initializeConnection(std::set<port_t>&  ports);
 
     VirtualServer& getTargetVirtualServer(Connection& connection);
-    void eventAcceptConnection(int ident);
     void run();
 
     class NOTOPENFILEERROR : public std::exception {
     public:
-        virtual const char* what() const throw() {
+        virtual const char* what() const noexcept {
             return "not open file";
         }
     };
 private:
     typedef std::vector<VirtualServer*>             VirtualServerVec;
-    typedef std::map<int, Connection*>           ConnectionMap;
-    typedef std::map<int, Connection*>::iterator ConnectionMapIter;
     typedef std::vector<VirtualServerConfig *>  VirtualServerConfigVec;
     typedef std::vector<VirtualServerConfig *>::iterator  VirtualServerConfigIter;
 
     VirtualServerConfigVec _defaultConfigs;
     VirtualServerVec       _vVirtualServers;
-    ConnectionMap       _mConnection;
+    ConnectionTable     _connections;
     std::map<port_t, VirtualServer*> _defaultVirtualServers;
     bool            _alive;
+    unsigned long   _processedRequestCount;
+    int             _workerThreads;
+    int             _workerProcesses;
+    bool            _workerCPUAffinity;
+    bool            _workerProcess;
+    int             _shutdownTimeout;
+    long            _keepAliveTimeout;
+    unsigned long   _keepAliveRequests;
+    unsigned long   _workerConnections;
+    long            _overloadTarget;
+    long            _overloadInterval;
+    long            _clientHeaderBufferSize;
+    long            _largeHeaderBuffers;
+    long            _largeHeaderBufferSize;
+    long            _clientBodyBufferSize;
+    std::vector<std::string> _commandLine;
+    std::string     _executable;
+    int             _maxEvents;
+    int             _acceptBatch;
+    bool            _edgeTriggered;
+    int             _fileIOThreads;
+    std::string     _metricsFile;
+    long            _stallThreshold;
+    int             _loopIndex;
+    std::map<port_t, ListenOptions> _listenOptions;
+    std::vector<std::map<port_t, int> > _listenSlots;
+    std::map<port_t, int> _inheritedListenFDs;
     EventHandler _eventHandler;
+    RequestBuffers _requestBuffers;
+    ObjectPool<Connection> _connectionPool;
+    FileIOPool _fileIOPool;
+    std::vector<FileJob*> _completedFileJobs;
+    Coroutine _fileIOWatch;
+    Coroutine _signalWatch;
+    LoopMetrics _metrics;
+    time_t _nextMetricsExport;
+    sig_atomic_t _metricsRequestsSeen;
 
+    //  WorkerStart is the argument of runWorker().
+    struct WorkerStart {
+        const FTServer* master;
+        int loopIndex;
+    };
+
+    //  WorkerProcess is a worker process of the master.
+    //  - Member variables
+    //      pid: The process, -1 if none runs in the slot.
+    //      started: When it was forked.
+    struct WorkerProcess {
+        pid_t pid;
+        time_t started;
+    };
+    std::vector<WorkerProcess> _workers;
+    bool _draining;
+    long _drainDeadline;
+    TimerWheel::Timer _drainTimer;
+    unsigned long _clientCount;
+    std::vector<EventContext*> _acceptContexts;
+    bool _acceptPaused;
+    LoadShedder _shedder;
+
+    void parseListenOptions(const std::vector<std::string>& values);
+    static bool parseListenValue(const std::string& parameter, const char* name, long& option);
+    static bool parseSize(const char* value, long& size);
+    void copySettings(const FTServer& master);
+    void openListenSlots();
+    void runMaster();
+    void spawnWorkerProcess(int slot);
+    void runWorkerProcess(int slot);
+    void reapWorkerProcess(pid_t pid, int status);
+    void signalWorkerProcesses(int signal);
+    bool spawnUpgrade();
+    void eventSignal();
+    void startDrain();
+    void drainConnections();
+    void initializeReactor(const VirtualServerConfigVec& configs);
+    void initializeVirtualServers(const VirtualServerConfigVec& configs);
     VirtualServer* makeVirtualServer(VirtualServerConfig* serverConf);
+    void runEventLoop();
+    static void* runWorker(void* data);
     void eventAcceptConnection(Connection* connection);
-    void handleUserFlaggedEvent(struct kevent event);
+    void eventAcceptCompletion(int ident, intptr_t result);
+    void addClient(Connection* newConnection);
+    void runDeferredTasks(long& since);
+    void runTimedEvent(const Event& event, long& since);
+    void recordDispatch(int kind, int ident, long& since);
+    void exportLoopMetrics();
+    void disposeConnection(Connection* connection);
 
-    EventContext::EventResult driveThisEvent(EventContext* context, int filter);
-    void runEachEvent(struct kevent event);
-    void eventProcessRequest(EventContext* context);
+    Coroutine acceptClients(Connection* connection, EventContext* context);
+    Coroutine serveClient(Connection* connection);
+    Coroutine completeFileJobs(EventContext* context);
+    Coroutine watchSignals(EventContext* context);
+    Coroutine awaitShutdown(EventContext* context);
+    void runEachEvent(const Event& event);
+    VirtualServer::ReturnCode processRequest(Connection& connection);
+    void pauseAccept();
+    void resumeAccept();
+    long getKeepAliveTime(Connection& connection) const;
 
-    EventContext::EventResult eventSetVirtualServerErrorPage(EventContext& context);
-    EventContext::EventResult eventGETResponse(EventContext& context);
-    EventContext::EventResult eventPOSTResponse(EventContext& context);
-    EventContext::EventResult eventTimeout(EventContext* context);
+    void eventTimeout(const Event& event);
+    void printLoopStats();
+    void printPoolStats(const char* name, const PoolStats& stats);
     void printParseResult();
 };
 
@@ -0,0 +1,174 @@
+#include <cerrno>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "FileIOPool.hpp"
+#include "Log.hpp"
+#include "constant.hpp"
+
+FileIOPool::FileIOPool()
+: _stopping(false)
+, _jobPool(POOL_SLAB_SIZE, FILE_JOB_POOL_PREALLOC) {
+    pthread_mutex_init(&this->_mutex, NULL);
+    pthread_cond_init(&this->_ready, NULL);
+    this->_wakeupFDs[0] = -1;
+    this->_wakeupFDs[1] = -1;
+}
+
+// Stop and join the workers, then free the jobs left.
+FileIOPool::~FileIOPool() {
+    pthread_mutex_lock(&this->_mutex);
+    this->_stopping = true;
+    pthread_cond_broadcast(&this->_ready);
+    pthread_mutex_unlock(&this->_mutex);
+    for (std::vector<pthread_t>::iterator iter = this->_threads.begin(); iter != this->_threads.end(); ++iter)
+        pthread_join(*iter, NULL);
+    for (std::deque<FileJob*>::iterator iter = this->_jobs.begin(); iter != this->_jobs.end(); ++iter)
+        this->_jobPool.destroy(*iter);
+    for (std::vector<FileJob*>::iterator iter = this->_completed.begin(); iter != this->_completed.end(); ++iter)
+        this->_jobPool.destroy(*iter);
+    if (this->_wakeupFDs[1] != this->_wakeupFDs[0] && this->_wakeupFDs[1] != -1)
+        close(this->_wakeupFDs[1]);
+    if (this->_wakeupFDs[0] != -1)
+        close(this->_wakeupFDs[0]);
+    pthread_cond_destroy(&this->_ready);
+    pthread_mutex_destroy(&this->_mutex);
+}
+
+// Create the wakeup fd and the workers. Fewer workers are run if some of them
+// can not be created.
+//  - Parameters threadCount: The number of workers, 1 at least.
+//  - Return(None)
+void FileIOPool::start(int threadCount) {
+#ifdef __linux__
+    this->_wakeupFDs[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->_wakeupFDs[0] == -1)
+        throw std::runtime_error("eventfd() Failed");
+    this->_wakeupFDs[1] = this->_wakeupFDs[0];
+#else
+    if (pipe(this->_wakeupFDs) == -1)
+        throw std::runtime_error("pipe() Failed");
+    for (int i = 0; i < 2; ++i) {
+        if (fcntl(this->_wakeupFDs[i], F_SETFL, O_NONBLOCK) == -1
+            || fcntl(this->_wakeupFDs[i], F_SETFD, FD_CLOEXEC) == -1)
+            throw std::runtime_error("fcntl() Failed");
+    }
+#endif
+    for (int i = 0; i < threadCount; ++i) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, FileIOPool::runWorker, this) != 0) {
+            Log::warning("pthread_create() failed: running %d file I/O thread(s)", i);
+            break;
+        }
+        this->_threads.push_back(thread);
+    }
+    if (this->_threads.empty())
+        throw std::runtime_error("no file I/O thread");
+}
+
+// Build a job on the storage of the pool.
+//  - Parameters: The arguments of FileJob().
+//  - Return: The job, to be given back to releaseJob().
+FileJob* FileIOPool::newJob(FileJob::Operation operation, int ident, unsigned int generation, const std::string& path) {
+    void* storage = this->_jobPool.allocate();
+
+    try {
+        return new (storage) FileJob(operation, ident, generation, path);
+    } catch (...) {
+        this->_jobPool.deallocate(storage);
+        throw;
+    }
+}
+
+// Destroy a job created by newJob(), once taken back.
+//  - Parameters job: The job.
+//  - Return(None)
+void FileIOPool::releaseJob(FileJob* job) {
+    this->_jobPool.destroy(job);
+}
+
+// Queue a job for a worker.
+//  - Parameters job: The job, given back by takeCompleted() once run.
+//  - Return(None)
+void FileIOPool::submit(FileJob* job) {
+    pthread_mutex_lock(&this->_mutex);
+    this->_jobs.push_back(job);
+    pthread_cond_signal(&this->_ready);
+    pthread_mutex_unlock(&this->_mutex);
+}
+
+// Take the jobs completed. The wakeup fd is cleared before the list is taken,
+// so a job completed in between wakes the event loop again.
+//  - Parameters completed: The jobs completed are appended to it.
+//  - Return(None)
+void FileIOPool::takeCompleted(std::vector<FileJob*>& completed) {
+    this->clearWakeup();
+    pthread_mutex_lock(&this->_mutex);
+    completed.insert(completed.end(), this->_completed.begin(), this->_completed.end());
+    this->_completed.clear();
+    pthread_mutex_unlock(&this->_mutex);
+}
+
+// Entry of worker thread.
+//  - Parameters data: The pool.
+//  - Return: NULL.
+void* FileIOPool::runWorker(void* data) {
+    static_cast<FileIOPool*>(data)->work();
+    return NULL;
+}
+
+// Run jobs until the pool stops. Only the first job completed since the event
+// loop took the list writes the wakeup fd.
+void FileIOPool::work() {
+    pthread_mutex_lock(&this->_mutex);
+    while (true) {
+        while (this->_jobs.empty() && !this->_stopping)
+            pthread_cond_wait(&this->_ready, &this->_mutex);
+        if (this->_stopping)
+            break;
+
+        FileJob* job = this->_jobs.front();
+
+        this->_jobs.pop_front();
+        pthread_mutex_unlock(&this->_mutex);
+        job->run();
+        pthread_mutex_lock(&this->_mutex);
+        this->_completed.push_back(job);
+        if (this->_completed.size() == 1)
+            this->wake();
+    }
+    pthread_mutex_unlock(&this->_mutex);
+}
+
+// Make the wakeup fd readable.
+void FileIOPool::wake() {
+#ifdef __linux__
+    const uint64_t one = 1;
+#else
+    const char one = 1;
+#endif
+
+    while (write(this->_wakeupFDs[1], &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
+
+// Read the wakeup fd until it is not readable.
+void FileIOPool::clearWakeup() {
+#ifdef __linux__
+    uint64_t count;
+
+    while (read(this->_wakeupFDs[0], &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+#else
+    char buffer[64];
+    ssize_t count;
+
+    do
+        count = read(this->_wakeupFDs[0], buffer, sizeof(buffer));
+    while (count > 0 || (count == -1 && errno == EINTR));
+#endif
+}
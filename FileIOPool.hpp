@@ -0,0 +1,67 @@
+#ifndef FILEIOPOOL_HPP_
+#define FILEIOPOOL_HPP_
+
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <stdexcept>
+#include <pthread.h>
+#include "FileJob.hpp"
+#include "ObjectPool.hpp"
+
+//  FileIOPool runs FileJobs on a bounded set of worker threads, so a slow disk
+//  stalls those threads rather than the event loop.
+//  Completed jobs are handed back through a wakeup fd: it becomes readable when
+//  the first job is queued to an empty completion list, and the event loop takes
+//  the whole list on its read event. A pool belongs to one event loop.
+//  Jobs are built on the storage of _jobPool. Only the event loop creates and
+//  releases them, so that pool needs no lock.
+//  - Member variables
+//      _mutex, _ready: guard the lists and wake the workers.
+//      _jobs: the jobs waiting for a worker.
+//      _completed: the jobs run, waiting for the event loop.
+//      _threads: the worker threads.
+//      _stopping: workers exit when set.
+//      _wakeupFDs: read and write end of the wakeup fd. (the same eventfd on Linux)
+//      _jobPool: storage of the jobs, used by the event loop only.
+//  - Methods
+//      start: Create the wakeup fd and 'threadCount' workers.
+//      newJob: Build a job on the storage of the pool.
+//      releaseJob: Destroy a job taken back, giving back its storage.
+//      getWakeupFD: The fd to watch for EF_READ, to call takeCompleted().
+//      submit: Queue 'job', owned by the pool until taken back.
+//      takeCompleted: Clear the wakeup fd and move completed jobs to 'completed'.
+class FileIOPool {
+public:
+    FileIOPool();
+    ~FileIOPool();
+
+    int getWakeupFD() const { return this->_wakeupFDs[0]; };
+    std::size_t getThreadCount() const { return this->_threads.size(); };
+
+    void start(int threadCount);
+    FileJob* newJob(FileJob::Operation operation, int ident, unsigned int generation, const std::string& path);
+    void releaseJob(FileJob* job);
+    void submit(FileJob* job);
+    void takeCompleted(std::vector<FileJob*>& completed);
+
+private:
+    pthread_mutex_t _mutex;
+    pthread_cond_t _ready;
+    std::deque<FileJob*> _jobs;
+    std::vector<FileJob*> _completed;
+    std::vector<pthread_t> _threads;
+    bool _stopping;
+    int _wakeupFDs[2];
+    ObjectPool<FileJob> _jobPool;
+
+    static void* runWorker(void* data);
+    void work();
+    void wake();
+    void clearWakeup();
+
+    FileIOPool(const FileIOPool&);
+    FileIOPool& operator=(const FileIOPool&);
+};
+
+#endif  // FILEIOPOOL_HPP_
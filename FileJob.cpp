@@ -0,0 +1,180 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "FileJob.hpp"
+#include "constant.hpp"
+
+//  Constructor of FileJob.
+//  - Parameters
+//      operation: What to do with path.
+//      ident: The socket of the connection requesting the job.
+//      generation: The generation of the connection in the connection table.
+//      path: The target file, or directory.
+FileJob::FileJob(Operation operation, int ident, unsigned int generation, const std::string& path)
+: operation(operation)
+, ident(ident)
+, generation(generation)
+, path(path)
+, autoIndex(false)
+, result(FR_NotFound)
+, error(0)
+, lastModified(0)
+, fd(-1)
+, size(0) { }
+
+//  Destructor of FileJob. The file opened is closed unless taken over.
+FileJob::~FileJob() {
+    if (this->fd != -1)
+        close(this->fd);
+}
+
+//  Do the operation. Called by a worker thread of FileIOPool.
+//  - Parameters(None)
+//  - Return(None)
+void FileJob::run() {
+    switch (this->operation) {
+    case FJ_Get:
+        this->runGet();
+        break;
+    case FJ_Post:
+        this->runWrite(O_TRUNC);
+        break;
+    case FJ_Append:
+        this->runWrite(O_APPEND);
+        break;
+    case FJ_Delete:
+        this->runDelete();
+        break;
+    }
+}
+
+//  Serve the target if it is a regular file, or else its index file, or else
+//  its listing if it is a directory and autoindex is on.
+void FileJob::runGet() {
+    struct stat buf;
+    const bool found = (stat(this->path.c_str(), &buf) == 0);
+
+    if (found && S_ISREG(buf.st_mode))
+        return this->readFile(this->path);
+
+    const bool isDirectory = found && S_ISDIR(buf.st_mode);
+
+    if (stat(this->indexPath.c_str(), &buf) == 0 && S_ISREG(buf.st_mode))
+        return this->readFile(this->indexPath);
+    if (this->autoIndex && isDirectory)
+        return this->listDirectory();
+    this->result = FR_NotFound;
+}
+
+//  Write the body to the target, created if needed.
+//  - Parameters flags: O_TRUNC or O_APPEND.
+//  - Return(None)
+void FileJob::runWrite(int flags) {
+    const int fd = open(this->path.c_str(), O_WRONLY | O_CREAT | flags | O_CLOEXEC, 0644);
+    std::string::size_type written = 0;
+
+    if (fd == -1)
+        return this->fail();
+    while (written < this->body.length()) {
+        const ssize_t count = write(fd, this->body.data() + written, this->body.length() - written);
+
+        if (count == -1) {
+            if (errno == EINTR)
+                continue;
+            this->fail();
+            close(fd);
+            return;
+        }
+        written += count;
+    }
+    close(fd);
+    this->result = FR_Done;
+}
+
+//  Unlink the target.
+void FileJob::runDelete() {
+    struct stat buf;
+
+    if (stat(this->path.c_str(), &buf) != 0) {
+        this->result = FR_NotFound;
+        return;
+    }
+    if (unlink(this->path.c_str()) == -1)
+        return this->fail();
+    this->result = FR_Done;
+}
+
+//  Read a regular file into data, as long as it was when opened. A file of
+//  SENDFILE_MIN_SIZE or more is left open in fd instead, to be sent by
+//  sendfile() without crossing into the server.
+//  - Parameters filePath: The file to read.
+//  - Return(None)
+void FileJob::readFile(const std::string& filePath) {
+    const int fd = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat buf;
+    std::string::size_type readTotal = 0;
+
+    if (fd == -1)
+        return this->fail();
+    if (fstat(fd, &buf) == -1) {
+        this->fail();
+        close(fd);
+        return;
+    }
+    this->file = filePath;
+    this->lastModified = buf.st_mtime;
+    if (buf.st_size >= SENDFILE_MIN_SIZE) {
+        this->fd = fd;
+        this->size = buf.st_size;
+        this->result = FR_File;
+        return;
+    }
+    this->data.resize(buf.st_size);
+    while (readTotal < this->data.length()) {
+        const ssize_t count = read(fd, &this->data[readTotal], this->data.length() - readTotal);
+
+        if (count == -1 && errno == EINTR)
+            continue;
+        if (count == -1) {
+            this->fail();
+            close(fd);
+            return;
+        }
+        if (count == 0)
+            break;
+        readTotal += count;
+    }
+    close(fd);
+    this->data.resize(readTotal);
+    this->result = FR_File;
+}
+
+//  List the names in the target directory, but ".".
+void FileJob::listDirectory() {
+    DIR* dir = opendir(this->path.c_str());
+
+    if (dir == NULL)
+        return this->fail();
+    while (true) {
+        const struct dirent* entry = readdir(dir);
+        if (entry == NULL)
+            break;
+        if (strcmp(entry->d_name, ".") == 0)
+            continue;
+
+        this->entries.push_back(entry->d_name);
+        if (entry->d_type == DT_DIR)
+            this->entries.back() += "/";
+    }
+    closedir(dir);
+    this->result = FR_Directory;
+}
+
+//  Record the failure of the last syscall.
+void FileJob::fail() {
+    this->error = errno;
+    this->result = FR_Error;
+}
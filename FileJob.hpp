@@ -0,0 +1,101 @@
+#ifndef FILEJOB_HPP_
+#define FILEJOB_HPP_
+
+#include <sys/types.h>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <coroutine>
+
+//  FileJob is the filesystem work of a request, run by a FileIOPool off the
+//  event loop. Regular files are always ready to a poller, but their syscalls
+//  may still block on the disk.
+//  A job is built on the event loop, run once by a worker thread and handed
+//  back; the loop and the worker never touch it at the same time.
+//  - Member variables
+//      operation: What to do with 'path'.
+//      ident: The socket of the connection requesting the job.
+//      generation: The generation of the connection in the connection table,
+//          by which a job completed after the connection closed is found stale.
+//      path: The target file, or directory.
+//      indexPath: FJ_Get: The file served if 'path' is not a regular file.
+//      autoIndex: FJ_Get: List 'path' if it is a directory.
+//      body: FJ_Post, FJ_Append: The content written to 'path'.
+//      result: The outcome, set by run().
+//      error: errno of FR_Error.
+//      file: FJ_Get: The path of the file read.
+//      lastModified: FJ_Get: The modification time of the file read.
+//      data: FJ_Get: The content of the file read, if smaller than
+//          SENDFILE_MIN_SIZE.
+//      fd: FJ_Get: The file opened to be sent by sendfile() instead, owned by
+//          the job until taken over, or -1.
+//      size: FJ_Get: The size of the file opened.
+//      entries: FJ_Get: The names in the directory listed, directories with '/'.
+//      waiter: The coroutine resumed once the job has been run, if any.
+//  - Methods
+//      run: Do the operation on the calling thread. It blocks.
+struct FileJob {
+    //  Operation is the filesystem work of a job.
+    //  - Constants
+    //      FJ_Get: Read 'path', or 'indexPath', or list 'path'.
+    //      FJ_Post: Write 'body' to 'path', created or truncated.
+    //      FJ_Delete: Unlink 'path'.
+    //      FJ_Append: Append 'body' to 'path', created if needed. (no connection)
+    enum Operation {
+        FJ_Get,
+        FJ_Post,
+        FJ_Delete,
+        FJ_Append,
+    };
+
+    //  Result is the outcome of a job.
+    //  - Constants
+    //      FR_File: A file has been read into 'data', or opened in 'fd'.
+    //      FR_Directory: A directory has been listed into 'entries'.
+    //      FR_Done: The file has been written or unlinked.
+    //      FR_NotFound: Nothing to serve at the path.
+    //      FR_Error: A syscall failed with 'error'.
+    enum Result {
+        FR_File,
+        FR_Directory,
+        FR_Done,
+        FR_NotFound,
+        FR_Error,
+    };
+
+    Operation operation;
+    int ident;
+    unsigned int generation;
+    std::string path;
+    std::string indexPath;
+    bool autoIndex;
+    std::string body;
+
+    Result result;
+    int error;
+    std::string file;
+    time_t lastModified;
+    std::string data;
+    int fd;
+    off_t size;
+    std::vector<std::string> entries;
+    std::coroutine_handle<> waiter;
+
+    FileJob(Operation operation, int ident, unsigned int generation, const std::string& path);
+    ~FileJob();
+
+    void run();
+
+private:
+    FileJob(const FileJob&);
+    FileJob& operator=(const FileJob&);
+
+    void runGet();
+    void runWrite(int flags);
+    void runDelete();
+    void readFile(const std::string& filePath);
+    void listDirectory();
+    void fail();
+};
+
+#endif  // FILEJOB_HPP_
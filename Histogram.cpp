@@ -0,0 +1,90 @@
+#include <cstdio>
+#include "Histogram.hpp"
+
+Histogram::Histogram() {
+    this->reset();
+}
+
+// Count a value.
+//  - Parameters value: The value, clamped to MaxValue.
+//  - Return(None)
+void Histogram::record(unsigned long value) {
+    if (value > MaxValue)
+        value = MaxValue;
+    ++this->_counts[bucketOf(value)];
+    if (this->_count == 0 || value < this->_min)
+        this->_min = value;
+    if (value > this->_max)
+        this->_max = value;
+    this->_sum += value;
+    ++this->_count;
+}
+
+// The value at a percentile.
+//  - Parameters percent: The percentile, from 0 to 100.
+//  - Return: The upper bound of the bucket reaching percent of values, not more
+//      than the max recorded. 0 if nothing is recorded.
+unsigned long Histogram::getPercentile(double percent) const {
+    unsigned long target = static_cast<unsigned long>(this->_count * percent / 100.0 + 0.5);
+    unsigned long seen = 0;
+
+    if (target == 0)
+        target = 1;
+    for (int bucket = 0; bucket < BucketCount; ++bucket) {
+        seen += this->_counts[bucket];
+        if (seen >= target) {
+            const unsigned long value = highestValueOf(bucket);
+            return value < this->_max ? value : this->_max;
+        }
+    }
+    return this->_max;
+}
+
+// Summarize the values as "count= min= mean= p50= p90= p99= p99.9= max=".
+std::string Histogram::format() const {
+    char line[256];
+
+    std::snprintf(line, sizeof(line), "count=%lu min=%lu mean=%.1f p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu",
+        this->getCount(),
+        this->getMin(),
+        this->getMean(),
+        this->getPercentile(50.0),
+        this->getPercentile(90.0),
+        this->getPercentile(99.0),
+        this->getPercentile(99.9),
+        this->getMax());
+    return line;
+}
+
+// Forget every value.
+void Histogram::reset() {
+    for (int bucket = 0; bucket < BucketCount; ++bucket)
+        this->_counts[bucket] = 0;
+    this->_count = 0;
+    this->_min = 0;
+    this->_max = 0;
+    this->_sum = 0;
+}
+
+// The bucket of a value: the value itself below SubBucketCount, or else the
+// SubBucketBits most significant bits of it offset by its magnitude.
+int Histogram::bucketOf(unsigned long value) {
+    int shift = 0;
+
+    if (value < SubBucketCount)
+        return static_cast<int>(value);
+    while ((value >> shift) >= SubBucketCount)
+        ++shift;
+    return shift * SubBucketHalf + static_cast<int>(value >> shift);
+}
+
+// The most value counted in a bucket.
+unsigned long Histogram::highestValueOf(int bucket) {
+    if (bucket < SubBucketCount)
+        return bucket;
+
+    const int shift = bucket / SubBucketHalf - 1;
+    const unsigned long subBucket = bucket - shift * SubBucketHalf;
+
+    return ((subBucket + 1) << shift) - 1;
+}
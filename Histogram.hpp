@@ -0,0 +1,55 @@
+#ifndef HISTOGRAM_HPP_
+#define HISTOGRAM_HPP_
+
+#include <string>
+
+//  Histogram counts values in log-linear buckets, as HdrHistogram does: values
+//  below SubBucketCount are exact, and every power of two above is split into
+//  SubBucketCount / 2 buckets, so a percentile is off by 1/16 of it at most.
+//  Recording is O(1) and the memory is fixed. Values are clamped to MaxValue.
+//  - Member variables
+//      _counts: the number of values per bucket.
+//      _count: the number of values recorded.
+//      _min, _max: the least and most value recorded.
+//      _sum: the sum of values recorded, for the mean.
+//  - Methods
+//      record: Count 'value'.
+//      getPercentile: The least value at or above 'percent' percent of values,
+//          reported as the upper bound of its bucket.
+//      format: Summarize count, min, mean, percentiles and max as a line.
+//      reset: Forget every value.
+class Histogram {
+public:
+    Histogram();
+
+    unsigned long getCount() const { return this->_count; };
+    unsigned long getMin() const { return this->_count ? this->_min : 0; };
+    unsigned long getMax() const { return this->_max; };
+    double getMean() const { return this->_count ? static_cast<double>(this->_sum) / this->_count : 0.0; };
+
+    void record(unsigned long value);
+    unsigned long getPercentile(double percent) const;
+    std::string format() const;
+    void reset();
+
+private:
+    enum {
+        SubBucketBits = 5,
+        SubBucketCount = 1 << SubBucketBits,
+        SubBucketHalf = SubBucketCount / 2,
+        ValueBits = 32,
+        BucketCount = (ValueBits - SubBucketBits + 2) * SubBucketHalf,
+    };
+    static const unsigned long MaxValue = 0xFFFFFFFFUL;
+
+    unsigned long _counts[BucketCount];
+    unsigned long _count;
+    unsigned long _min;
+    unsigned long _max;
+    unsigned long _sum;
+
+    static int bucketOf(unsigned long value);
+    static unsigned long highestValueOf(int bucket);
+};
+
+#endif  // HISTOGRAM_HPP_
@@ -0,0 +1,141 @@
+#include <unistd.h>
+#include <cerrno>
+#include "KqueuePoller.hpp"
+
+Poller* Poller::create() {
+    return new KqueuePoller();
+}
+
+KqueuePoller::KqueuePoller()
+: _kqueue(kqueue()) {
+    if (_kqueue < 0)
+        throw std::logic_error("Cannot create kqueue.");
+}
+
+KqueuePoller::~KqueuePoller() {
+    close(_kqueue);
+}
+
+// Add new event on Kqueue
+//  - Parameters
+//      filter: filter value for Kevent
+//      fd: FD number to watch
+//      udata: user data (optional)
+//      edgeTriggered: set EV_CLEAR on the event
+//  EF_EXIT watches the process 'fd' for NOTE_EXIT.
+//  - Return(none)
+void KqueuePoller::add(int filter, int fd, void* udata, bool edgeTriggered) {
+    this->queueChange(fd, toKqueueFilter(filter), EV_ADD | EV_ENABLE | (edgeTriggered ? EV_CLEAR : 0),
+        (filter == EF_EXIT) ? NOTE_EXIT : 0, 0, udata);
+}
+
+// Remove existing event on Kqueue
+//  - Parameters
+//      filter: filter value for Kevent to remove
+//      fd: FD number to stop watching
+//  The changes of a process not applied yet are dropped first, so the exit of
+//  a process added and removed at once is not delivered.
+//  - Return(none)
+void KqueuePoller::remove(int filter, int fd) {
+    if (filter == EF_EXIT) {
+        std::vector<struct kevent>::iterator iter = _changelist.begin();
+
+        while (iter != _changelist.end()) {
+            if (static_cast<int>(iter->ident) == fd && iter->filter == EVFILT_PROC)
+                iter = _changelist.erase(iter);
+            else
+                ++iter;
+        }
+    }
+    this->queueChange(fd, toKqueueFilter(filter), EV_DELETE, 0, 0, 0);
+}
+
+// Enable existing event on Kqueue
+void KqueuePoller::enable(int filter, int fd) {
+    this->queueChange(fd, toKqueueFilter(filter), EV_ENABLE, 0, 0, 0);
+}
+
+// Disable existing event on Kqueue
+void KqueuePoller::disable(int filter, int fd) {
+    this->queueChange(fd, toKqueueFilter(filter), EV_DISABLE, 0, 0, 0);
+}
+
+// Kqueue drops the events of fd by itself when fd is closed.
+// Only the changes of fd not applied yet are dropped, not to be applied on a reused fd number.
+void KqueuePoller::forget(int fd) {
+    std::vector<struct kevent>::iterator iter = _changelist.begin();
+
+    while (iter != _changelist.end()) {
+        if (static_cast<int>(iter->ident) == fd
+            && (iter->filter == EVFILT_READ || iter->filter == EVFILT_WRITE))
+            iter = _changelist.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+// Submit queued changes and wait for events in one kevent() call.
+// Changes failed are returned as EV_ERROR, which are skipped, but for a process
+// which has exited before it was watched, whose exit is delivered.
+//  - Return: the number of events appended, -1 on error.
+int KqueuePoller::wait(std::vector<Event>& eventlist, int maxEvent, long timeout) {
+    const int eventlistSize = maxEvent + _changelist.size();
+    struct timespec timeoutSpec;
+
+    timeoutSpec.tv_sec = timeout / 1000;
+    timeoutSpec.tv_nsec = (timeout % 1000) * 1000000;
+
+    _eventlist.resize(eventlistSize);
+    ++_syscallCount;
+    const int count = kevent(_kqueue,
+                            _changelist.empty() ? NULL : &_changelist[0], _changelist.size(),
+                            &_eventlist[0], eventlistSize, timeout < 0 ? NULL : &timeoutSpec);
+    _changelist.clear();
+
+    int appended = 0;
+    for (int i = 0; i < count; ++i) {
+        if ((_eventlist[i].flags & EV_ERROR)
+            && !(_eventlist[i].filter == EVFILT_PROC && _eventlist[i].data == ESRCH && _eventlist[i].udata != NULL))
+            continue;
+
+        Event event;
+
+        event.ident = _eventlist[i].ident;
+        event.filter = fromKqueueFilter(_eventlist[i].filter);
+        event.data = _eventlist[i].data;
+        event.udata = _eventlist[i].udata;
+        event.buffer = NULL;
+        eventlist.push_back(event);
+        ++appended;
+    }
+    return count < 0 ? -1 : appended;
+}
+
+void KqueuePoller::queueChange(int ident, short filter, unsigned short flags, unsigned int fflags, intptr_t data, void* udata) {
+    struct kevent ev;
+
+    EV_SET(&ev, ident, filter, flags, fflags, data, udata);
+    _changelist.push_back(ev);
+}
+
+short KqueuePoller::toKqueueFilter(int filter) {
+    switch (filter) {
+    case EF_READ:
+        return EVFILT_READ;
+    case EF_EXIT:
+        return EVFILT_PROC;
+    default:
+        return EVFILT_WRITE;
+    }
+}
+
+int KqueuePoller::fromKqueueFilter(short filter) {
+    switch (filter) {
+    case EVFILT_READ:
+        return EF_READ;
+    case EVFILT_PROC:
+        return EF_EXIT;
+    default:
+        return EF_WRITE;
+    }
+}
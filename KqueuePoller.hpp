@@ -0,0 +1,36 @@
+#ifndef KQUEUEPOLLER_HPP_
+#define KQUEUEPOLLER_HPP_
+
+#include <sys/event.h>
+#include <vector>
+#include "Poller.hpp"
+
+//  Poller backend using kqueue. (BSD, macOS)
+//  - Member variables
+//      _kqueue: FD number of Kqueue
+//      _changelist: changes queued until next kevent() call.
+//      _eventlist: buffer to receive triggered kevents.
+class KqueuePoller : public Poller {
+public:
+    KqueuePoller();
+    virtual ~KqueuePoller();
+
+    virtual void add(int filter, int fd, void* udata, bool edgeTriggered);
+    virtual void remove(int filter, int fd);
+    virtual void enable(int filter, int fd);
+    virtual void disable(int filter, int fd);
+    virtual void forget(int fd);
+    virtual int wait(std::vector<Event>& eventlist, int maxEvent, long timeout);
+
+private:
+    const int _kqueue;
+    std::vector<struct kevent> _changelist;
+    std::vector<struct kevent> _eventlist;
+
+    void queueChange(int ident, short filter, unsigned short flags, unsigned int fflags, intptr_t data, void* udata);
+
+    static short toKqueueFilter(int filter);
+    static int fromKqueueFilter(short filter);
+};
+
+#endif  // KQUEUEPOLLER_HPP_
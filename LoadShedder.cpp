@@ -0,0 +1,44 @@
+#include "LoadShedder.hpp"
+
+LoadShedder::LoadShedder()
+: _target(0)
+, _interval(0)
+, _intervalEnd(0)
+, _minDelay(-1)
+, _overloaded(false) { }
+
+// Set the target and the interval. The state measured so far is forgotten.
+//  - Parameters
+//      target: The acceptable queue delay in microseconds, 0 to shed none.
+//      interval: The interval in microseconds.
+//  - Return(None)
+void LoadShedder::configure(long target, long interval) {
+    this->_target = target;
+    this->_interval = interval;
+    this->_intervalEnd = 0;
+    this->_minDelay = -1;
+    this->_overloaded = false;
+}
+
+// Record the queue delay of a request, and decide whether to process it. An
+// interval ends on the first request after it, and an interval without any
+// request is not overloaded. A negative delay, of a request parsed after the
+// clock was read, counts as none.
+//  - Parameters
+//      now: Microseconds of the monotonic clock.
+//      delay: Microseconds from the parse of the request to now.
+//  - Return: Whether to process the request, or refuse it.
+bool LoadShedder::admit(long now, long delay) {
+    if (this->_target <= 0)
+        return true;
+    if (delay < 0)
+        delay = 0;
+    if (now >= this->_intervalEnd) {
+        this->_overloaded = (this->_minDelay > this->_target);
+        this->_minDelay = -1;
+        this->_intervalEnd = now + this->_interval;
+    }
+    if (this->_minDelay == -1 || delay < this->_minDelay)
+        this->_minDelay = delay;
+    return delay <= (this->_overloaded ? this->_target : this->_interval);
+}
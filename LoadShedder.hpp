@@ -0,0 +1,43 @@
+#ifndef LOADSHEDDER_HPP_
+#define LOADSHEDDER_HPP_
+
+//  LoadShedder decides which requests of an event loop to refuse under
+//  overload, from their queue delay: the time from their parse to their
+//  processing. As CoDel does with packets, it looks at the smallest delay of
+//  each interval. If even that one exceeded the target, the queue has stayed
+//  long for the whole interval, which no burst explains: the loop is
+//  overloaded and refuses the requests which waited longer than the target
+//  during the next interval. Otherwise only the requests which waited longer
+//  than a whole interval are refused.
+//  Shedding the requests which waited the longest keeps the delay of the rest
+//  near the target, so the requests served are still answered in time.
+//  - Member variables
+//      _target: the acceptable queue delay in microseconds, 0 to shed none.
+//      _interval: the interval in microseconds.
+//      _intervalEnd: the end of the current interval.
+//      _minDelay: the smallest delay of the current interval, -1 if none.
+//      _overloaded: the smallest delay of the last interval exceeded the target.
+//  - Methods
+//      configure: Set the target and the interval.
+//      admit: Record the delay of a request, and whether to process it.
+//      isOverloaded: Whether the last interval was overloaded.
+class LoadShedder {
+public:
+    LoadShedder();
+
+    void configure(long target, long interval);
+    bool admit(long now, long delay);
+    bool isOverloaded() const { return this->_overloaded; };
+
+private:
+    long _target;
+    long _interval;
+    long _intervalEnd;
+    long _minDelay;
+    bool _overloaded;
+
+    LoadShedder(const LoadShedder&);
+    LoadShedder& operator=(const LoadShedder&);
+};
+
+#endif  // LOADSHEDDER_HPP_
@@ -18,11 +18,15 @@ const char* Log::getPrefix(int logLevel) {
     }
 }
 
+// Print a log line. stdout is locked for the whole line, as worker threads log
+// concurrently.
 void Log::printPrefixed(int logLevel, const char* format, va_list& va) {
-    std::cout << getPrefix(logLevel);
-    std::cout << std::setw(20) << std::right << ":: ";
+    flockfile(stdout);
+    std::fprintf(stdout, "%s%20s", getPrefix(logLevel), ":: ");
     std::vfprintf(stdout, format, va);
-    std::cout << std::endl;
+    std::fputc('\n', stdout);
+    std::fflush(stdout);
+    funlockfile(stdout);
 }
 
 #define LOG_PRINT(LEVEL) va_list va; va_start(va, format); printPrefixed(LEVEL, format, va); va_end(va);
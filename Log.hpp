@@ -5,6 +5,8 @@
 #include <iostream>
 #include <iomanip>
 #include <algorithm>
+#include <cstdarg>
+#include <cstdio>
 
 #ifndef LOG_LEVEL
 #define LOG_LEVEL 5
@@ -12,13 +14,6 @@
 
 class Log {
 public:
-    static void verbose(const char* format, ...);
-    static void debug(const char* format, ...);
-    static void info(const char* format, ...);
-    static void warning(const char* format, ...);
-    static void error(const char* format, ...);
-
-private:
     enum {
         LogVerbose,
         LogDebug,
@@ -26,6 +21,17 @@ private:
         LogWarning,
         LogError
     };
+
+    //  Whether logs of logLevel are printed, to skip formatting arguments of others.
+    static bool isEnabled(int logLevel) { return LOG_LEVEL >= LogError + 1 - logLevel; };
+
+    static void verbose(const char* format, ...);
+    static void debug(const char* format, ...);
+    static void info(const char* format, ...);
+    static void warning(const char* format, ...);
+    static void error(const char* format, ...);
+
+private:
     static const char* getPrefix(int logLevel);
     static void printPrefixed(int logLevel, const char* format, va_list& va);
     static void printError(int logLevel);
@@ -0,0 +1,50 @@
+#include <time.h>
+#include "LoopClock.hpp"
+
+LoopClock::LoopClock()
+: _microseconds(0)
+, _milliseconds(0)
+, _seconds(-1) {
+    this->_httpDate[0] = '\0';
+    this->update();
+}
+
+// Read the clocks of the kernel. The Date header is formatted again only when
+// the second has changed since the last update.
+//  - Parameters(None)
+//  - Return(None)
+void LoopClock::update() {
+    struct timespec now;
+
+    this->_microseconds = readMicroseconds();
+    this->_milliseconds = this->_microseconds / 1000;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec != this->_seconds) {
+        this->_seconds = now.tv_sec;
+        formatHTTPDate(this->_seconds, this->_httpDate);
+    }
+}
+
+// Read the monotonic clock of the kernel.
+//  - Return: microseconds of the monotonic clock.
+long LoopClock::readMicroseconds() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Format time as IMF-fixdate. (RFC 7231 7.1.1.1)
+//  - Parameters
+//      time: Seconds since the Epoch.
+//      buffer: The buffer of HTTPDateSize at least.
+//  - Return: the length of formatted date, 0 on failure.
+std::size_t LoopClock::formatHTTPDate(time_t time, char* buffer) {
+    struct tm tm;
+
+    if (gmtime_r(&time, &tm) == NULL) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    return strftime(buffer, HTTPDateSize, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
@@ -0,0 +1,54 @@
+#ifndef LOOPCLOCK_HPP_
+#define LOOPCLOCK_HPP_
+
+#include <cstddef>
+#include <ctime>
+
+//  LoopClock is the time of an event loop, read from the kernel once per wakeup
+//  by update() rather than by every user. Between two updates it stands still,
+//  which is precise enough for timeouts and HTTP dates. Durations within a
+//  wakeup are measured with readMicroseconds() instead.
+//  The IMF-fixdate of the Date header is formatted only when the second changes.
+//  A clock is owned by one event loop and is not thread-safe.
+//  - Member variables
+//      _microseconds: microseconds of the monotonic clock.
+//      _milliseconds: milliseconds of the monotonic clock.
+//      _seconds: seconds since the Epoch.
+//      _httpDate: IMF-fixdate of _seconds.
+//  - Methods
+//      update: Read the clocks of the kernel.
+//      getMicroseconds: Monotonic time of the wakeup, for measuring the loop.
+//      getMilliseconds: Monotonic time, for timeouts.
+//      getSeconds: Wall-clock time.
+//      getHTTPDate: Wall-clock time as IMF-fixdate, for the Date header.
+//      readMicroseconds: Monotonic time read from the kernel now.
+//      formatHTTPDate: Format 'time' as IMF-fixdate into 'buffer' of HTTPDateSize.
+class LoopClock {
+public:
+    //  HTTPDateSize is the size of a buffer holding an IMF-fixdate with NUL.
+    //  ("Sun, 06 Nov 1994 08:49:37 GMT")
+    enum { HTTPDateSize = 30 };
+
+    LoopClock();
+
+    long getMicroseconds() const { return this->_microseconds; };
+    long getMilliseconds() const { return this->_milliseconds; };
+    time_t getSeconds() const { return this->_seconds; };
+    const char* getHTTPDate() const { return this->_httpDate; };
+
+    void update();
+
+    static long readMicroseconds();
+    static std::size_t formatHTTPDate(time_t time, char* buffer);
+
+private:
+    long _microseconds;
+    long _milliseconds;
+    time_t _seconds;
+    char _httpDate[HTTPDateSize];
+
+    LoopClock(const LoopClock&);
+    LoopClock& operator=(const LoopClock&);
+};
+
+#endif  // LOOPCLOCK_HPP_
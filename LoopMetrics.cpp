@@ -0,0 +1,60 @@
+#include <cstdio>
+#include "LoopMetrics.hpp"
+#include "LoopClock.hpp"
+
+//  Constructor of LoopMetrics.
+//  - Parameters now: The start of the first period.
+LoopMetrics::LoopMetrics(time_t now)
+: _since(now) { }
+
+// Append a report of the period, a line per histogram. Kinds of dispatch not
+// seen in the period are left out.
+//  - Parameters
+//      loopIndex: The event loop, 0 for the main thread.
+//      now: The end of the period.
+//      syscalls: The poller syscalls of the loop since it started.
+//      requests: The requests processed by the loop since it started.
+//      report: The report is appended to it.
+//  - Return(None)
+void LoopMetrics::format(int loopIndex, time_t now, unsigned long syscalls, unsigned long requests, std::string& report) const {
+    char line[128];
+    char date[LoopClock::HTTPDateSize];
+
+    LoopClock::formatHTTPDate(now, date);
+    std::snprintf(line, sizeof(line), "event loop %d at %s: %ld s (times in microseconds)\n",
+        loopIndex, date, static_cast<long>(now - this->_since));
+    report += line;
+    std::snprintf(line, sizeof(line), "  %-30s %lu (%.2f per request), %lu requests\n", "poller syscalls",
+        syscalls, requests ? static_cast<double>(syscalls) / requests : 0.0, requests);
+    report += line;
+    std::snprintf(line, sizeof(line), "  %-30s ", "wait");
+    report += line + this->_wait.format() + "\n";
+    std::snprintf(line, sizeof(line), "  %-30s ", "events per wakeup");
+    report += line + this->_events.format() + "\n";
+    for (int kind = 0; kind < DispatchKindCount; ++kind) {
+        if (this->_dispatch[kind].getCount() == 0)
+            continue;
+        std::snprintf(line, sizeof(line), "  %-30s ", getKindName(kind).c_str());
+        report += line + this->_dispatch[kind].format() + "\n";
+    }
+}
+
+// Forget the values of the period.
+//  - Parameters now: The start of the next period.
+//  - Return(None)
+void LoopMetrics::reset(time_t now) {
+    this->_wait.reset();
+    this->_events.reset();
+    for (int kind = 0; kind < DispatchKindCount; ++kind)
+        this->_dispatch[kind].reset();
+    this->_since = now;
+}
+
+// The name of a kind of dispatch.
+//  - Parameters kind: EventType or TimeoutDispatch.
+//  - Return: The name.
+std::string LoopMetrics::getKindName(int kind) {
+    if (kind == TimeoutDispatch)
+        return "EF_TIMER";
+    return EventContext::eventTypeToString(static_cast<EventContext::EventType>(kind));
+}
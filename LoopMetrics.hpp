@@ -0,0 +1,72 @@
+#ifndef LOOPMETRICS_HPP_
+#define LOOPMETRICS_HPP_
+
+#include <ctime>
+#include <string>
+#include "Histogram.hpp"
+#include "EventContext.hpp"
+
+//  LoopMetrics records where the time of an event loop goes, as Histograms of
+//  the time blocked in EventHandler::checkEvent(), the events per wakeup and the
+//  time of each dispatch per EventType, in microseconds. Expired timeouts are
+//  counted as their own kind, TimeoutDispatch.
+//  The histograms cover the period since the last reset(), so an export shows
+//  the recent behavior of the loop.
+//  - Member variables
+//      _wait: microseconds blocked per wakeup.
+//      _events: events per wakeup.
+//      _dispatch: microseconds per dispatch, by EventType or TimeoutDispatch.
+//      _since: the start of the period, in seconds since the Epoch.
+//  - Methods
+//      recordWakeup: Count a wakeup after 'waitTime' with 'events'.
+//      recordDispatch: Count a dispatch of 'kind' which took 'elapsed'.
+//      format: Append a report of the period to 'report', a line per histogram,
+//          after the totals of poller syscalls and requests of the loop.
+//      reset: Start a new period at 'now'.
+//      getKindName: The name of a kind of dispatch.
+class LoopMetrics {
+public:
+    enum {
+        TimeoutDispatch = EventContext::EV_Count,
+        DispatchKindCount,
+    };
+
+    explicit LoopMetrics(time_t now);
+
+    void recordWakeup(long waitTime, int events);
+    void recordDispatch(int kind, long elapsed);
+    void format(int loopIndex, time_t now, unsigned long syscalls, unsigned long requests, std::string& report) const;
+    void reset(time_t now);
+
+    static std::string getKindName(int kind);
+
+private:
+    Histogram _wait;
+    Histogram _events;
+    Histogram _dispatch[DispatchKindCount];
+    time_t _since;
+
+    LoopMetrics(const LoopMetrics&);
+    LoopMetrics& operator=(const LoopMetrics&);
+};
+
+//  Count a wakeup of the event loop.
+//  - Parameters
+//      waitTime: Microseconds blocked in checkEvent().
+//      events: The number of events taken.
+//  - Return(None)
+inline void LoopMetrics::recordWakeup(long waitTime, int events) {
+    this->_wait.record(waitTime > 0 ? waitTime : 0);
+    this->_events.record(events > 0 ? events : 0);
+}
+
+//  Count a dispatch.
+//  - Parameters
+//      kind: EventType of the event or task, or TimeoutDispatch.
+//      elapsed: Microseconds taken.
+//  - Return(None)
+inline void LoopMetrics::recordDispatch(int kind, long elapsed) {
+    this->_dispatch[kind].record(elapsed > 0 ? elapsed : 0);
+}
+
+#endif  // LOOPMETRICS_HPP_
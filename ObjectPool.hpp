@@ -0,0 +1,144 @@
+#ifndef OBJECTPOOL_HPP_
+#define OBJECTPOOL_HPP_
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+//  PoolStats is the occupancy of an ObjectPool.
+//  - Member variables
+//      capacity: The number of objects the slabs hold.
+//      inUse: The number of objects allocated.
+//      peak: The most objects allocated at once.
+//      slabs: The number of slabs.
+struct PoolStats {
+    std::size_t capacity;
+    std::size_t inUse;
+    std::size_t peak;
+    std::size_t slabs;
+};
+
+//  ObjectPool keeps the storage of objects of T in slabs and recycles it through
+//  a free list, so frequent objects do not go to the general allocator.
+//  Slabs are never moved nor freed before the pool, so addresses are stable.
+//  An object is built on allocate() with placement new and given back with
+//  destroy(). A pool is owned by one event loop and is not thread-safe.
+//  - Member variables
+//      _slabSize: the number of objects per slab.
+//      _slabs: storage allocated.
+//      _freeList: the slots not in use, linked through their storage.
+//      _stats: occupancy of the pool.
+//  - Methods
+//      allocate: Take the storage of an object, growing the pool by a slab if needed.
+//      deallocate: Give back the storage taken by allocate().
+//      destroy: Destruct the object and give back its storage.
+template <typename T>
+class ObjectPool {
+public:
+    ObjectPool(std::size_t slabSize, std::size_t preallocate);
+    ~ObjectPool();
+
+    const PoolStats& getStats() const { return this->_stats; };
+
+    void* allocate();
+    void deallocate(void* storage);
+    void destroy(T* object);
+
+private:
+    union Slot {
+        char storage[sizeof(T)];
+        Slot* next;
+        long double alignLongDouble;
+        long long alignLongLong;
+        void* alignPointer;
+    };
+
+    const std::size_t _slabSize;
+    std::vector<Slot*> _slabs;
+    Slot* _freeList;
+    PoolStats _stats;
+
+    void grow();
+
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+};
+
+//  Constructor of ObjectPool.
+//  - Parameters
+//      slabSize: The number of objects per slab, 1 at least.
+//      preallocate: The number of objects to allocate storage for at once.
+template <typename T>
+ObjectPool<T>::ObjectPool(std::size_t slabSize, std::size_t preallocate)
+: _slabSize(slabSize)
+, _freeList(NULL) {
+    this->_stats.capacity = 0;
+    this->_stats.inUse = 0;
+    this->_stats.peak = 0;
+    this->_stats.slabs = 0;
+    while (this->_stats.capacity < preallocate)
+        this->grow();
+}
+
+//  Destructor of ObjectPool.
+//  Frees the slabs. Objects still in use are not destructed.
+template <typename T>
+ObjectPool<T>::~ObjectPool() {
+    for (typename std::vector<Slot*>::iterator iter = this->_slabs.begin();
+        iter != this->_slabs.end(); ++iter)
+        ::operator delete(*iter);
+}
+
+//  Take the storage of an object.
+//  - Return: storage for an object of T, to be built with placement new.
+template <typename T>
+void* ObjectPool<T>::allocate() {
+    if (this->_freeList == NULL)
+        this->grow();
+
+    Slot* slot = this->_freeList;
+
+    this->_freeList = slot->next;
+    if (++this->_stats.inUse > this->_stats.peak)
+        this->_stats.peak = this->_stats.inUse;
+    return slot->storage;
+}
+
+//  Give back the storage taken by allocate(), without destructing.
+//  - Parameters storage: The storage to give back.
+//  - Return(None)
+template <typename T>
+void ObjectPool<T>::deallocate(void* storage) {
+    Slot* slot = static_cast<Slot*>(storage);
+
+    slot->next = this->_freeList;
+    this->_freeList = slot;
+    --this->_stats.inUse;
+}
+
+//  Destruct the object and give back its storage. NULL is ignored.
+//  - Parameters object: The object built on the storage of this pool.
+//  - Return(None)
+template <typename T>
+void ObjectPool<T>::destroy(T* object) {
+    if (object == NULL)
+        return;
+    object->~T();
+    this->deallocate(object);
+}
+
+//  Allocate a slab and put its slots on the free list.
+template <typename T>
+void ObjectPool<T>::grow() {
+    Slot* slab = static_cast<Slot*>(::operator new(sizeof(Slot) * this->_slabSize));
+
+    this->_slabs.push_back(slab);
+    for (std::size_t i = this->_slabSize; i > 0; --i) {
+        slab[i - 1].next = this->_freeList;
+        this->_freeList = &slab[i - 1];
+    }
+    this->_stats.capacity += this->_slabSize;
+    ++this->_stats.slabs;
+}
+
+#endif  // OBJECTPOOL_HPP_
@@ -0,0 +1,95 @@
+#ifndef POLLER_HPP_
+#define POLLER_HPP_
+
+#include <stdint.h>
+#include <vector>
+#include <stdexcept>
+
+struct msghdr;
+
+//  EventFilter indicates which condition of an ident the event watches.
+//  - Constants
+//      EF_READ: The ident has data to read.
+//      EF_WRITE: The ident is able to be written.
+//      EF_TIMER: The timeout of the ident has expired. (delivered by EventHandler)
+//      EF_EXIT: The process ident has exited. (kqueue; on Linux the exit of a
+//          process is watched as EF_READ of its pidfd)
+//      EF_ACCEPTED: A client has been accepted on the ident. (completion backends)
+//      EF_RECEIVED: Bytes have been received from the ident. (completion backends)
+//      EF_SENT: A send() to the ident has completed. (completion backends)
+enum EventFilter {
+    EF_READ,
+    EF_WRITE,
+    EF_TIMER,
+    EF_EXIT,
+    EF_ACCEPTED,
+    EF_RECEIVED,
+    EF_SENT,
+};
+
+//  Event is the unit of a triggered event, independent from the backend.
+//  - Member variables
+//      ident: The identifier of event. (fd in most case)
+//      filter: The filter of triggered event.
+//      data: Filter-specific data. (bytes available for EF_READ if known, kind of EF_TIMER,
+//          the result of the syscall done by the kernel for a completion: the client
+//          accepted, the bytes received or sent, or -errno)
+//      udata: The user data registered with event.
+//      buffer: The bytes received of EF_RECEIVED, lent by the poller until the
+//          next wait(). NULL for the other filters.
+struct Event {
+    int ident;
+    int filter;
+    intptr_t data;
+    void* udata;
+    const char* buffer;
+};
+
+//  Poller is the interface of I/O multiplexing backends used by EventHandler.
+//  The implementation is selected at build time (see Makefile).
+//  Changes are queued and applied to the kernel on next wait(), so errors of a
+//  change are not reported to its caller.
+//  - Member variables
+//      _syscallCount: the number of syscalls made by the backend.
+//  - Methods
+//      add: Watch 'filter' condition of 'fd'. With 'edgeTriggered', the event is
+//          reported only when the condition newly arises, so the handler must
+//          drain 'fd'. Backends without edge-triggering report it level-triggered.
+//      remove: Stop watching 'filter' condition of 'fd'.
+//      enable: Resume watching 'filter' condition of 'fd' disabled before.
+//      disable: Pause watching 'filter' condition of 'fd' keeping its registration.
+//      forget: Drop every condition watched on 'fd'. Called before 'fd' is closed.
+//      wait: Apply queued changes, wait for events up to 'timeout' milliseconds
+//          (-1 for no limit) and append them to 'eventlist'.
+//      isCompletionBased: Whether the backend does the I/O itself and reports its
+//          result, rather than readiness. Such a backend also takes EF_ACCEPTED
+//          and EF_RECEIVED in add(), which accept or receive on 'fd' for as long
+//          as the watch is enabled, and send(). Disabling or removing them
+//          cancels the I/O in flight, but what completed before is delivered.
+//      send: Send 'message' on 'fd' once, reported as EF_SENT. The message and
+//          the bytes it points to must stay untouched until then.
+class Poller {
+public:
+    Poller() : _syscallCount(0) { };
+    virtual ~Poller() { };
+
+    unsigned long getSyscallCount() const { return _syscallCount; };
+
+    virtual void add(int filter, int fd, void* udata, bool edgeTriggered) = 0;
+    virtual void remove(int filter, int fd) = 0;
+    virtual void enable(int filter, int fd) = 0;
+    virtual void disable(int filter, int fd) = 0;
+    virtual void forget(int fd) = 0;
+    virtual int wait(std::vector<Event>& eventlist, int maxEvent, long timeout) = 0;
+    virtual bool isCompletionBased() const { return false; };
+    virtual void send(int, struct msghdr*, void*) {
+        throw std::logic_error("The poller does no completion I/O.");
+    };
+
+    static Poller* create();
+
+protected:
+    unsigned long _syscallCount;
+};
+
+#endif  // POLLER_HPP_
@@ -1,30 +1,74 @@
-#include <sys/socket.h>
+#include <cerrno>
 #include <sstream>
 #include <string>
 #include <cctype>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
 #include "Request.hpp"
 #include "constant.hpp"
 
 static void tolower(std::string& value);
+static bool hasToken(const std::string& list, const char* token);
+
+//  Constructor of RequestBuffers, with the default sizes.
+RequestBuffers::RequestBuffers()
+: header(DEFAULT_CLIENT_HEADER_BUFFER_SIZE, BUFFER_POOL_IDLE_LIMIT)
+, largeHeader(DEFAULT_LARGE_HEADER_BUFFER_SIZE, BUFFER_POOL_IDLE_LIMIT)
+, body(DEFAULT_CLIENT_BODY_BUFFER_SIZE, BUFFER_POOL_IDLE_LIMIT)
+, largeHeaderCount(DEFAULT_LARGE_HEADER_BUFFERS)
+{ }
+
+//  Set the sizes of the buffers.
+//  - Parameters
+//      headerSize: 'client_header_buffer_size'.
+//      largeHeaderCount, largeHeaderSize: 'large_client_header_buffers'.
+//      bodySize: 'client_body_buffer_size'.
+//  - Return(None)
+void RequestBuffers::configure(std::size_t headerSize, std::size_t largeHeaderCount, std::size_t largeHeaderSize, std::size_t bodySize) {
+    this->header.setBlockSize(headerSize);
+    this->largeHeader.setBlockSize(largeHeaderSize);
+    this->body.setBlockSize(bodySize);
+    this->largeHeaderCount = largeHeaderCount;
+}
 
+//  Constructor of Request for a listening socket, which receives nothing.
 Request::Request()
-: _parsingStatus(S_NONE)
+: _buffers(NULL)
+, _headerScanned(0)
+, _headerSize(0)
+, _method(HTTP::RM_UNKNOWN)
+, _majorVersion('1')
+, _minorVersion('1')
+, _bodyWritten(0)
+, _parsingStatus(S_NONE)
+{ }
+
+//  Constructor of Request for a client.
+//  - Parameters buffers: The pools the message is received into.
+Request::Request(RequestBuffers& buffers)
+: _buffers(&buffers)
+, _headerScanned(0)
+, _headerSize(0)
+, _method(HTTP::RM_UNKNOWN)
+, _majorVersion('1')
+, _minorVersion('1')
+, _bodyWritten(0)
+, _parsingStatus(S_NONE)
 { }
 
 //  Destructor of Request object.
-Request::~Request() {
-    for (HeaderSectionType::iterator iter = this->_headerSection.begin(); iter != this->_headerSection.end(); ++iter)
-        delete *iter;
-}
+Request::~Request() { }
 
 //  Returns first header field value of name.
 //  - Parameters name: The name to search value.
 //  - Return: The first header field value of name
 const std::string* Request::getFirstHeaderFieldValueByName(const std::string& name) const {
     for (HeaderSectionType::const_iterator iter = this->_headerSection.begin(); iter != this->_headerSection.end(); ++iter)
-        if ((*iter)->first == name)
-            return &(*iter)->second;
+        if (iter->first == name)
+            return &iter->second;
 
     return (NULL);
 }
@@ -33,41 +77,142 @@ const std::string* Request::getFirstHeaderFieldValueByName(const std::string& na
 //  - Parameter(None)
 //  - Return(None)
 void Request::clearMessage() {
-    this->_message.clear();
+    this->_received.clear();
+    this->_headerScanned = 0;
+}
+
+//  Whether the client lets the connection be kept open after the response:
+//  HTTP/1.1 unless it sent 'Connection: close', HTTP/1.0 only if it sent
+//  'Connection: keep-alive'. (RFC 7230 6.3)
+//  - Parameters(None)
+//  - Return: Whether the connection may persist.
+bool Request::isKeepAlive() const {
+    const std::string* connection = this->getFirstHeaderFieldValueByName("connection");
+    const bool persistentByDefault = this->_majorVersion > '1'
+        || (this->_majorVersion == '1' && this->_minorVersion >= '1');
+
+    if (connection == NULL)
+        return persistentByDefault;
+    if (persistentByDefault)
+        return !hasToken(*connection, "close");
+    return hasToken(*connection, "keep-alive");
+}
+
+//  Forget what was parsed from the last request, so a request on a persistent
+//  connection is parsed from a clean state. The message received is kept, as
+//  it may hold the next request.
+//  - Parameter(None)
+//  - Return(None)
+void Request::clearParsed() {
+    this->_method = HTTP::RM_UNKNOWN;
+    this->_methodString.clear();
+    this->_target.clear();
+    this->_targetToken.clear();
+    this->_majorVersion = '1';
+    this->_minorVersion = '1';
+    this->_headerSection.clear();
+    this->_body.clear();
+    this->_bodyWritten = 0;
+}
+
+//  Take the body over, leaving it empty, so it is handed on without a copy.
+//  - Parameters body: Set to the body.
+//  - Return(None)
+void Request::takeBody(std::string& body) {
+    body.swap(this->_body);
+    this->_body.clear();
+    this->_bodyWritten = 0;
 }
 
 //  Receive message from client. If the message is ready to process, parse it.
-//  - Parameters clientSocketFD: The fd to recv().
+//  - Parameters
+//      clientSocketFD: The fd to recv().
+//      sizeHint: The bytes available on the fd if known by the poller, 0 otherwise.
+//      drain: Receive until the fd would block, as it is watched edge-triggered.
+//      parse: Parse a request. Without it, the message is only buffered, up to
+//          PIPELINE_BUFFER_SIZE, as the last request is still processed.
 //  - Return: See the type definition.
-ReturnCaseOfRecv Request::receive(int clientSocketFD) {
+ReturnCaseOfRecv Request::receive(int clientSocketFD, std::size_t sizeHint, bool drain, bool parse) {
     if (!(this->isStatusNone() || this->isStatusParsingBody()))
         return RCRECV_ALREADY_PROCESSING_WAIT;
+    if (!parse && this->_received.size() >= PIPELINE_BUFFER_SIZE)
+        return RCRECV_ALREADY_PROCESSING_WAIT;
 
-    ssize_t result = this->receiveMessage(clientSocketFD);
-    if (result == -1)
-        return RCRECV_ERROR;
-    else if (result == 0)
-        return RCRECV_ZERO;
+    const std::size_t messageSize = this->_received.size();
+    const ReturnCaseOfRecv result = this->receiveMessage(clientSocketFD, sizeHint, drain);
+    if (result == RCRECV_ERROR || result == RCRECV_ZERO)
+        return result;
+    if (this->_received.size() == messageSize || !parse)
+        return result;
 
-    ReturnCaseOfRecv returnCode;
-    if (this->isReadyToProcess() || this->isStatusParsingBody()) {
-        this->_targetToken.clear();
-        this->_parsingStatus = this->parseMessage();
-        if (this->_parsingStatus == S_PARSING_FAIL)
-            this->_message.clear();
-        returnCode = (this->_parsingStatus == S_PARSING_BODY) ? RCRECV_SOME : RCRECV_PARSING_FINISH;
+    const ReturnCaseOfRecv returnCode = this->parseReceived();
+
+    return (returnCode == RCRECV_SOME) ? result : returnCode;
+}
+
+//  Take bytes received by the kernel from client, as receive() does with those
+//  it reads. The bytes are always kept, as they have left the socket: beyond
+//  PIPELINE_BUFFER_SIZE, or while a request parsed waits to be taken, the
+//  caller is told to stop receiving.
+//  - Parameters
+//      data: The bytes received.
+//      length: The number of bytes, 1 at least.
+//      parse: Parse a request. Without it, the message is only buffered, as
+//          the last request is still processed.
+//  - Return: See the type definition.
+ReturnCaseOfRecv Request::receiveCompleted(const char* data, std::size_t length, bool parse) {
+    while (length > 0) {
+        std::size_t blockCount;
+        const std::size_t copied = this->_received.append(data, length, this->nextBlockPool(blockCount));
+
+        data += copied;
+        length -= copied;
     }
-    else
-        returnCode = RCRECV_SOME;
+    if (!(this->isStatusNone() || this->isStatusParsingBody()))
+        return RCRECV_ALREADY_PROCESSING_WAIT;
+    if (!parse)
+        return (this->_received.size() >= PIPELINE_BUFFER_SIZE) ? RCRECV_ALREADY_PROCESSING_WAIT : RCRECV_SOME;
+    return this->parseReceived();
+}
+
+//  Parse a request from the message received, if it is ready to process.
+//  A header section beyond RequestBuffers::getHeaderLimit() fails parsing.
+//  - Parameters(None)
+//  - Return
+//      RCRECV_SOME: No request is complete yet.
+//      RCRECV_PARSING_FINISH: A request has been parsed, or failed parsing.
+ReturnCaseOfRecv Request::parseReceived() {
+    const std::size_t headerLimit = this->_buffers->getHeaderLimit();
 
-    return returnCode;
+    if (this->isStatusParsingBody() || this->isReadyToProcess()) {
+        this->_targetToken.clear();
+        if (this->isStatusParsingBody() || this->_headerSize <= headerLimit)
+            this->_parsingStatus = this->parseMessage();
+        else
+            this->_parsingStatus = S_PARSING_FAIL;
+    } else if (this->_received.size() > headerLimit)
+        this->_parsingStatus = S_PARSING_FAIL;
+    else
+        return RCRECV_SOME;
+    if (this->_parsingStatus == S_PARSING_FAIL)
+        this->clearMessage();
+    return (this->_parsingStatus == S_PARSING_BODY) ? RCRECV_SOME : RCRECV_PARSING_FINISH;
 }
 
-//  Returns whether Request received the end of header section or not.
+//  Returns whether Request received the end of header section or not. The
+//  search goes on from where the last one stopped, so a header section
+//  received in many reads is scanned once.
 //  - Parameters(None)
 //  - Return: Whether request received the end of header section or not.
-bool Request::isReadyToProcess() const {
-    return (this->_message.find("\r\n\r\n") != std::string::npos);
+bool Request::isReadyToProcess() {
+    const std::size_t found = this->_received.find("\r\n\r\n", this->_headerScanned);
+
+    if (found == BufferChain::npos) {
+        this->_headerScanned = std::max(this->_headerScanned, this->_received.size() - std::min<std::size_t>(this->_received.size(), 3));
+        return false;
+    }
+    this->_headerSize = found + 4;
+    return true;
 }
 
 //  Return whether the body is chunked or not.
@@ -87,49 +232,82 @@ bool Request::isChunked() const {
         return false;
 }
 
-//  Receive message from client.
-//  - Parameters clientSocketFD: The fd to recv().
-//  - Return: the result of recv() call.
-ssize_t Request::receiveMessage(int clientSocketFD) {
-    char buf[BUF_SIZE];
-
-    ssize_t result = recv(clientSocketFD, buf, BUF_SIZE - 1, 0);
-    if (result <= 0)
-        return result;
-    buf[result] = '\0';
-    this->appendMessage(buf);
-
-    return result;
+//  Receive message from client into the message, up to DRAIN_BUDGET bytes.
+//  Reads are sized by 'sizeHint' if known. Without 'drain', it stops once the
+//  bytes hinted or a short read shows the socket empty, as the poller reports
+//  the rest. With 'drain', it goes on until recv() would block.
+//  Until the end of a header section is received, a block is taken per read: a
+//  block of RequestBuffers::header for a new request, then blocks of
+//  largeHeader once it does not fit in one. What follows, the body or the
+//  requests pipelined, is received into blocks of body.
+//  - Parameters
+//      clientSocketFD: The fd to recv().
+//      sizeHint: The bytes available on the fd if known, 0 otherwise.
+//      drain: Receive until recv() would block.
+//  - Return
+//      RCRECV_ERROR, RCRECV_ZERO: Nothing received, by an error or the end of stream.
+//      RCRECV_SOME: Received what the socket had, possibly nothing.
+//      RCRECV_SOME_LEFT: Received some, stopped by the budget or the end of stream.
+ReturnCaseOfRecv Request::receiveMessage(int clientSocketFD, std::size_t sizeHint, bool drain) {
+    std::size_t received = 0;
+
+    while (received < DRAIN_BUDGET) {
+        std::size_t readSize = (sizeHint > received) ? sizeHint - received : BUF_SIZE;
+        if (readSize > DRAIN_BUDGET - received)
+            readSize = DRAIN_BUDGET - received;
+
+        std::size_t blockCount;
+        BufferPool& pool = this->nextBlockPool(blockCount);
+        const ssize_t result = this->_received.receive(clientSocketFD, readSize, pool, blockCount);
+
+        if (result < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return RCRECV_SOME;
+            return received > 0 ? RCRECV_SOME_LEFT : RCRECV_ERROR;
+        }
+        if (result == 0)
+            return received > 0 ? RCRECV_SOME_LEFT : RCRECV_ZERO;
+        received += result;
+        if (!drain && (static_cast<std::size_t>(result) < readSize || (sizeHint > 0 && received >= sizeHint)))
+            return RCRECV_SOME;
+    }
+    return RCRECV_SOME_LEFT;
 }
 
-//  Append received message from client.
-//  - Parameters message: The string of message received from client.
-//  - Return(None)
-void Request::appendMessage(const char* message) {
-    this->_message += message;
+//  The pool the next block of the message is taken from: until the end of a
+//  header section is received, RequestBuffers::header for a new request, then
+//  largeHeader, a block at a time. body after it.
+//  - Parameters blockCount: Set to the most blocks taken by a read.
+//  - Return: The pool.
+BufferPool& Request::nextBlockPool(std::size_t& blockCount) {
+    if (!this->isStatusParsingBody() && !this->isReadyToProcess()) {
+        blockCount = 1;
+        return this->_received.empty() ? this->_buffers->header : this->_buffers->largeHeader;
+    }
+    blockCount = RECEIVE_IOV_COUNT;
+    return this->_buffers->body;
 }
 
-//  Parse HTTP request message.
+//  Parse HTTP request message. The header section, found by isReadyToProcess(),
+//  is moved out of the message to be parsed, and the body is moved to _body as
+//  it is received.
 //  - Parameters(None)
 //  - Return: Whether the parsing succeeded or not.
 Request::Status Request::parseMessage() {
-    std::istringstream iss(this->_message);
-    std::size_t parsedPositionOfMessage = 0;
-
     if (!this->isStatusParsingBody()) {
+        std::string header;
         std::string line;
 
+        this->clearParsed();
+        this->_received.moveTo(header, this->_headerSize);
+        this->_headerScanned = 0;
+
+        std::istringstream iss(header);
         if (!std::getline(iss, line, '\r'))
             return S_PARSING_FAIL;
         if (this->parseRequestLine(line) == PR_FAIL)
             return S_PARSING_FAIL;
 
-        for (HeaderSectionType::iterator itr = this->_headerSection.begin();
-            itr != this->_headerSection.end();
-            itr++) {
-                delete *itr;
-            }
-        this->_headerSection.clear();
         while (true) {
             iss.get();
             if (!std::getline(iss, line, '\r'))
@@ -143,15 +321,13 @@ Request::Status Request::parseMessage() {
         if (iss.get() != '\n')
             return S_PARSING_FAIL;
 
-        this->_body.clear();
-        parsedPositionOfMessage = iss.tellg();
         this->_parsingStatus = S_PARSING_BODY;
     }
 
     ParsingResult result;
 
     if (this->isChunked()) {
-        result = this->parseChunkToBody(iss, parsedPositionOfMessage);
+        result = this->parseChunkToBody();
     }
     else {
         const std::string* headerFieldValue = getFirstHeaderFieldValueByName("content-length");
@@ -163,9 +339,7 @@ Request::Status Request::parseMessage() {
                 return S_PARSING_FAIL;
             const std::size_t bodySize = static_cast<std::size_t>(ssizeBodySize);
             const std::size_t sizeLeft = bodySize - this->_body.length();
-            std::string moreBody = this->_message.substr(parsedPositionOfMessage, sizeLeft);
-            this->_body += moreBody;
-            parsedPositionOfMessage += moreBody.length();
+            this->_received.moveTo(this->_body, std::min(sizeLeft, this->_received.size()));
             if (this->_body.length() != bodySize)
                 result = PR_EOF;
             else
@@ -179,10 +353,6 @@ Request::Status Request::parseMessage() {
         }
     }
 
-    this->_reducedBody = this->_body;
-
-    this->_message.erase(0, parsedPositionOfMessage);
-
     if (result == PR_FAIL)
         return S_PARSING_FAIL;
     else if (result == PR_EOF) {
@@ -255,32 +425,41 @@ ParsingResult Request::parseHeader(const std::string& headerField) {
         value.erase(value.length() - 1);
 
     tolower(name);
-    this->_headerSection.push_back(new HeaderSectionElementType(name, value)); // leaks
+    this->_headerSection.push_back(HeaderSectionElementType());
+    this->_headerSection.back().first.swap(name);
+    this->_headerSection.back().second.swap(value);
 
     return PR_SUCCESS;
 }
 
-//  Parse chunked body.
-//  - Parameters iss: input string stream of body.
-//  - Return: Whether the parsing succeeded or not.
-ParsingResult Request::parseChunkToBody(std::istringstream& iss, std::size_t& parsedPositionOfMessage) {
+//  Parse chunked body. Each chunk is moved to _body once it is received
+//  whole, with its CRLF. Chunk extensions are ignored.
+//  - Parameters(None)
+//  - Return: Whether the parsing succeeded or not, PR_EOF to receive more.
+ParsingResult Request::parseChunkToBody() {
     while (true) {
-        const std::ios_base::fmtflags ff = iss.flags();
-        iss.setf(std::ios_base::hex, std::ios_base::basefield);
-        int chunkLength;
-        if (std::isspace(iss.peek()))
-            return iss.eof() ? PR_EOF : PR_FAIL;
-        iss >> chunkLength;
-        iss.flags(ff);
-        iss.get();
-        iss.get();
-        std::string chunk(chunkLength + 1, '\0');
-        iss.read(&chunk[0], chunkLength);
-        if (iss.get() != '\r' || iss.get() != '\n')
-            return iss.eof() ? PR_EOF : PR_FAIL;
-
-        this->_body += chunk;
-        parsedPositionOfMessage = iss.tellg();
+        const std::size_t lineLength = this->_received.find("\r\n", 0);
+        if (lineLength == BufferChain::npos)
+            return PR_EOF;
+
+        std::string line;
+        this->_received.copy(lineLength, line);
+        if (line.empty() || !std::isxdigit(line[0]))
+            return PR_FAIL;
+        char* end;
+        const long chunkLength = std::strtol(line.c_str(), &end, 16);
+        if (chunkLength < 0 || chunkLength >= INT_MAX || (*end != '\0' && *end != ';'))
+            return PR_FAIL;
+
+        const std::size_t chunkEnd = lineLength + 2 + chunkLength;
+        if (this->_received.size() < chunkEnd + 2)
+            return PR_EOF;
+        if (this->_received.at(chunkEnd) != '\r' || this->_received.at(chunkEnd + 1) != '\n')
+            return PR_FAIL;
+
+        this->_received.consume(lineLength + 2);
+        this->_received.moveTo(this->_body, chunkLength);
+        this->_received.consume(2);
 
         if (chunkLength == 0)
             break;
@@ -321,4 +500,28 @@ void Request::updateParsedTarget(std::string parsed){
 static void tolower(std::string& value) {
     for (std::string::iterator iter = value.begin(); iter != value.end(); ++iter)
         *iter = tolower(*iter);
-}
\ No newline at end of file
+}
+
+//  Whether a comma-separated list of a header field holds a token, compared
+//  case-insensitively.
+//  - Parameters
+//      list: The value of the header field.
+//      token: The token in lower case.
+//  - Return: Whether the list holds the token.
+static bool hasToken(const std::string& list, const char* token) {
+    std::istringstream iss(list);
+    std::string element;
+
+    while (std::getline(iss, element, ',')) {
+        const std::string::size_type begin = element.find_first_not_of(" \t");
+        const std::string::size_type end = element.find_last_not_of(" \t");
+
+        if (begin == std::string::npos)
+            continue;
+        element = element.substr(begin, end - begin + 1);
+        tolower(element);
+        if (element == token)
+            return true;
+    }
+    return false;
+}
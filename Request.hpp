@@ -1,8 +1,10 @@
 #ifndef REQUEST_HPP_
 #define REQUEST_HPP_
 
+#include <sys/types.h>
 #include <string>
 #include <vector>
+#include "BufferChain.hpp"
 
 //  ParsingResult indicates the result of parsing.
 enum ParsingResult {
@@ -29,19 +31,52 @@ enum RequestMethod {
 //      RCRECV_ERROR: An error has occured.
 //      RCRECV_ZERO: Nothing received.
 //      RCRECV_SOME: Received some message but not enough to process.
+//      RCRECV_SOME_LEFT: RCRECV_SOME, but stopped by the budget before draining the socket.
 //      RCRECV_PARSING_FAIL: Received enough message to process, but failed parsing.
 //      RCRECV_PARSING_FINISH: Received enough message to process, and succeeded parsing.
 enum ReturnCaseOfRecv {
     RCRECV_ERROR = -1,
     RCRECV_ZERO,
     RCRECV_SOME,
+    RCRECV_SOME_LEFT,
     RCRECV_PARSING_FINISH,
     RCRECV_ALREADY_PROCESSING_WAIT,
 };
 
+//  RequestBuffers are the BufferPools the requests of an event loop are
+//  received into, shared by its client connections.
+//  - Member variables
+//      header: blocks of 'client_header_buffer_size', the first of a request.
+//      largeHeader: blocks of 'large_client_header_buffers', the rest of a header
+//          section which does not fit in the first.
+//      largeHeaderCount: the number of blocks of largeHeader a header section
+//          may take, which bounds its size.
+//      body: blocks of 'client_body_buffer_size', for the body.
+//  - Methods
+//      configure: Set the sizes, before any request is received.
+//      getHeaderLimit: The most bytes of a header section.
+struct RequestBuffers {
+    BufferPool header;
+    BufferPool largeHeader;
+    BufferPool body;
+    std::size_t largeHeaderCount;
+
+    RequestBuffers();
+
+    void configure(std::size_t headerSize, std::size_t largeHeaderCount, std::size_t largeHeaderSize, std::size_t bodySize);
+    std::size_t getHeaderLimit() const { return this->largeHeaderCount * this->largeHeader.getBlockSize(); };
+
+private:
+    RequestBuffers(const RequestBuffers&);
+    RequestBuffers& operator=(const RequestBuffers&);
+};
+
 //  Accumulate HTTP request message and parse it and store.
 //  - member variables
-//      _message: Accumulated HTTP request message.
+//      _buffers: the pools the message is received into, NULL for a listening socket.
+//      _received: Accumulated HTTP request message, consumed as it is parsed.
+//      _headerScanned: the bytes of _received searched for the end of the header section.
+//      _headerSize: the size of the header section found, with its empty line.
 //
 //      _method: Parsed request method.
 //      _target: Parsed target resource URI.
@@ -49,6 +84,7 @@ enum ReturnCaseOfRecv {
 //      _minorVersion: Parsed major version.
 //      _headerSection: Parsed header field vector.
 //      _body: Parsed payload body.
+//      _bodyWritten: the bytes of _body written to a CGI script.
 //
 //      _parsingStatus: store parsing status.
 class Request {
@@ -62,9 +98,10 @@ public:
     };
 
     typedef std::pair<std::string, std::string> HeaderSectionElementType;
-    typedef std::vector<HeaderSectionElementType*> HeaderSectionType;
+    typedef std::vector<HeaderSectionElementType> HeaderSectionType;
 
     Request();
+    explicit Request(RequestBuffers& buffers);
     ~Request();
 
     HTTP::RequestMethod getMethod() const { return this->_method; };
@@ -72,23 +109,31 @@ public:
     const std::string& getTargetResourceURI() const { return this->_target; };
     char getMajorVersion() const { return this->_majorVersion; };
     char getMinorVersion() const { return this->_minorVersion; };
-    std::string getMessage() const { return this->_message; };
     const std::string* getFirstHeaderFieldValueByName(const std::string& name) const;
     const std::string& getBody() const { return this->_body; };
-    const std::string& getReducedBody() const { return this->_reducedBody; };
+    std::size_t getBodyWritten() const { return this->_bodyWritten; };
     const std::vector<std::string> getTargetToken() const { return this->_targetToken; };
 
     void clearMessage();
-    void reduceBody(size_t index) { _reducedBody.erase(0, index); };
+    void reduceBody(size_t length) { this->_bodyWritten += length; };
+    void takeBody(std::string& body);
     void resetStatus() { this->_parsingStatus = S_NONE; };
     bool isParsingFail() const { return this->_parsingStatus == S_PARSING_FAIL; };
     bool isLengthRequired() const { return this->_parsingStatus == S_LENGTH_REQUIRED; };
+    bool isIdle() const { return this->_received.empty() && this->_parsingStatus == S_NONE; };
+    bool isParsed() const { return !this->isStatusNone() && !this->isStatusParsingBody(); };
+    bool isKeepAlive() const;
 
-    ReturnCaseOfRecv receive(int clientSocketFD);
+    ReturnCaseOfRecv receive(int clientSocketFD, std::size_t sizeHint, bool drain, bool parse);
+    ReturnCaseOfRecv receiveCompleted(const char* data, std::size_t length, bool parse);
+    ReturnCaseOfRecv parseReceived();
     void updateParsedTarget(std::string parsed);
 
 private:
-    std::string _message;
+    RequestBuffers* _buffers;
+    BufferChain _received;
+    std::size_t _headerScanned;
+    std::size_t _headerSize;
 
     HTTP::RequestMethod _method;
     std::string _methodString;
@@ -100,25 +145,29 @@ private:
     HeaderSectionType _headerSection;
 
     std::string _body;
-    std::string _reducedBody;
+    std::size_t _bodyWritten;
 
     Status _parsingStatus;
 
-    bool isReadyToProcess() const;
+    bool isReadyToProcess();
     bool isChunked() const;
     bool isStatusNone() const { return this->_parsingStatus == S_NONE; };
     bool isStatusParsingBody() const { return this->_parsingStatus == S_PARSING_BODY; };
 
-    ssize_t receiveMessage(int clientSocketFD);
-    void appendMessage(const char* message);
+    ReturnCaseOfRecv receiveMessage(int clientSocketFD, std::size_t sizeHint, bool drain);
+    BufferPool& nextBlockPool(std::size_t& blockCount);
 
     Status parseMessage();
     ParsingResult parseRequestLine(const std::string& requestLine);
     ParsingResult parseHTTPVersion(const std::string& token);
     ParsingResult parseHeader(const std::string& headerField);
-    ParsingResult parseChunkToBody(std::istringstream& iss, std::size_t& parsedPositionOfMessage);
+    ParsingResult parseChunkToBody();
 
     HTTP::RequestMethod requestMethodByString(const std::string& token);
+    void clearParsed();
+
+    Request(const Request&);
+    Request& operator=(const Request&);
 };
 
 #endif  // REQUEST_HPP_
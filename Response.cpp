@@ -1,18 +1,59 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <cerrno>
 #include "Response.hpp"
 
+//  Send up to count bytes of fd from offset to socket, by sendfile() of the
+//  platform.
+//  - Return: The bytes sent, or -1 with errno set if none has been.
+static ssize_t sendFileRange(int fd, int socket, off_t offset, off_t count) {
+#if defined(__linux__)
+    return sendfile(socket, fd, &offset, count);
+#elif defined(__APPLE__)
+    off_t length = count;
+
+    if (sendfile(fd, socket, offset, &length, NULL, 0) == -1 && length == 0)
+        return -1;
+    return length;
+#else
+    off_t length = 0;
+
+    if (sendfile(fd, socket, offset, count, NULL, &length, 0) == -1 && length == 0)
+        return -1;
+    return length;
+#endif
+}
+
 //  Constructor of Response.
 Response::Response()
 : _message("")
-, _messageDataSize(0)
-, _copyBegin(NULL)
-, _sendBegin(NULL) { }
+, _file(-1)
+, _fileSize(0)
+, _outputSize(0)
+, _sent(0)
+, _corked(false) {
+    std::memset(&this->_sendMessage, 0, sizeof(this->_sendMessage));
+}
 
-//  clear message.
+//  Destructor of Response. The files not sent are closed.
+Response::~Response() {
+    this->closeFile();
+    for (std::deque<Segment>::iterator iter = this->_output.begin(); iter != this->_output.end(); ++iter)
+        if (iter->fd != -1)
+            close(iter->fd);
+}
+
+//  clear the message being built.
 //  - Parameter(None)
 //  - Return(None)
 void Response::clearMessage() {
     this->_message.clear();
-    this->_sendBegin = NULL;
+    this->_body.clear();
+    this->closeFile();
 }
 
 //  Append message to response message.
@@ -22,44 +63,253 @@ void Response::appendMessage(const std::string& message) {
     this->_message += message;
 }
 
-//  Send response message to client.
+//  Append a NUL-terminated message, without building a std::string of it.
+void Response::appendMessage(const char* message) {
+    this->_message += message;
+}
+
+//  Take body over as the body of the response, leaving it empty. The header
+//  block is appended to the message before or after it.
+//  - Parameters body: The body of the response.
+//  - Return(None)
+void Response::setBody(std::string& body) {
+    this->_body.swap(body);
+    body.clear();
+}
+
+//  Take fd over as the body of the response, sent by sendfile() from its start.
+//  - Parameters
+//      fd: The file, closed by the response.
+//      size: The bytes of the file to send.
+//  - Return(None)
+void Response::setFile(int fd, off_t size) {
+    this->closeFile();
+    this->_file = fd;
+    this->_fileSize = size;
+}
+
+//  Append the output of a CGI script. What follows the end of its header
+//  section goes to the body, so the header is completed on commit without
+//  moving the body.
+//  - Parameters
+//      data: The output read.
+//      size: The bytes of data.
+//  - Return(None)
+void Response::appendCGIOutput(const char* data, std::size_t size) {
+    if (this->isHeaderSectionEnded()) {
+        this->_body.append(data, size);
+        return;
+    }
+
+    // The end of the header section may straddle the last output.
+    const std::string::size_type searchFrom = (this->_message.size() > 3) ? this->_message.size() - 3 : 0;
+    this->_message.append(data, size);
+    const std::string::size_type headerEnd = this->_message.find("\r\n\r\n", searchFrom);
+    if (headerEnd == std::string::npos)
+        return;
+    this->_body.append(this->_message, headerEnd + 4, std::string::npos);
+    this->_message.erase(headerEnd + 4);
+}
+
+//  Commit the response built to the output, behind the responses not sent yet.
+//  The output of a CGI script is completed into a response first.
+//  - Parameters keepAlive: Whether the connection is kept open after it.
+//  - Return(None)
+void Response::commitMessage(bool keepAlive) {
+    this->forgeMessageIfEmpty();
+    this->forgeStartlineForCGI(keepAlive);
+    this->commitSegment(this->_message);
+    this->commitSegment(this->_body);
+    this->commitFile();
+}
+
+//  Send the responses committed to client, as many as the socket takes.
 //  - Parameters
 //      clientSocket: The socket fd of client.
 //  - Returns: See the type definition.
 ReturnCaseOfSend Response::sendResponseMessage(int clientSocket) {
-    if (this->_sendBegin == NULL)
-        this->_sendBegin = &this->_message[0];
-    if (this->_messageDataSize == 0)
-        this->_messageDataSize = this->_message.length();
+    while (!this->_output.empty()) {
+        const ReturnCaseOfSend result = (this->_output.front().fd == -1)
+            ? this->sendMemorySegments(clientSocket)
+            : this->sendFileSegment(clientSocket);
+
+        if (result != RCSEND_ALL)
+            return result;
+    }
+    return RCSEND_ALL;
+}
 
-    const std::string::size_type sendedSize = this->_sendBegin - &this->_message[0];
-    const std::string::size_type sizeToSend = this->_messageDataSize - sendedSize;
-    ssize_t sendedBytes = send(clientSocket, this->_sendBegin, sizeToSend, 0);
+//  Send the segments in memory at the front of the output, gathered by
+//  writev() up to SEND_IOV_COUNT.
+//  - Parameters clientSocket: The socket fd of client.
+//  - Return: RCSEND_ALL if the segments gathered have been sent, see the type
+//      definition otherwise.
+ReturnCaseOfSend Response::sendMemorySegments(int clientSocket) {
+    const int count = this->gatherSegments(clientSocket);
+    ssize_t sendedBytes = writev(clientSocket, this->_sendIov, count);
 
     if (sendedBytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return RCSEND_SOME;
         return RCSEND_ERROR;
     }
-    else if (static_cast<std::string::size_type>(sendedBytes) != sizeToSend) {
-        this->_sendBegin += sendedBytes;
+    return (this->consumeSegments(sendedBytes, count) == 0) ? RCSEND_ALL : RCSEND_SOME;
+}
 
-        return RCSEND_SOME;
+//  Gather the segments in memory at the front of the output into a message,
+//  to be sent by the poller, which must not change until it completes.
+//  - Parameters clientSocket: The socket fd of client.
+//  - Return: The message.
+struct msghdr* Response::gatherMessage(int clientSocket) {
+    std::memset(&this->_sendMessage, 0, sizeof(this->_sendMessage));
+    this->_sendMessage.msg_iovlen = this->gatherSegments(clientSocket);
+    this->_sendMessage.msg_iov = this->_sendIov;
+    return &this->_sendMessage;
+}
+
+//  Take the result of the message of gatherMessage() sent by the poller.
+//  - Parameters result: The bytes sent, or -errno.
+//  - Return: RCSEND_ALL if the whole output has been sent, RCSEND_SOME if some
+//      is left, to be sent by the next message or as a file, RCSEND_ERROR on
+//      an error but an interruption.
+ReturnCaseOfSend Response::completeMessage(ssize_t result) {
+    if (result < 0)
+        return (result == -EINTR || result == -EAGAIN || result == -ECANCELED) ? RCSEND_SOME : RCSEND_ERROR;
+    this->consumeSegments(result, this->_sendMessage.msg_iovlen);
+    return this->_output.empty() ? RCSEND_ALL : RCSEND_SOME;
+}
+
+//  Gather the segments in memory at the front of the output into _sendIov, up
+//  to SEND_IOV_COUNT. If a file follows them, the socket is corked first, so
+//  the header leaves with the start of the file.
+//  - Parameters clientSocket: The socket fd of client.
+//  - Return: The number of segments gathered.
+int Response::gatherSegments(int clientSocket) {
+    int count = 0;
+    std::string::size_type offset = this->_sent;
+    std::deque<Segment>::const_iterator iter = this->_output.begin();
+
+    for (; iter != this->_output.end() && iter->fd == -1 && count < SEND_IOV_COUNT; ++iter) {
+        this->_sendIov[count].iov_base = const_cast<char*>(iter->data.data()) + offset;
+        this->_sendIov[count].iov_len = iter->data.size() - offset;
+        offset = 0;
+        ++count;
     }
-    else {
-        this->_message.clear();
-        this->_sendBegin = NULL;
-        this->_messageDataSize = 0;
+    if (iter != this->_output.end() && iter->fd != -1 && !this->_corked)
+        this->setCork(clientSocket, true);
+    return count;
+}
 
-        return RCSEND_ALL;
+//  Drop what has been sent of the segments gathered.
+//  - Parameters
+//      sent: The bytes sent.
+//      count: The number of segments gathered.
+//  - Return: The number of segments gathered not sent in full.
+int Response::consumeSegments(std::size_t sent, int count) {
+    this->_outputSize -= sent;
+    while (count > 0 && sent >= this->_output.front().data.size() - this->_sent) {
+        sent -= this->_output.front().data.size() - this->_sent;
+        this->_output.pop_front();
+        this->_sent = 0;
+        --count;
     }
+    this->_sent += sent;
+    return count;
 }
 
-// initialize body size in Response
-void Response::initBodyBySize(std::string::size_type size) {
-    std::string::size_type headerSize = this->_message.length();
-    this->_messageDataSize = headerSize + size;
-    this->_message.reserve(this->_messageDataSize);
-    this->_copyBegin = &this->_message[0] + headerSize;
-};
+//  Send the file at the front of the output by sendfile(), from where the last
+//  call stopped. Once it has been sent, it is closed and the socket uncorked.
+//  - Parameters clientSocket: The socket fd of client.
+//  - Return: RCSEND_ALL if the file has been sent, see the type definition
+//      otherwise. A file cut short since it was opened is RCSEND_ERROR.
+ReturnCaseOfSend Response::sendFileSegment(int clientSocket) {
+    Segment& segment = this->_output.front();
+    const ssize_t sendedBytes = sendFileRange(segment.fd, clientSocket, segment.offset, segment.end - segment.offset);
+
+    if (sendedBytes == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return RCSEND_SOME;
+        return RCSEND_ERROR;
+    }
+    if (sendedBytes == 0)
+        return RCSEND_ERROR;
+    this->_outputSize -= sendedBytes;
+    segment.offset += sendedBytes;
+    if (segment.offset < segment.end)
+        return RCSEND_SOME;
+    close(segment.fd);
+    this->_output.pop_front();
+    if (this->_corked)
+        this->setCork(clientSocket, false);
+    return RCSEND_ALL;
+}
+
+//  Cork the socket, holding partial frames back until uncorked, with TCP_CORK
+//  or TCP_NOPUSH of the platform.
+//  - Parameters
+//      clientSocket: The socket fd of client.
+//      cork: Whether to cork or uncork, which sends what is held.
+//  - Return(None)
+void Response::setCork(int clientSocket, bool cork) {
+    int value = cork ? 1 : 0;
+
+#if defined(TCP_CORK)
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+#elif defined(TCP_NOPUSH)
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NOPUSH, &value, sizeof(value));
+#else
+    (void)clientSocket;
+    (void)value;
+#endif
+    this->_corked = cork;
+}
+
+//  Whether the header section of the message has ended, so the rest of a CGI
+//  output belongs to the body. The message is cut right after its end.
+//  - Parameters(None)
+//  - Return: Whether the message ends with the end of the header section.
+bool Response::isHeaderSectionEnded() const {
+    const std::string::size_type size = this->_message.size();
+
+    return size >= 4 && this->_message.compare(size - 4, 4, "\r\n\r\n") == 0;
+}
+
+//  Move segment to the end of the output, leaving it empty. An empty segment
+//  is not committed.
+//  - Parameters segment: The segment to commit.
+//  - Return(None)
+void Response::commitSegment(std::string& segment) {
+    if (segment.empty())
+        return;
+    this->_outputSize += segment.size();
+    this->_output.push_back(Segment());
+    this->_output.back().data.swap(segment);
+    this->_output.back().fd = -1;
+}
+
+//  Move the file of the response to the end of the output, if any.
+//  - Parameters(None)
+//  - Return(None)
+void Response::commitFile() {
+    if (this->_file == -1)
+        return;
+    this->_outputSize += this->_fileSize;
+    this->_output.push_back(Segment());
+    this->_output.back().fd = this->_file;
+    this->_output.back().offset = 0;
+    this->_output.back().end = this->_fileSize;
+    this->_file = -1;
+}
+
+//  Close the file of the response being built, if any.
+//  - Parameters(None)
+//  - Return(None)
+void Response::closeFile() {
+    if (this->_file == -1)
+        return;
+    close(this->_file);
+    this->_file = -1;
+}
 
 void Response::forgeMessageIfEmpty() {
     if (_message.empty() == true) {
@@ -67,26 +317,36 @@ void Response::forgeMessageIfEmpty() {
     }
 }
 
-void Response::forgeStartlineForCGI() {
+//  Complete the output of a CGI script into a response: a status line, the
+//  Connection header field of the connection and Content-Length are added if
+//  the script left them out.
+//  - Parameters keepAlive: Whether the connection is kept open after it.
+//  - Return(None)
+void Response::forgeStartlineForCGI(bool keepAlive) {
     size_t bodyBeginIndex = _message.find("\r\n\r\n") + 4;
     size_t bodyLength;
     size_t findResult;
     std::string contentLengthLine;
     std::ostringstream oss;
+    const char* const connectionLine = keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
 
     findResult = _message.find("HTTP");
-    if (findResult == 0)
+    if (findResult == 0) {
+        const size_t headerBegin = _message.find("\r\n") + 2;
+        findResult = _message.find("\r\nConnection:");
+        if (findResult == std::string::npos || findResult + 2 >= bodyBeginIndex)
+            _message.insert(headerBegin, connectionLine);
         return ;
+    }
     _message.insert(0, "HTTP/1.1 200 OK\r\n");
-    bodyBeginIndex += 17;
+    _message.insert(17, connectionLine);
+    bodyBeginIndex += 17 + std::strlen(connectionLine);
     findResult = _message.find("Content-Length");
     if (findResult != std::string::npos)
         return ;
     // if (findResult > bodyBeginIndex)
     //     return ;
-    bodyLength = _message.length() - bodyBeginIndex;
-    if (bodyLength < 0)
-        return ;
+    bodyLength = _message.length() - bodyBeginIndex + _body.length();
     oss << "Content-Length: " << bodyLength << "\r\n";
     contentLengthLine = oss.str();
     _message.insert(bodyBeginIndex - 2, contentLengthLine);
@@ -1,7 +1,11 @@
 #ifndef RESPONSE_HPP_
 #define RESPONSE_HPP_
 
+#include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstring>
+#include <deque>
 #include <string>
 #include <sstream>
 #include "constant.hpp"
@@ -18,31 +22,88 @@ enum ReturnCaseOfSend {
 };
 
 //  Store response message.
-//  If fail sending message at once, this->_sendBegin store the point where to
-//  begin sending.
+//  A response is built as a header block in _message and a body in _body or
+//  _file, and committed to _output once complete. The body is taken over
+//  rather than copied behind the header. The segments in memory of _output are
+//  sent together by writev(), and a file by sendfile() straight from the file
+//  to the socket, corked behind its header so they leave in full packets.
+//  Responses committed before the ones ahead have been sent, like those of
+//  pipelined requests, queue up behind them, so they go out in order and
+//  together in as few writes as possible. The bytes queued, files included, are
+//  counted so the connection stops taking requests beyond PIPELINE_OUTPUT_SIZE.
+//  With a completion based poller, the segments in memory are gathered into a
+//  message sent by the kernel instead, and the result taken when it completes.
 //  - Member variable
-//      _message: A message to send.
-//      _sendBegin: Begging point to send.
+//      _message: The header block of the response being built, or the whole
+//          response if its body is appended to it.
+//      _body: The body of the response being built.
+//      _file: The file of the response being built as its body, or -1.
+//      _fileSize: The bytes of _file to send.
+//      _output: The segments committed, to send.
+//      _outputSize: The bytes of _output not sent yet.
+//      _sent: The bytes of the first segment of _output sent, if in memory.
+//      _corked: Whether the socket is corked until a file has been sent.
+//      _sendIov: The segments gathered to send.
+//      _sendMessage: The message of gatherMessage(), over _sendIov.
 class Response {
 public:
     Response();
+    ~Response();
 
     void clearMessage();
     void appendMessage(const std::string& message);
+    void appendMessage(const char* message);
+    void setBody(std::string& body);
+    void setFile(int fd, off_t size);
+    void appendCGIOutput(const char* data, std::size_t size);
+    void commitMessage(bool keepAlive);
+    bool hasOutput() const { return !this->_output.empty(); };
+    bool isOutputFull() const { return this->_outputSize >= PIPELINE_OUTPUT_SIZE; };
+    bool isFileFirst() const { return !this->_output.empty() && this->_output.front().fd != -1; };
 
     ReturnCaseOfSend sendResponseMessage(int clientSocket);
-
-    void initBodyBySize(std::string::size_type size);
-    void memcpyMessage(char* buf, ssize_t size) { memcpy(this->_copyBegin, buf, size); this->_copyBegin += size; };
-    bool isReadAllFile() const { return static_cast<std::string::size_type>(this->_copyBegin - &this->_message[0]) == this->_messageDataSize; };
-    void forgeMessageIfEmpty();
-    void forgeStartlineForCGI();
+    struct msghdr* gatherMessage(int clientSocket);
+    ReturnCaseOfSend completeMessage(ssize_t result);
 
 private:
+    //  Segment is a part of the output: bytes in memory, or a range of a file.
+    //  - Member variables
+    //      data: The bytes, if fd is -1.
+    //      fd: The file, owned by the segment, or -1.
+    //      offset: The offset of the file to send from.
+    //      end: The end of the range of the file.
+    struct Segment {
+        std::string data;
+        int fd;
+        off_t offset;
+        off_t end;
+    };
+
     std::string _message;
-    std::string::size_type _messageDataSize;
-    char* _copyBegin;
-    const char* _sendBegin;
+    std::string _body;
+    int _file;
+    off_t _fileSize;
+    std::deque<Segment> _output;
+    off_t _outputSize;
+    std::string::size_type _sent;
+    bool _corked;
+    struct iovec _sendIov[SEND_IOV_COUNT];
+    struct msghdr _sendMessage;
+
+    Response(const Response&);
+    Response& operator=(const Response&);
+
+    bool isHeaderSectionEnded() const;
+    void commitSegment(std::string& segment);
+    void commitFile();
+    void closeFile();
+    ReturnCaseOfSend sendMemorySegments(int clientSocket);
+    int gatherSegments(int clientSocket);
+    int consumeSegments(std::size_t sent, int count);
+    ReturnCaseOfSend sendFileSegment(int clientSocket);
+    void setCork(int clientSocket, bool cork);
+    void forgeMessageIfEmpty();
+    void forgeStartlineForCGI(bool keepAlive);
 };
 
 #endif  // RESPONSE_HPP_
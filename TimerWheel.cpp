@@ -0,0 +1,176 @@
+#include "TimerWheel.hpp"
+
+TimerWheel::Timer::Timer()
+: _prev(NULL)
+, _next(NULL)
+, _wheel(NULL)
+, _expire(0)
+, _ident(-1)
+, _kind(0)
+, _udata(NULL) { }
+
+TimerWheel::Timer::~Timer() {
+    if (this->_wheel != NULL)
+        this->_wheel->cancel(*this);
+}
+
+// Set the values delivered when the timer expires.
+//  - Parameters
+//      ident: The identifier of timer. (fd in most case)
+//      kind: The kind of timeout, to tell several timers of an ident apart.
+//      udata: The user data.
+//  - Return(none)
+void TimerWheel::Timer::set(int ident, int kind, void* udata) {
+    this->_ident = ident;
+    this->_kind = kind;
+    this->_udata = udata;
+}
+
+//  - Parameters
+//      resolution: milliseconds per tick.
+//      now: current time.
+TimerWheel::TimerWheel(long resolution, long now)
+: _resolution(resolution)
+, _origin(now)
+, _currentTick(0)
+, _count(0) {
+    for (int level = 0; level < Levels; ++level) {
+        for (int slot = 0; slot < SlotCount; ++slot) {
+            this->_slots[level][slot]._prev = &this->_slots[level][slot];
+            this->_slots[level][slot]._next = &this->_slots[level][slot];
+        }
+    }
+}
+
+// Arm the timer. An armed timer is moved, which restarts it.
+//  - Parameters
+//      timer: The timer to arm.
+//      milliseconds: The timeout.
+//      now: current time.
+//  - Return(none)
+void TimerWheel::arm(Timer& timer, long milliseconds, long now) {
+    this->cancel(timer);
+    timer._wheel = this;
+    timer._expire = this->tickOf(now + milliseconds) + 1;
+    this->insert(timer);
+}
+
+// Disarm the timer. Nothing happens if it is not armed.
+void TimerWheel::cancel(Timer& timer) {
+    if (!timer.isArmed())
+        return;
+    this->unlink(timer);
+}
+
+// Find how long the caller may sleep before advance() has to run.
+// Only the lowest level is scanned. Without a timer there, the caller wakes
+// up when the lowest level wraps and the upper levels cascade down. The
+// current tick may itself be such a wrap, not cascaded yet.
+//  - Parameters now: current time.
+//  - Return: timeout in milliseconds, -1 if no timer is armed.
+long TimerWheel::nextTimeout(long now) const {
+    if (this->_count == 0)
+        return -1;
+
+    const unsigned long index = this->_currentTick & SlotMask;
+    unsigned long tick = this->_currentTick;
+    if (index != 0) {
+        tick = (this->_currentTick | SlotMask) + 1;
+        for (unsigned long slot = index; slot < SlotCount; ++slot) {
+            const Timer& head = this->_slots[0][slot];
+            if (head._next != &head) {
+                tick = this->_currentTick - index + slot;
+                break;
+            }
+        }
+    }
+
+    const long timeout = this->_origin + static_cast<long>(tick) * this->_resolution - now;
+    return timeout < 0 ? 0 : timeout;
+}
+
+// Expire every tick passed until now.
+//  - Parameters
+//      now: current time.
+//      expired: Timers expired are disarmed and appended here.
+//  - Return(none)
+void TimerWheel::advance(long now, std::vector<Timer*>& expired) {
+    const unsigned long nowTick = this->tickOf(now);
+
+    if (this->_count == 0) {
+        if (this->_currentTick <= nowTick)
+            this->_currentTick = nowTick + 1;
+        return;
+    }
+    while (this->_currentTick <= nowTick) {
+        const int index = this->_currentTick & SlotMask;
+
+        if (index == 0) {
+            for (int level = 1; level < Levels; ++level) {
+                this->cascade(level);
+                if (((this->_currentTick >> (SlotBits * level)) & SlotMask) != 0)
+                    break;
+            }
+        }
+        ++this->_currentTick;
+
+        Timer& head = this->_slots[0][index];
+        while (head._next != &head) {
+            Timer& timer = *head._next;
+            this->unlink(timer);
+            expired.push_back(&timer);
+        }
+    }
+}
+
+// Link the timer on the slot of its expiration.
+// A level is chosen by how far the expiration is. Timers beyond the last level
+// are clamped to it.
+void TimerWheel::insert(Timer& timer) {
+    const unsigned long maxDelta = (1UL << (SlotBits * Levels)) - 1;
+    unsigned long delta = timer._expire - this->_currentTick;
+    int level = 0;
+
+    if (timer._expire < this->_currentTick) {
+        timer._expire = this->_currentTick;
+        delta = 0;
+    }
+    if (delta > maxDelta) {
+        timer._expire = this->_currentTick + maxDelta;
+        delta = maxDelta;
+    }
+    while (level < Levels - 1 && delta >= (1UL << (SlotBits * (level + 1))))
+        ++level;
+
+    Timer& head = this->_slots[level][(timer._expire >> (SlotBits * level)) & SlotMask];
+    timer._prev = head._prev;
+    timer._next = &head;
+    head._prev->_next = &timer;
+    head._prev = &timer;
+    ++this->_count;
+}
+
+void TimerWheel::unlink(Timer& timer) {
+    timer._prev->_next = timer._next;
+    timer._next->_prev = timer._prev;
+    timer._prev = NULL;
+    timer._next = NULL;
+    --this->_count;
+}
+
+// Move the timers of the current slot of 'level' down to lower levels.
+void TimerWheel::cascade(int level) {
+    Timer& head = this->_slots[level][(this->_currentTick >> (SlotBits * level)) & SlotMask];
+
+    while (head._next != &head) {
+        Timer& timer = *head._next;
+        this->unlink(timer);
+        this->insert(timer);
+    }
+}
+
+unsigned long TimerWheel::tickOf(long now) const {
+    if (now < this->_origin)
+        return 0;
+    return (now - this->_origin) / this->_resolution;
+}
@@ -0,0 +1,88 @@
+#ifndef TIMERWHEEL_HPP_
+#define TIMERWHEEL_HPP_
+
+#include <cstddef>
+#include <vector>
+
+//  TimerWheel keeps timeouts in userspace as a hierarchical timing wheel.
+//  Time is counted in ticks of '_resolution' milliseconds. A level has SlotCount
+//  slots and a slot of a level spans the whole lower level, so far timers are
+//  kept coarse and cascaded down as time passes.
+//  Arm, re-arm and cancel are O(1), as a Timer is an intrusive list node.
+//  A timer expires within one tick after its timeout, never before.
+//  Times are milliseconds of a monotonic clock.
+//  - Member variables
+//      _resolution: milliseconds per tick.
+//      _origin: time in milliseconds of tick 0.
+//      _currentTick: the next tick to expire.
+//      _count: the number of armed timers.
+//      _slots: list head per level and slot.
+//  - Methods
+//      arm: (Re-)arm 'timer' to expire 'milliseconds' after 'now'.
+//      cancel: Disarm 'timer' if armed.
+//      nextTimeout: Milliseconds until advance() has work to do, -1 if no timer.
+//      advance: Disarm timers expired by 'now' and append them to 'expired'.
+class TimerWheel {
+public:
+    //  Timer is a timeout owned by its user. It is disarmed when destroyed.
+    //  - Member variables
+    //      _ident, _kind, _udata: The values delivered when expired.
+    class Timer {
+    public:
+        Timer();
+        ~Timer();
+
+        void set(int ident, int kind, void* udata);
+        bool isArmed() const { return this->_prev != NULL; };
+        int getIdent() const { return this->_ident; };
+        int getKind() const { return this->_kind; };
+        void* getUData() const { return this->_udata; };
+
+    private:
+        friend class TimerWheel;
+
+        Timer* _prev;
+        Timer* _next;
+        TimerWheel* _wheel;
+        unsigned long _expire;
+        int _ident;
+        int _kind;
+        void* _udata;
+
+        Timer(const Timer&);
+        Timer& operator=(const Timer&);
+    };
+
+    TimerWheel(long resolution, long now);
+
+    std::size_t size() const { return this->_count; };
+
+    void arm(Timer& timer, long milliseconds, long now);
+    void cancel(Timer& timer);
+    long nextTimeout(long now) const;
+    void advance(long now, std::vector<Timer*>& expired);
+
+private:
+    enum {
+        Levels = 4,
+        SlotBits = 6,
+        SlotCount = 1 << SlotBits,
+        SlotMask = SlotCount - 1,
+    };
+
+    const long _resolution;
+    const long _origin;
+    unsigned long _currentTick;
+    std::size_t _count;
+    Timer _slots[Levels][SlotCount];
+
+    void insert(Timer& timer);
+    void unlink(Timer& timer);
+    void cascade(int level);
+    unsigned long tickOf(long now) const;
+
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+};
+
+#endif  // TIMERWHEEL_HPP_
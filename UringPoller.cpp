@@ -0,0 +1,461 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include "UringPoller.hpp"
+#include "Log.hpp"
+
+Poller* Poller::create() {
+    return new UringPoller();
+}
+
+UringPoller::UringPoller()
+: _nextToken(1)
+, _completion(false)
+, _bufferRing(NULL)
+, _receiveBuffers(NULL)
+, _bufferTail(0) {
+    struct io_uring_params params;
+
+    std::memset(&params, 0, sizeof(params));
+    _ring = syscall(__NR_io_uring_setup, RingEntries, &params);
+    if (_ring < 0)
+        throw std::logic_error("Cannot create io_uring.");
+    // Not inherited by CGI processes nor by an upgraded binary.
+    fcntl(_ring, F_SETFD, FD_CLOEXEC);
+
+    _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (_cqRingSize > _sqRingSize)
+            _sqRingSize = _cqRingSize;
+        _cqRingSize = 0;
+    }
+    _sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+    _cqRing = _sqRing;
+    if (_sqRing != MAP_FAILED && _cqRingSize != 0)
+        _cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+    _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = static_cast<struct io_uring_sqe*>(mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES));
+    if (_sqRing == MAP_FAILED || _cqRing == MAP_FAILED || _sqes == MAP_FAILED) {
+        close(_ring);
+        throw std::logic_error("Cannot map io_uring.");
+    }
+
+    char* const sq = static_cast<char*>(_sqRing);
+    char* const cq = static_cast<char*>(_cqRing);
+    _sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    _sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    _sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    _sqEntries = params.sq_entries;
+    _cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    _cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    _cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // SQE index i is always placed on SQ array slot i.
+    unsigned* const sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    for (unsigned i = 0; i < _sqEntries; ++i)
+        sqArray[i] = i;
+    this->setupReceiveBuffers();
+}
+
+UringPoller::~UringPoller() {
+    if (_completion) {
+        munmap(_receiveBuffers, ReceiveBufferCount * ReceiveBufferSize);
+        munmap(_bufferRing, ReceiveBufferCount * sizeof(struct io_uring_buf));
+    }
+    munmap(_sqes, _sqesSize);
+    if (_cqRingSize != 0)
+        munmap(_cqRing, _cqRingSize);
+    munmap(_sqRing, _sqRingSize);
+    close(_ring);
+}
+
+// Provide the ring of buffers EF_RECEIVED is received into, which enables the
+// completion I/O. Multishot receive came with Linux 6.0, the first to know
+// IORING_OP_SEND_ZC, so an older kernel, or one refusing the ring, is left
+// with readiness only.
+void UringPoller::setupReceiveBuffers() {
+    char probeStorage[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+    struct io_uring_probe* const probe = reinterpret_cast<struct io_uring_probe*>(probeStorage);
+
+    std::memset(probeStorage, 0, sizeof(probeStorage));
+    if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_PROBE, probe, 256) < 0
+        || probe->last_op < IORING_OP_SEND_ZC)
+        return;
+
+    void* const ring = mmap(NULL, ReceiveBufferCount * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* const buffers = mmap(NULL, ReceiveBufferCount * ReceiveBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg registration;
+
+    std::memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = reinterpret_cast<uint64_t>(ring);
+    registration.ring_entries = ReceiveBufferCount;
+    registration.bgid = ReceiveBufferGroup;
+    if (ring == MAP_FAILED || buffers == MAP_FAILED
+        || syscall(__NR_io_uring_register, _ring, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        Log::info("io_uring: no provided buffer ring, completion I/O disabled");
+        if (ring != MAP_FAILED)
+            munmap(ring, ReceiveBufferCount * sizeof(struct io_uring_buf));
+        if (buffers != MAP_FAILED)
+            munmap(buffers, ReceiveBufferCount * ReceiveBufferSize);
+        return;
+    }
+    _bufferRing = static_cast<struct io_uring_buf*>(ring);
+    _receiveBuffers = static_cast<char*>(buffers);
+    for (unsigned short bufferID = 0; bufferID < ReceiveBufferCount; ++bufferID)
+        this->provideBuffer(bufferID);
+    this->recycleBuffers();
+    _completion = true;
+}
+
+// Put a buffer on the ring, seen by the kernel once the tail is published.
+// The tail overlays 'resv' of the first entry, so only the other fields are set.
+void UringPoller::provideBuffer(unsigned short bufferID) {
+    struct io_uring_buf& entry = _bufferRing[_bufferTail & (ReceiveBufferCount - 1)];
+
+    entry.addr = reinterpret_cast<uint64_t>(_receiveBuffers + bufferID * ReceiveBufferSize);
+    entry.len = ReceiveBufferSize;
+    entry.bid = bufferID;
+    ++_bufferTail;
+}
+
+// Give back the buffers lent with the last events and publish the tail.
+void UringPoller::recycleBuffers() {
+    for (std::vector<unsigned short>::const_iterator iter = _lentBuffers.begin(); iter != _lentBuffers.end(); ++iter)
+        this->provideBuffer(*iter);
+    _lentBuffers.clear();
+    __atomic_store_n(&_bufferRing[0].resv, _bufferTail, __ATOMIC_RELEASE);
+}
+
+// Watch the condition of fd. Existing watch of the same condition is replaced.
+// Polls are re-armed after each completion, which is level-triggered, so
+// 'edgeTriggered' is ignored.
+//  - Parameters
+//      filter: EF_READ or EF_WRITE, or EF_ACCEPTED or EF_RECEIVED with completion I/O
+//      fd: FD number to watch
+//      udata: user data delivered with the event
+//  - Return(none)
+void UringPoller::add(int filter, int fd, void* udata, bool) {
+    this->eraseRequest(fd, filter);
+
+    const uint64_t token = this->insertRequest(fd, filter, udata, true);
+    this->submitRequest(token, _requests[token]);
+}
+
+// Send the message on fd once, reported as EF_SENT. SIGPIPE is not raised.
+//  - Parameters
+//      fd: The socket to send on.
+//      message: The message, untouched until EF_SENT is delivered.
+//      udata: user data delivered with the event
+//  - Return(none)
+void UringPoller::send(int fd, struct msghdr* message, void* udata) {
+    this->eraseRequest(fd, EF_SENT);
+
+    const uint64_t token = this->insertRequest(fd, EF_SENT, udata, true);
+    _requests[token].message = message;
+    this->submitRequest(token, _requests[token]);
+}
+
+// Stop watching the condition of fd.
+void UringPoller::remove(int filter, int fd) {
+    this->eraseRequest(fd, filter);
+}
+
+// Resume watching the condition of fd.
+void UringPoller::enable(int filter, int fd) {
+    const TokenMap::const_iterator tokenIter = _tokens.find(std::make_pair(fd, filter));
+    if (tokenIter == _tokens.end())
+        return;
+
+    Request& request = _requests[tokenIter->second];
+    request.enabled = true;
+    if (!request.armed)
+        this->submitRequest(tokenIter->second, request);
+}
+
+// Pause watching the condition of fd.
+// The armed poll is cancelled and the watch gets a new token, so the late
+// completion of cancelled poll is ignored. A completion request is cancelled
+// keeping its token, as what it completed before must be delivered, and is
+// submitted again on its last completion if enabled by then.
+void UringPoller::disable(int filter, int fd) {
+    const TokenMap::const_iterator tokenIter = _tokens.find(std::make_pair(fd, filter));
+    if (tokenIter == _tokens.end())
+        return;
+
+    if (isCompletionFilter(filter)) {
+        Request& request = _requests[tokenIter->second];
+
+        request.enabled = false;
+        if (request.armed)
+            this->cancelRequest(tokenIter->second);
+        return;
+    }
+
+    void* const udata = _requests[tokenIter->second].udata;
+    this->eraseRequest(fd, filter);
+    this->insertRequest(fd, filter, udata, false);
+}
+
+// Drop every condition of fd. Pending requests hold the file, so this must precede close().
+void UringPoller::forget(int fd) {
+    this->eraseRequest(fd, EF_READ);
+    this->eraseRequest(fd, EF_WRITE);
+    this->eraseRequest(fd, EF_ACCEPTED);
+    this->eraseRequest(fd, EF_RECEIVED);
+    this->eraseRequest(fd, EF_SENT);
+}
+
+// Give back the buffers lent, re-arm delivered requests, submit every queued
+// SQE and wait in one io_uring_enter().
+//  - Return: the number of events appended, -1 on error.
+int UringPoller::wait(std::vector<Event>& eventlist, int maxEvent, long timeout) {
+    const std::vector<Event>::size_type sizeBefore = eventlist.size();
+
+    if (_completion && !_lentBuffers.empty())
+        this->recycleBuffers();
+    for (std::vector<uint64_t>::const_iterator iter = _rearmTokens.begin(); iter != _rearmTokens.end(); ++iter) {
+        const RequestMap::iterator request = _requests.find(*iter);
+        if (request != _requests.end() && request->second.enabled && !request->second.armed
+            && !request->second.forgotten)
+            this->submitRequest(request->first, request->second);
+    }
+    _rearmTokens.clear();
+
+    const unsigned minComplete = (timeout != 0) ? 1 : 0;
+    if (minComplete != 0 && timeout > 0) {
+        struct io_uring_sqe sqe;
+
+        _waitTimeout.tv_sec = timeout / 1000;
+        _waitTimeout.tv_nsec = (timeout % 1000) * 1000000;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_TIMEOUT;
+        sqe.fd = -1;
+        sqe.addr = reinterpret_cast<uint64_t>(&_waitTimeout);
+        sqe.len = 1;
+        sqe.off = 1;
+        sqe.user_data = 0;
+        this->queueSQE(sqe);
+    }
+    if (this->enter(this->countUnsubmitted(), minComplete, IORING_ENTER_GETEVENTS) < 0
+        && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME)
+        return -1;
+
+    unsigned head = *_cqHead;
+    const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail && eventlist.size() - sizeBefore < static_cast<std::size_t>(maxEvent)) {
+        this->reapCompletion(_cqes[head & _cqMask], eventlist);
+        ++head;
+    }
+    __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    return eventlist.size() - sizeBefore;
+}
+
+uint64_t UringPoller::insertRequest(int ident, int filter, void* udata, bool enabled) {
+    const uint64_t token = _nextToken++;
+    Request request;
+
+    request.ident = ident;
+    request.filter = filter;
+    request.udata = udata;
+    request.enabled = enabled;
+    request.armed = false;
+    request.message = NULL;
+    request.forgotten = false;
+    _requests.insert(std::make_pair(token, request));
+    _tokens[std::make_pair(ident, filter)] = token;
+    return token;
+}
+
+// Forget the request of (ident, filter) and cancel it in the kernel if armed.
+// Late completions of the cancelled poll are ignored on reap. A completion
+// request armed is kept, forgotten, until its last completion.
+void UringPoller::eraseRequest(int ident, int filter) {
+    const TokenMap::iterator tokenIter = _tokens.find(std::make_pair(ident, filter));
+    if (tokenIter == _tokens.end())
+        return;
+
+    const RequestMap::iterator requestIter = _requests.find(tokenIter->second);
+    if (requestIter != _requests.end() && requestIter->second.armed && isCompletionFilter(filter)) {
+        this->cancelRequest(tokenIter->second);
+        requestIter->second.forgotten = true;
+        _tokens.erase(tokenIter);
+        return;
+    }
+    if (requestIter != _requests.end() && requestIter->second.armed) {
+        struct io_uring_sqe sqe;
+
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_REMOVE;
+        sqe.fd = -1;
+        sqe.addr = tokenIter->second;
+        sqe.user_data = 0;
+        this->queueSQE(sqe);
+    }
+    if (requestIter != _requests.end())
+        _requests.erase(requestIter);
+    _tokens.erase(tokenIter);
+}
+
+// Submit the request: a poll, or the I/O of a completion filter.
+// Clients are accepted non-blocking and close-on-exec, like by acceptClient().
+void UringPoller::submitRequest(uint64_t token, Request& request) {
+    struct io_uring_sqe sqe;
+
+    if (!isCompletionFilter(request.filter)) {
+        this->submitPoll(token, request);
+        return;
+    }
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.fd = request.ident;
+    sqe.user_data = token;
+    if (request.filter == EF_ACCEPTED) {
+        sqe.opcode = IORING_OP_ACCEPT;
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    } else if (request.filter == EF_RECEIVED) {
+        sqe.opcode = IORING_OP_RECV;
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = ReceiveBufferGroup;
+    } else {
+        sqe.opcode = IORING_OP_SENDMSG;
+        sqe.addr = reinterpret_cast<uint64_t>(request.message);
+        sqe.len = 1;
+        sqe.msg_flags = MSG_NOSIGNAL;
+    }
+    this->queueSQE(sqe);
+    request.armed = true;
+}
+
+// Cancel the completion request of token. Its result comes as its last completion.
+void UringPoller::cancelRequest(uint64_t token) {
+    struct io_uring_sqe sqe;
+
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = -1;
+    sqe.addr = token;
+    sqe.user_data = 0;
+    this->queueSQE(sqe);
+}
+
+void UringPoller::submitPoll(uint64_t token, Request& request) {
+    struct io_uring_sqe sqe;
+
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_POLL_ADD;
+    sqe.fd = request.ident;
+    sqe.poll32_events = (request.filter == EF_READ) ? (POLLIN | POLLRDHUP) : POLLOUT;
+    sqe.user_data = token;
+    this->queueSQE(sqe);
+    request.armed = true;
+}
+
+// Put sqe on the submission queue. Submit queued SQEs first if the queue is full.
+void UringPoller::queueSQE(const struct io_uring_sqe& sqe) {
+    const unsigned tail = *_sqTail;
+
+    if (this->countUnsubmitted() >= _sqEntries
+        && this->enter(this->countUnsubmitted(), 0, 0) < 0)
+        throw std::runtime_error("io_uring submission Failed.");
+    _sqes[tail & _sqMask] = sqe;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+unsigned UringPoller::countUnsubmitted() const {
+    return *_sqTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+}
+
+int UringPoller::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    ++_syscallCount;
+    return syscall(__NR_io_uring_enter, _ring, toSubmit, minComplete, flags, NULL, 0);
+}
+
+// Convert a completion into Event. Polls are queued to re-arm.
+// Completions of removals and wait timeouts carry token 0 and are ignored.
+// A poll interrupted is re-armed without an event. A poll failed otherwise is
+// delivered like EPOLLERR, so the handler meets the error on its fd and
+// disposes of it, and is not re-armed until enabled again.
+// A buffer received into is lent until the next wait() whoever it is for.
+void UringPoller::reapCompletion(const struct io_uring_cqe& cqe, std::vector<Event>& eventlist) {
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+        _lentBuffers.push_back(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+    const RequestMap::iterator iter = _requests.find(cqe.user_data);
+    if (cqe.user_data == 0 || iter == _requests.end())
+        return;
+    if (isCompletionFilter(iter->second.filter)) {
+        this->reapIOCompletion(iter, cqe, eventlist);
+        return;
+    }
+
+    Request& request = iter->second;
+    Event event;
+
+    request.armed = false;
+    event.ident = request.ident;
+    event.filter = request.filter;
+    event.data = 0;
+    event.udata = request.udata;
+    event.buffer = NULL;
+    if (cqe.res == -EINTR || cqe.res == -EAGAIN || cqe.res == -ECANCELED) {
+        _rearmTokens.push_back(cqe.user_data);
+        return;
+    }
+    if (cqe.res < 0) {
+        Log::warning("io_uring poll of [%d] failed: %s", request.ident, std::strerror(-cqe.res));
+        eventlist.push_back(event);
+        return;
+    }
+    eventlist.push_back(event);
+    _rearmTokens.push_back(cqe.user_data);
+}
+
+// Convert the completion of accept, receive or send into Event with its result.
+// A multishot request goes on while IORING_CQE_F_MORE is set. Once ended, it
+// is submitted again if enabled, unless it met the end of stream or an error,
+// which are delivered. Running out of buffers, an interruption or a cancel is
+// retried without an event, but for a send, whose result is always delivered.
+// A request forgotten is erased on its last completion, closing the clients
+// accepted meanwhile.
+void UringPoller::reapIOCompletion(RequestMap::iterator iter, const struct io_uring_cqe& cqe, std::vector<Event>& eventlist) {
+    Request& request = iter->second;
+    const bool retry = cqe.res == -ENOBUFS || cqe.res == -EINTR || cqe.res == -EAGAIN || cqe.res == -ECANCELED;
+
+    if (!(cqe.flags & IORING_CQE_F_MORE))
+        request.armed = false;
+    if (request.forgotten) {
+        if (request.filter == EF_ACCEPTED && cqe.res >= 0)
+            close(cqe.res);
+        if (!request.armed)
+            _requests.erase(iter);
+        return;
+    }
+
+    Event event;
+
+    event.ident = request.ident;
+    event.filter = request.filter;
+    event.data = cqe.res;
+    event.udata = request.udata;
+    event.buffer = NULL;
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+        event.buffer = _receiveBuffers + (cqe.flags >> IORING_CQE_BUFFER_SHIFT) * ReceiveBufferSize;
+    if (request.filter == EF_SENT) {
+        eventlist.push_back(event);
+        _tokens.erase(std::make_pair(request.ident, request.filter));
+        _requests.erase(iter);
+        return;
+    }
+    if (!retry)
+        eventlist.push_back(event);
+    if (!request.armed && (retry || request.filter == EF_ACCEPTED || cqe.res > 0))
+        _rearmTokens.push_back(cqe.user_data);
+}
@@ -0,0 +1,121 @@
+#ifndef URINGPOLLER_HPP_
+#define URINGPOLLER_HPP_
+
+#include <linux/io_uring.h>
+#include <map>
+#include <vector>
+#include <utility>
+#include "Poller.hpp"
+
+//  Poller backend using io_uring. (Linux 5.1+)
+//  Every watch is an one-shot IORING_OP_POLL_ADD re-armed after delivery while
+//  enabled, so handlers keep the level-triggered semantics of kqueue. Registrations, re-arms
+//  and removals are queued as SQEs and submitted together with the wait in a
+//  single io_uring_enter() per loop iteration. The wait is bounded by a TIMEOUT
+//  SQE which also completes with the first other completion.
+//  On Linux 6.0+ it also does completion I/O: EF_ACCEPTED is a multishot
+//  IORING_OP_ACCEPT, EF_RECEIVED a multishot IORING_OP_RECV into the buffers of
+//  a ring provided to the kernel, and send() an IORING_OP_SENDMSG, so the
+//  accepts, reads and writes of client sockets are done by the kernel within
+//  the same io_uring_enter(). A multishot request ended by the kernel, like
+//  one running out of buffers, is submitted again while enabled. A buffer
+//  received into is lent with its event and given back to the ring on the
+//  next wait(). Disabling a completion request cancels it but keeps its token,
+//  so what completed before the cancel is still delivered, and a request
+//  forgotten is kept until its last completion, which gives back its buffers
+//  and closes the clients it accepted.
+//  - Member variables
+//      _ring: FD number of io_uring instance.
+//      _sq*, _cq*: pointers to the rings shared with the kernel.
+//      _waitTimeout: timespec of the TIMEOUT SQE bounding the wait.
+//      _nextToken: user_data of next request. 0 is reserved for removals.
+//      _requests: alive poll requests per token.
+//      _tokens: token per (ident, filter).
+//      _rearmTokens: tokens delivered and waiting to be re-armed.
+//      _completion: completion I/O is supported.
+//      _bufferRing: the ring of buffers provided for EF_RECEIVED.
+//      _receiveBuffers: the memory of the buffers, ReceiveBufferSize each.
+//      _bufferTail: the tail of _bufferRing, published on each wait().
+//      _lentBuffers: buffers delivered, given back on next wait().
+class UringPoller : public Poller {
+public:
+    UringPoller();
+    virtual ~UringPoller();
+
+    virtual void add(int filter, int fd, void* udata, bool edgeTriggered);
+    virtual void remove(int filter, int fd);
+    virtual void enable(int filter, int fd);
+    virtual void disable(int filter, int fd);
+    virtual void forget(int fd);
+    virtual int wait(std::vector<Event>& eventlist, int maxEvent, long timeout);
+    virtual bool isCompletionBased() const { return _completion; };
+    virtual void send(int fd, struct msghdr* message, void* udata);
+
+private:
+    //  Request is a watch, or a completion request, on the ring.
+    //  - Member variables
+    //      message: the message of EF_SENT.
+    //      forgotten: erased while in flight, kept until its last completion.
+    struct Request {
+        int ident;
+        int filter;
+        void* udata;
+        bool enabled;
+        bool armed;
+        struct msghdr* message;
+        bool forgotten;
+    };
+    typedef std::map<uint64_t, Request> RequestMap;
+    typedef std::map<std::pair<int, int>, uint64_t> TokenMap;
+
+    enum {
+        RingEntries = 256,
+        ReceiveBufferCount = 128,
+        ReceiveBufferSize = 0x1 << 14,
+        ReceiveBufferGroup = 0,
+    };
+
+    int _ring;
+    void* _sqRing;
+    void* _cqRing;
+    std::size_t _sqRingSize;
+    std::size_t _cqRingSize;
+    struct io_uring_sqe* _sqes;
+    std::size_t _sqesSize;
+    unsigned* _sqTail;
+    unsigned* _sqHead;
+    unsigned _sqMask;
+    unsigned _sqEntries;
+    unsigned* _cqHead;
+    unsigned* _cqTail;
+    unsigned _cqMask;
+    struct io_uring_cqe* _cqes;
+
+    struct __kernel_timespec _waitTimeout;
+    uint64_t _nextToken;
+    RequestMap _requests;
+    TokenMap _tokens;
+    std::vector<uint64_t> _rearmTokens;
+    bool _completion;
+    struct io_uring_buf* _bufferRing;
+    char* _receiveBuffers;
+    unsigned short _bufferTail;
+    std::vector<unsigned short> _lentBuffers;
+
+    static bool isCompletionFilter(int filter) { return filter >= EF_ACCEPTED; };
+    void setupReceiveBuffers();
+    void provideBuffer(unsigned short bufferID);
+    void recycleBuffers();
+    uint64_t insertRequest(int ident, int filter, void* udata, bool enabled);
+    void eraseRequest(int ident, int filter);
+    void submitRequest(uint64_t token, Request& request);
+    void submitPoll(uint64_t token, Request& request);
+    void cancelRequest(uint64_t token);
+    void queueSQE(const struct io_uring_sqe& sqe);
+    unsigned countUnsubmitted() const;
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+    void reapCompletion(const struct io_uring_cqe& cqe, std::vector<Event>& eventlist);
+    void reapIOCompletion(RequestMap::iterator iter, const struct io_uring_cqe& cqe, std::vector<Event>& eventlist);
+};
+
+#endif  // URINGPOLLER_HPP_
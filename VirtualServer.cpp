@@ -1,4 +1,6 @@
 #include <fcntl.h>
+#include <cstdlib>
+#include <csignal>
 #include "VirtualServer.hpp"
 #include "EventHandler.hpp"
 #include "EventContext.hpp"
@@ -21,6 +23,7 @@ const Status Status::_array[] = {
     { "411", "length required" },
     { "413", "payload too large" },
     { "500", "internal server error" },
+    { "503", "service unavailable" },
 };
 
 static void updateContentType(const std::string& name, std::string& type);
@@ -49,14 +52,14 @@ _name(name),
 _clientMaxBodySize(DEFAULT_CLIENT_MAX_BODY_SIZE) {
 }
 
-//  update error page of virtual server.
+//  update error page of virtual server. The file is read by readErrorPage().
 //  - Parameters
 //      statusCode: status code in std::string.
 //      filePath: the path of file to read.
 //  - Return: upon successful completion a value of 0 is returned.
 //      otherwise, a value of -1 is returned.
 int VirtualServer::updateErrorPage(EventHandler& eventHandler, const std::string& statusCode, const std::string& filePath) {
-    const int targetFileFD = open(filePath.c_str(), O_RDONLY);
+    const int targetFileFD = open(filePath.c_str(), O_RDONLY | O_CLOEXEC);
     if (targetFileFD == -1)
         return -1;
     if (fcntl(targetFileFD, F_SETFL, O_NONBLOCK) == -1) {
@@ -64,49 +67,44 @@ int VirtualServer::updateErrorPage(EventHandler& eventHandler, const std::string
         return -1;
     }
 
-    std::pair<const std::string&, VirtualServer&>* tempData = new std::pair<const std::string&, VirtualServer&>(statusCode, *this);
-    eventHandler.addEvent(EVFILT_READ, targetFileFD, EventContext::EV_SetVirtualServerErrorPage, tempData);
+    EventContext* context = eventHandler.addEvent(EF_READ, targetFileFD, EventContext::EV_SetVirtualServerErrorPage, this);
 
+    this->_errorPageReaders.push_back(this->readErrorPage(eventHandler, context, statusCode));
+    this->_errorPageReaders.back().start();
     return 0;
 }
 
-//  event function reading a file and setting error page.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult VirtualServer::eventSetVirtualServerErrorPage(EventContext& context) {
+//  Read a file as the error page of statusCode, awaiting it readable, and
+//  close it once read, or once an error is logged.
+//  - Parameters
+//      eventHandler: The EventHandler the file is watched on.
+//      context: context of the file.
+//      statusCode: status code in std::string.
+//  - Return: The coroutine.
+Coroutine VirtualServer::readErrorPage(EventHandler& eventHandler, EventContext* context, std::string statusCode) {
     char buf[BUF_SIZE];
     ssize_t readByteCount;
-    const int targetFileFD = context.getIdent();
-    std::pair<const std::string&, VirtualServer&>* data = static_cast<std::pair<const std::string&, VirtualServer&>*>(context.getData());
-    const std::string& statusCode = data->first;
-
-    readByteCount = read(targetFileFD, buf, BUF_SIZE - 1);
-    if (readByteCount == -1) {
-        delete data;
-        delete &context;
-        close(targetFileFD);
-        return EventContext::ER_Done;
-    }
-    buf[readByteCount] = '\0';
-
-    this->_errorPage[statusCode].append(buf);
 
-    if (readByteCount == BUF_SIZE - 1)
-        return EventContext::ER_Continue;
-    else {
-        delete data;
-        delete &context;
-        close(targetFileFD);
-        return EventContext::ER_Done;
-    }
+    do {
+        co_await eventHandler.readable(context);
+        readByteCount = read(context->getIdent(), buf, BUF_SIZE);
+        try {
+            if (readByteCount > 0)
+                this->_errorPage[statusCode].append(buf, readByteCount);
+        } catch (const std::exception& excep) {
+            Log::warning("Reading the error page %s failed: %s", statusCode.c_str(), excep.what());
+            readByteCount = -1;
+        }
+    } while (readByteCount == BUF_SIZE);
+    eventHandler.removeEvent(EF_READ, context);
 }
 
 //  Process request from client.
 //  - Parameters
 //      clientConnection: The connection of client requesting process.
-//      kqueueFD: The kqueue fd is where to add write event for response.
+//      fileIOPool: The pool running the filesystem work of the request.
 //  - Return: See the type definition.
-VirtualServer::ReturnCode VirtualServer::processRequest(Connection& clientConnection, EventHandler& eventHandler) {
+VirtualServer::ReturnCode VirtualServer::processRequest(Connection& clientConnection, FileIOPool& fileIOPool) {
     const Request& request = clientConnection.getRequest();
     ReturnCode returnCode;
 
@@ -125,13 +123,13 @@ VirtualServer::ReturnCode VirtualServer::processRequest(Connection& clientConnec
 
     switch(request.getMethod()) {
         case HTTP::RM_GET:
-            returnCode = processGET(clientConnection, eventHandler);
+            returnCode = processGET(clientConnection, fileIOPool);
             break;
         case HTTP::RM_POST:
-            returnCode = processPOST(clientConnection, eventHandler);
+            returnCode = processPOST(clientConnection, fileIOPool);
             break;
         case HTTP::RM_DELETE:
-            returnCode = processDELETE(clientConnection);
+            returnCode = processDELETE(clientConnection, fileIOPool);
             break;
         case HTTP::RM_PUT:
             returnCode = set201Response(clientConnection);
@@ -184,13 +182,14 @@ bool VirtualServer::detectCGI(Connection& clientConnection, const Location& loca
     }
 }
 
-//  Process GET request.
+//  Process GET request. The file, index file or directory listing is looked up
+//  and read by fileIOPool, as the connection awaits the job, and responded by
+//  setFileJobResponse().
 //  - Parameters request: The request to process.
 //  - Return(None)
-VirtualServer::ReturnCode VirtualServer::processGET(Connection& clientConnection, EventHandler& eventHandler) {
+VirtualServer::ReturnCode VirtualServer::processGET(Connection& clientConnection, FileIOPool& fileIOPool) {
     const Request& request = clientConnection.getRequest();
     const std::string& targetResourceURI = request.getTargetResourceURI();
-    struct stat buf;
     std::string targetRepresentationURI;
 
     if (this->_others.find("return") != this->_others.end()) {
@@ -222,134 +221,19 @@ VirtualServer::ReturnCode VirtualServer::processGET(Connection& clientConnection
         return this->passCGI(clientConnection, location);
     }
 
-    if (stat(targetRepresentationURI.c_str(), &buf) == 0
-            && (buf.st_mode & S_IFREG) != 0) {
-        this->appendStatusLine(clientConnection, Status::I_200);
-
-        this->appendDefaultHeaderFields(clientConnection);
-        clientConnection.appendResponseMessage("Content-Type: ");
-        std::string type;
-        updateContentType(targetRepresentationURI, type);
-        clientConnection.appendResponseMessage(type);
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Content-Length: ");
-        std::ostringstream oss;
-        oss << buf.st_size;
-        clientConnection.appendResponseMessage(oss.str().c_str());
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Last-Modified: ");
-        const struct timespec lastModified = buf.st_mtimespec;
-        const struct tm tm = *gmtime(&lastModified.tv_sec);
-        char lastModifiedString[BUF_SIZE];
-        strftime(lastModifiedString, BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
-        clientConnection.appendResponseMessage(lastModifiedString);
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
-        clientConnection.appendResponseMessage("\r\n");
-
-        if (buf.st_size == 0)
-            return RC_SUCCESS;
-
-        const int targetFileFD = open(targetRepresentationURI.c_str(), O_RDONLY);
-        if (targetFileFD == -1)
-            return RC_ERROR;
-        if (fcntl(targetFileFD, F_SETFL, O_NONBLOCK) == -1) {
-            close(targetFileFD);
-            return RC_ERROR;
-        }
-
-        eventHandler.addEvent(EVFILT_READ, targetFileFD, EventContext::EV_GETResponse, &clientConnection);
-
-        clientConnection.initResponseBodyBySize(buf.st_size);
-
-        return RC_IN_PROGRESS;
-    }
-    const std::string absoluteIndexPath = targetRepresentationURI + "/" + location.getIndex();
-    if (stat(absoluteIndexPath.c_str(), &buf) == 0
-            && (buf.st_mode & S_IFREG) != 0) {
-        this->appendStatusLine(clientConnection, Status::I_200);
-
-        this->appendDefaultHeaderFields(clientConnection);
-        clientConnection.appendResponseMessage("Content-Type: ");
-        std::string type;
-        updateContentType(location.getIndex(), type);
-        clientConnection.appendResponseMessage(type);
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Content-Length: ");
-        std::ostringstream oss;
-        oss << buf.st_size;
-        clientConnection.appendResponseMessage(oss.str().c_str());
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Last-Modified: ");
-        const struct timespec lastModified = buf.st_mtimespec;
-        const struct tm tm = *gmtime(&lastModified.tv_sec);
-        char lastModifiedString[BUF_SIZE];
-        strftime(lastModifiedString, BUF_SIZE, "%a, %d %b %Y %H:%M:%S GMT", &tm);
-        clientConnection.appendResponseMessage(lastModifiedString);
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
-        clientConnection.appendResponseMessage("\r\n");
-
-        if (buf.st_size == 0)
-            return RC_SUCCESS;
-        const int targetFileFD = open(absoluteIndexPath.c_str(), O_RDONLY);
-        if (targetFileFD == -1)
-            return RC_ERROR;
-        if (fcntl(targetFileFD, F_SETFL, O_NONBLOCK) == -1) {
-            close(targetFileFD);
-            return RC_ERROR;
-        }
-
-        eventHandler.addEvent(EVFILT_READ, targetFileFD, EventContext::EV_GETResponse, &clientConnection);
-
-        clientConnection.initResponseBodyBySize(buf.st_size);
-
-        return RC_IN_PROGRESS;
-    }
-
-    if (location.getAutoIndex()
-            && stat(targetRepresentationURI.c_str(), &buf) == 0
-            && (buf.st_mode & S_IFDIR) != 0)
-        return this->setListResponse(clientConnection, targetRepresentationURI.c_str());
-
-    return this->set404Response(clientConnection);
-}
-
-
-//  event function reading a file and responding of GET request.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult VirtualServer::eventGETResponse(EventContext& context, EventHandler& eventHandler) {
-    char buf[BUF_SIZE];
-    ssize_t readByteCount;
-    const int targetFileFD = context.getIdent();
-    Connection& clientConnection = *static_cast<Connection*>(context.getData());
-
-    readByteCount = read(targetFileFD, buf, BUF_SIZE);
-    if (readByteCount == -1) {
-        delete &context;
-        close(targetFileFD);
-        return EventContext::ER_Done;
-    }
-
-    clientConnection.memcpyResponseMessage(buf, readByteCount);
+    FileJob* job = fileIOPool.newJob(FileJob::FJ_Get, clientConnection.getIdent(), clientConnection.getGeneration(), targetRepresentationURI);
 
-    if (!clientConnection.isResponseReadAllFile())
-        return EventContext::ER_Continue;
-    else {
-        delete &context;
-        close(targetFileFD);
-
-        const int clientSocketFD = clientConnection.getIdent();
-        eventHandler.addEvent(EVFILT_WRITE, clientSocketFD, EventContext::EV_Response, &clientConnection);
-        return EventContext::ER_Done;
-    }
+    job->indexPath = targetRepresentationURI + "/" + location.getIndex();
+    job->autoIndex = location.getAutoIndex();
+    clientConnection.setFileJob(job);
+    return RC_IN_PROGRESS;
 }
 
-//  Process POST request.
+//  Process POST request. The body is written by fileIOPool, as the connection
+//  awaits the job, and responded by setFileJobResponse().
 //  - Parameters request: The request to process.
 //  - Return(None)
-VirtualServer::ReturnCode VirtualServer::processPOST(Connection& clientConnection, EventHandler& eventHandler) {
+VirtualServer::ReturnCode VirtualServer::processPOST(Connection& clientConnection, FileIOPool& fileIOPool) {
     const Request& request = clientConnection.getRequest();
     const std::string& targetResourceURI = request.getTargetResourceURI();
     std::string targetRepresentationURI;
@@ -383,84 +267,20 @@ VirtualServer::ReturnCode VirtualServer::processPOST(Connection& clientConnectio
         return this->passCGI(clientConnection, location);
     }
 
-    const int targetFileFD = open(targetRepresentationURI.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (targetFileFD == -1)
-        return RC_ERROR;
-    if (fcntl(targetFileFD, F_SETFL, O_NONBLOCK) == -1) {
-        close(targetFileFD);
-        return RC_ERROR;
-    }
-
-    eventHandler.addEvent(EVFILT_WRITE, targetFileFD, EventContext::EV_POSTResponse, &clientConnection);
+    FileJob* job = fileIOPool.newJob(FileJob::FJ_Post, clientConnection.getIdent(), clientConnection.getGeneration(), targetRepresentationURI);
 
+    clientConnection.takeRequestBody(job->body);
+    clientConnection.setFileJob(job);
     return RC_IN_PROGRESS;
 }
 
-//  event function writing a file and responding of POST request.
-//  - Parameters context: context of event.
-//  - Return: result of event.
-EventContext::EventResult VirtualServer::eventPOSTResponse(EventContext& context, EventHandler& eventHandler) {
-    typedef std::pair<std::string, const char*> ElementType;
-    typedef std::map<int, ElementType> SendBeginMapType;
-
-    static SendBeginMapType sendBeginMap;
-    const int targetFileFD = context.getIdent();
-    Connection& clientConnection = *static_cast<Connection*>(context.getData());
-
-    ElementType* element;
-    const SendBeginMapType::iterator iter = sendBeginMap.find(targetFileFD);
-    if (iter == sendBeginMap.end()) {
-        element = &sendBeginMap[targetFileFD];
-        element->first = clientConnection.getRequest().getBody();
-        element->second = &element->first[0];
-    }
-    else {
-        element = &iter->second;
-    }
-
-    const char* const sendBegin = element->second;
-    std::size_t lengthToSend = std::strlen(sendBegin);
-
-    ssize_t writeByteCount;
-    writeByteCount = write(targetFileFD, sendBegin, lengthToSend);
-
-    if (static_cast<std::size_t>(writeByteCount) != lengthToSend) {
-        element->second += writeByteCount;
-        return EventContext::ER_Continue;
-    }
-
-    sendBeginMap.erase(targetFileFD);
-    delete &context;
-    close(targetFileFD);
-
-    this->appendStatusLine(clientConnection, Status::I_201);
-
-    std::string bodyString;
-    this->updateBodyString(Status::I_201, "File created.", bodyString);
-
-    this->appendContentDefaultHeaderFields(clientConnection);
-    clientConnection.appendResponseMessage("Content-Length: ");
-    std::ostringstream oss;
-    oss << bodyString.length();
-    clientConnection.appendResponseMessage(oss.str());
-    clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
-    clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
-
-    const int clientSocketFD = clientConnection.getIdent();
-    eventHandler.addEvent(EVFILT_WRITE, clientSocketFD, EventContext::EV_Response, &clientConnection);
-
-    return EventContext::ER_Done;
-}
-
-//  Process DELETE request.
+//  Process DELETE request. The file is unlinked by fileIOPool, as the
+//  connection awaits the job, and responded by setFileJobResponse().
 //  - Parameters request: The request to process.
 //  - Return(None)
-VirtualServer::ReturnCode VirtualServer::processDELETE(Connection& clientConnection) {
+VirtualServer::ReturnCode VirtualServer::processDELETE(Connection& clientConnection, FileIOPool& fileIOPool) {
     const Request& request = clientConnection.getRequest();
     const std::string& targetResourceURI = request.getTargetResourceURI();
-    struct stat buf;
     std::string targetRepresentationURI;
 
     if (this->_others.find("return") != this->_others.end()) {
@@ -487,30 +307,107 @@ VirtualServer::ReturnCode VirtualServer::processDELETE(Connection& clientConnect
         return this->set413Response(clientConnection);
 
     location.updateRepresentationPath(targetResourceURI, targetRepresentationURI);
-    if (stat(targetRepresentationURI.c_str(), &buf) == 0) {
+    clientConnection.setFileJob(fileIOPool.newJob(FileJob::FJ_Delete, clientConnection.getIdent(), clientConnection.getGeneration(), targetRepresentationURI));
+    return RC_IN_PROGRESS;
+}
 
-        if (unlink(targetRepresentationURI.c_str()) == -1)
-            return RC_ERROR;
+//  Set the response of a request once its FileJob has been run.
+//  - Parameters
+//      clientConnection: The connection of client which requested job.
+//      job: The job run.
+//  - Return(None)
+void VirtualServer::setFileJobResponse(Connection& clientConnection, FileJob& job) {
+    ReturnCode returnCode = RC_ERROR;
+
+    switch (job.result) {
+    case FileJob::FR_File:
+        returnCode = this->setFileResponse(clientConnection, job);
+        break;
+    case FileJob::FR_Directory:
+        returnCode = this->setListResponse(clientConnection, job.entries);
+        break;
+    case FileJob::FR_Done:
+        if (job.operation == FileJob::FJ_Post)
+            returnCode = this->setFileJobDoneResponse(clientConnection, Status::I_201, "File created.");
+        else
+            returnCode = this->setFileJobDoneResponse(clientConnection, Status::I_200, "File deleted.");
+        break;
+    case FileJob::FR_NotFound:
+        returnCode = this->set404Response(clientConnection);
+        break;
+    case FileJob::FR_Error:
+        Log::debug("File job on %s failed: %s", job.path.c_str(), strerror(job.error));
+        break;
+    }
+    if (returnCode == RC_ERROR)
+        this->set500Response(clientConnection);
+}
 
-        this->appendStatusLine(clientConnection, Status::I_200);
+//  set response message with the file read by job.
+//  - Parameters
+//      clientConnection: The client connection.
+//      job: The FileJob with FR_File result, whose data or file is taken over
+//          as the body.
+//  - Return(None)
+VirtualServer::ReturnCode VirtualServer::setFileResponse(Connection& clientConnection, FileJob& job) {
+    clientConnection.clearResponseMessage();
+    this->appendStatusLine(clientConnection, Status::I_200);
 
-        std::string bodyString;
-        this->updateBodyString(Status::I_200, "File deleted.", bodyString);
+    this->appendDefaultHeaderFields(clientConnection);
+    clientConnection.appendResponseMessage("Content-Type: ");
+    std::string type;
+    updateContentType(job.file, type);
+    clientConnection.appendResponseMessage(type);
+    clientConnection.appendResponseMessage("\r\n");
+    clientConnection.appendResponseMessage("Content-Length: ");
+    std::ostringstream oss;
+    if (job.fd != -1)
+        oss << job.size;
+    else
+        oss << job.data.length();
+    clientConnection.appendResponseMessage(oss.str());
+    clientConnection.appendResponseMessage("\r\n");
+    clientConnection.appendResponseMessage("Last-Modified: ");
+    char lastModifiedString[LoopClock::HTTPDateSize];
+    LoopClock::formatHTTPDate(job.lastModified, lastModifiedString);
+    clientConnection.appendResponseMessage(lastModifiedString);
+    clientConnection.appendResponseMessage("\r\n");
+    this->appendConnectionHeaderField(clientConnection);
+    clientConnection.appendResponseMessage("\r\n");
+    if (job.fd != -1) {
+        clientConnection.setResponseFile(job.fd, job.size);
+        job.fd = -1;
+    }
+    else
+        clientConnection.setResponseBody(job.data);
 
-        this->appendContentDefaultHeaderFields(clientConnection);
-        clientConnection.appendResponseMessage("Content-Length: ");
-        std::ostringstream oss;
-        oss << bodyString.length();
-        clientConnection.appendResponseMessage(oss.str());
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
-        clientConnection.appendResponseMessage("\r\n");
-        clientConnection.appendResponseMessage(bodyString);
+    return RC_SUCCESS;
+}
 
-        return RC_SUCCESS;
-    }
+//  set response message of a file written or deleted.
+//  - Parameters
+//      clientConnection: The client connection.
+//      index: The status of response.
+//      description: The description in default body.
+//  - Return(None)
+VirtualServer::ReturnCode VirtualServer::setFileJobDoneResponse(Connection& clientConnection, Status::Index index, const char* description) {
+    clientConnection.clearResponseMessage();
+    this->appendStatusLine(clientConnection, index);
+
+    std::string bodyString;
+    this->updateBodyString(index, description, bodyString);
+
+    this->appendContentDefaultHeaderFields(clientConnection);
+    clientConnection.appendResponseMessage("Content-Length: ");
+    std::ostringstream oss;
+    oss << bodyString.length();
+    clientConnection.appendResponseMessage(oss.str());
+    clientConnection.appendResponseMessage("\r\n");
+    this->appendConnectionHeaderField(clientConnection);
+    clientConnection.appendResponseMessage("\r\n");
+    clientConnection.setResponseBody(bodyString);
 
-    return this->set404Response(clientConnection);
+    return RC_SUCCESS;
 }
 
 //  Set status line to response of clientConnection.
@@ -528,10 +425,19 @@ void VirtualServer::appendStatusLine(Connection& clientConnection, Status::Index
 void VirtualServer::appendDefaultHeaderFields(Connection& clientConnection) {
     clientConnection.appendResponseMessage("Server: crash-webserve\r\n");
     clientConnection.appendResponseMessage("Date: ");
-    clientConnection.appendResponseMessage(this->makeDateHeaderField());
+    clientConnection.appendResponseMessage(clientConnection.getClock().getHTTPDate());
     clientConnection.appendResponseMessage("\r\n");
 }
 
+//  append the Connection header field, telling whether the connection is kept
+//  open after the response.
+void VirtualServer::appendConnectionHeaderField(Connection& clientConnection) {
+    if (clientConnection.isKeepAlive())
+        clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    else
+        clientConnection.appendResponseMessage("Connection: close\r\n");
+}
+
 //  append default header fields for error code.
 void VirtualServer::appendContentDefaultHeaderFields(Connection& clientConnection) {
     this->appendDefaultHeaderFields(clientConnection);
@@ -564,9 +470,9 @@ VirtualServer::ReturnCode VirtualServer::set201Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
@@ -581,7 +487,7 @@ VirtualServer::ReturnCode VirtualServer::set301Response(Connection& clientConnec
     clientConnection.clearResponseMessage();
     this->appendStatusLine(clientConnection, Status::I_301);
     this->appendDefaultHeaderFields(clientConnection);
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("Content-Length: ");
     this->updateBodyString(Status::I_301, NULL, bodyString);
     ss << bodyString.size();
@@ -595,7 +501,7 @@ VirtualServer::ReturnCode VirtualServer::set301Response(Connection& clientConnec
     clientConnection.appendResponseMessage("\r\n");
     clientConnection.appendResponseMessage("\r\n");
 
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
     return RC_SUCCESS;
 }
 
@@ -609,7 +515,7 @@ VirtualServer::ReturnCode VirtualServer::set308Response(Connection& clientConnec
     clientConnection.clearResponseMessage();
     this->appendStatusLine(clientConnection, Status::I_308);
     this->appendDefaultHeaderFields(clientConnection);
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("Content-Length: ");
     this->updateBodyString(Status::I_308, NULL, bodyString);
     ss << bodyString.size();
@@ -623,7 +529,7 @@ VirtualServer::ReturnCode VirtualServer::set308Response(Connection& clientConnec
     clientConnection.appendResponseMessage("\r\n");
     clientConnection.appendResponseMessage("\r\n");
 
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
     return RC_SUCCESS;
 }
 
@@ -644,9 +550,9 @@ VirtualServer::ReturnCode VirtualServer::set400Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
@@ -667,9 +573,9 @@ VirtualServer::ReturnCode VirtualServer::set404Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
@@ -683,7 +589,7 @@ VirtualServer::ReturnCode VirtualServer::set405Response(Connection& clientConnec
 
 
     std::string bodyString;
-    std::string reqBody = clientConnection.getRequest().getBody();
+    const std::string& reqBody = clientConnection.getRequest().getBody();
     this->updateBodyString(Status::I_405, reqBody.c_str(), bodyString);
 
     this->appendContentDefaultHeaderFields(clientConnection);
@@ -692,7 +598,7 @@ VirtualServer::ReturnCode VirtualServer::set405Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
 
     if (location != NULL) {
         clientConnection.appendResponseMessage("Allow: ");
@@ -708,7 +614,7 @@ VirtualServer::ReturnCode VirtualServer::set405Response(Connection& clientConnec
         clientConnection.appendResponseMessage("\r\n");
     }
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
@@ -730,9 +636,9 @@ VirtualServer::ReturnCode VirtualServer::set411Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
@@ -754,9 +660,9 @@ VirtualServer::ReturnCode VirtualServer::set413Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
@@ -777,95 +683,64 @@ VirtualServer::ReturnCode VirtualServer::set500Response(Connection& clientConnec
     oss << bodyString.length();
     clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage(bodyString);
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
 
-//  set body for directory listing.
-VirtualServer::ReturnCode VirtualServer::setListResponse(Connection& clientConnection, const std::string& path) {
+//  set response message with 503 status, refusing a request under overload.
+//  The client is told to retry after SHED_RETRY_AFTER seconds.
+//  - Parameters clientConnection: The client connection.
+//  - Return(None)
+VirtualServer::ReturnCode VirtualServer::set503Response(Connection& clientConnection) {
     clientConnection.clearResponseMessage();
-    this->appendStatusLine(clientConnection, Status::I_200);
-
-    DIR* dir;
+    this->appendStatusLine(clientConnection, Status::I_503);
 
-    dir = opendir(path.c_str());
-    if (dir == NULL)
-        return RC_ERROR;
-
-    int contentLength = 100;
-    while (true) {
-        const struct dirent* entry = readdir(dir);
-        if (entry == NULL)
-            break;
-        if (entry->d_namlen == 1 && strcmp(entry->d_name, ".") == 0)
-            continue;
-
-        const bool isEntryDirectory = (entry->d_type == DT_DIR);
-        contentLength += (entry->d_namlen + isEntryDirectory) * 2 + 17;
-    }
-    closedir(dir);
-
-    contentLength += 26;
+    std::string bodyString;
+    this->updateBodyString(Status::I_503, NULL, bodyString);
 
     this->appendContentDefaultHeaderFields(clientConnection);
     clientConnection.appendResponseMessage("Content-Length: ");
     std::ostringstream oss;
-    oss << contentLength;
-    clientConnection.appendResponseMessage(oss.str().c_str());
+    oss << bodyString.length() << "\r\nRetry-After: " << SHED_RETRY_AFTER;
+    clientConnection.appendResponseMessage(oss.str());
     clientConnection.appendResponseMessage("\r\n");
-    clientConnection.appendResponseMessage("Connection: keep-alive\r\n");
+    this->appendConnectionHeaderField(clientConnection);
     clientConnection.appendResponseMessage("\r\n");
+    clientConnection.setResponseBody(bodyString);
 
-    clientConnection.appendResponseMessage("<html>\r\n<head><title>Index of /</title></head>\r\n<body bgcolor=\"white\">\r\n<h1>Index of /</h1><hr><pre>");
-
-    dir = opendir(path.c_str());
-    if (dir == NULL)
-        return RC_ERROR;
+    return RC_SUCCESS;
+}
 
-    while (true) {
-        const struct dirent* entry = readdir(dir);
-        if (entry == NULL)
-            break;
-        if (entry->d_namlen == 1 && strcmp(entry->d_name, ".") == 0)
-            continue;
-
-        const bool isEntryDirectory = (entry->d_type == DT_DIR);
-        std::string name;
-        if (!isEntryDirectory)
-            name = entry->d_name;
-        else {
-            name += entry->d_name;
-            name += "/";
-        }
+//  set body for directory listing.
+VirtualServer::ReturnCode VirtualServer::setListResponse(Connection& clientConnection, const std::vector<std::string>& entries) {
+    std::string bodyString = "<html>\r\n<head><title>Index of /</title></head>\r\n<body bgcolor=\"white\">\r\n<h1>Index of /</h1><hr><pre>";
 
-        clientConnection.appendResponseMessage("<a href=\"");
-        clientConnection.appendResponseMessage(name);
-        clientConnection.appendResponseMessage("\">");
-        clientConnection.appendResponseMessage(name);
-        clientConnection.appendResponseMessage("</a>\r\n");
+    for (std::vector<std::string>::const_iterator iter = entries.begin(); iter != entries.end(); ++iter) {
+        bodyString += "<a href=\"";
+        bodyString += *iter;
+        bodyString += "\">";
+        bodyString += *iter;
+        bodyString += "</a>\r\n";
     }
-    closedir(dir);
+    bodyString += "</pre><hr></body></html>\r\n";
 
-    clientConnection.appendResponseMessage("</pre><hr></body></html>\r\n");
+    clientConnection.clearResponseMessage();
+    this->appendStatusLine(clientConnection, Status::I_200);
+    this->appendContentDefaultHeaderFields(clientConnection);
+    clientConnection.appendResponseMessage("Content-Length: ");
+    std::ostringstream oss;
+    oss << bodyString.length();
+    clientConnection.appendResponseMessage(oss.str());
+    clientConnection.appendResponseMessage("\r\n");
+    this->appendConnectionHeaderField(clientConnection);
+    clientConnection.appendResponseMessage("\r\n");
+    clientConnection.setResponseBody(bodyString);
 
     return RC_SUCCESS;
 }
-// Find the current time based on GMT
-//  - Parameters(None)
-//  - Return
-//      Current time based on GMT(std::string)
-std::string VirtualServer::makeDateHeaderField() {
-    char cDate[1000];
-    time_t rr = time(0);
-    struct tm tm = *gmtime(&rr);
-    strftime(cDate, sizeof(cDate), "%a, %d %b %Y %H:%M:%S GMT", &tm);
-    std::string dateStr = cDate;
-    return dateStr;
-}
-
 // Make Location Field (redirection path)
 //  - Parameters
 //      locOther : etc directive set of connected locations
@@ -1006,7 +881,7 @@ char** VirtualServer::makeCGIEnvironmentArray() {
             iter++) {
 		element = iter->first + "=" + iter->second;
 		result[idx] = new char[element.length() + 1];
-        strlcpy(result[idx], element.c_str(), element.length() + 1);
+        std::memcpy(result[idx], element.c_str(), element.length() + 1);
         idx++;
 	}
 	result[idx] = NULL;
@@ -1048,6 +923,12 @@ VirtualServer::ReturnCode VirtualServer::passCGI(Connection& clientConnection, c
         Log::error("VirtualServer::passCGI pipe() Failed.");
         return RC_ERROR;
     }
+    // CGI processes must not inherit pipes of other requests, or those never
+    // reach EOF while the process runs. dup2() clears the flag on stdin/stdout.
+    for (int i = 0; i < 2; ++i) {
+        fcntl(pipeToChild[i], F_SETFD, FD_CLOEXEC);
+        fcntl(pipeFromChild[i], F_SETFD, FD_CLOEXEC);
+    }
 
     pid = fork();
     if (pid == ChildProcess) {
@@ -1055,12 +936,21 @@ VirtualServer::ReturnCode VirtualServer::passCGI(Connection& clientConnection, c
         close(pipeFromChild[0]);
 		dup2(pipeToChild[0], STDIN_FILENO);
 		dup2(pipeFromChild[1], STDOUT_FILENO);
+		signal(SIGPIPE, SIG_DFL);
 		execve(cgiPath.c_str(), argScript, const_cast<char*const*>(envp));
         exit(130);
 	} else {
 
-        // close(pipeToChild[0]);
+        // Ends of the child are closed here, so the events own one end each.
+        close(pipeToChild[0]);
         close(pipeFromChild[1]);
+        pipeToChild[0] = -1;
+        pipeFromChild[1] = -1;
+        // The pipes are awaited by the connection, so they must not block.
+        if (pid != Error) {
+            fcntl(pipeToChild[1], F_SETFL, O_NONBLOCK);
+            fcntl(pipeFromChild[0], F_SETFL, O_NONBLOCK);
+        }
         _CGIEnvironmentMap.clear();
 
         for (size_t i = 0; envp[i]; i++)
@@ -1068,33 +958,17 @@ VirtualServer::ReturnCode VirtualServer::passCGI(Connection& clientConnection, c
         delete[] envp;
 
         if (pid == Error) {
+            close(pipeToChild[1]);
+            close(pipeFromChild[0]);
             Log::error("VirtualServer::passCGI fork() Failed.");
             // send response code 500 
             return RC_ERROR;
         }
 
-        int statloc;
-        waitpid(pid, &statloc, WNOHANG);
-        if (WEXITSTATUS(statloc) == 130) {
-            Log::debug("CGI execution failed.");
-        } else {
-
-            clientConnection.addKevent(
-                EVFILT_WRITE,
-                pipeToChild[1],
-                EventContext::EV_CGIParamBody,
-                (void*)&clientConnection,
-                pipeToChild
-            );
-
-            clientConnection.addKevent(
-                EVFILT_READ,
-                pipeFromChild[0],
-                EventContext::EV_CGIResponse,
-                (void*)&clientConnection,
-                pipeFromChild
-            );
-        }
+        // A script failing to run exits without output, which is answered
+        // like any other empty output. Children are reaped by the kernel
+        // (SA_NOCLDWAIT), so only their exit is awaited, not their status.
+        clientConnection.setCGI(pid, pipeToChild[1], pipeFromChild[0]);
     }
     return RC_IN_PROGRESS;
 }
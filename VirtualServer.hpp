@@ -15,6 +15,8 @@
 #include "Location.hpp"
 #include "Connection.hpp"
 #include "Request.hpp"
+#include "FileIOPool.hpp"
+#include "Coroutine.hpp"
 #include "constant.hpp"
 
 class Connection;
@@ -46,6 +48,7 @@ struct Status {
         I_411,
         I_413,
         I_500,
+        I_503,
     };
 
     static const Status _array[];
@@ -76,11 +79,16 @@ inline const char* getStatusReasonBy(HTTP::Status::Index index) {
 //      _name: The name of server.
 //      _clientMaxBodySize: The limit of body size in request messsage.
 //      _location: The location directive data for VirtualServer.
+//      _errorPageReaders: The coroutines reading the error pages.
 //
 //      _others: Variable for additional data.
 //          std::string _defaultErrorPagePath: The path used to set error pages.
 //
 //      _statusCode: Store status code of server.
+//      _CGIEnvironmentMap: The CGI environment of the request being processed.
+//
+//  Each worker thread builds its own VirtualServers (see FTServer::runWorker),
+//  so the members above are never shared between threads.
 class VirtualServer {
 public:
     enum ReturnCode {
@@ -102,13 +110,11 @@ public:
     };
     void appendLocation(Location* lc) { this->_location.push_back(lc); };
     int updateErrorPage(EventHandler& eventHandler, const std::string& statusCode, const std::string& filePath);
-    EventContext::EventResult eventSetVirtualServerErrorPage(EventContext& context);
-    EventContext::EventResult eventGETResponse(EventContext& context, EventHandler& eventHandler);
-    EventContext::EventResult eventPOSTResponse(EventContext& context, EventHandler& eventHandler);
+    void setFileJobResponse(Connection& clientConnection, FileJob& job);
 
-    VirtualServer::ReturnCode processRequest(Connection& clientConnection, EventHandler& eventHandler);
+    VirtualServer::ReturnCode processRequest(Connection& clientConnection, FileIOPool& fileIOPool);
+    ReturnCode set503Response(Connection& clientConnection);
 
-    std::string makeDateHeaderField();
     std::string makeLocationHeaderField(const std::map<std::string, std::vector<std::string> >& locOther);
 
 private:
@@ -120,16 +126,20 @@ private:
     std::map<std::string, std::vector<std::string> > _others;
 
     std::map<std::string, std::string> _errorPage;
+    std::vector<Coroutine> _errorPageReaders;
+
+    Coroutine readErrorPage(EventHandler& eventHandler, EventContext* context, std::string statusCode);
 
     const Location* getMatchingLocation(const Request& request);
 
-    ReturnCode processGET(Connection& clientConnection, EventHandler& eventHandler);
-    ReturnCode processPOST(Connection& clientConnection, EventHandler& eventHandler);
-    ReturnCode processDELETE(Connection& clientConnection);
+    ReturnCode processGET(Connection& clientConnection, FileIOPool& fileIOPool);
+    ReturnCode processPOST(Connection& clientConnection, FileIOPool& fileIOPool);
+    ReturnCode processDELETE(Connection& clientConnection, FileIOPool& fileIOPool);
 
     void appendStatusLine(Connection& clientConnection, HTTP::Status::Index index);
     void appendDefaultHeaderFields(Connection& clientConnection);
     void appendContentDefaultHeaderFields(Connection& clientConnection);
+    void appendConnectionHeaderField(Connection& clientConnection);
     void updateBodyString(HTTP::Status::Index index, const char* description, std::string& bodystring) const;
 
     ReturnCode set201Response(Connection& clientConnection);
@@ -141,7 +151,9 @@ private:
     ReturnCode set411Response(Connection& clientConnection);
     ReturnCode set413Response(Connection& clientConnection);
     ReturnCode set500Response(Connection& clientConnection);
-    ReturnCode setListResponse(Connection& clientConnection, const std::string& path);
+    ReturnCode setListResponse(Connection& clientConnection, const std::vector<std::string>& entries);
+    ReturnCode setFileResponse(Connection& clientConnection, FileJob& job);
+    ReturnCode setFileJobDoneResponse(Connection& clientConnection, HTTP::Status::Index index, const char* description);
 
     // enum {
     //     SERVER_SOFTWARE,
@@ -20,7 +20,7 @@ VirtualServerConfig::~VirtualServerConfig() {
 //  - return(None)
 void    VirtualServerConfig::appendConfig(std::string directive, std::vector<std::string> value) {
     std::map<std::string, std::vector<std::string> >::iterator itr = this->_configs.find(directive);
-    if (itr->first == "error_page" && itr != this->_configs.end()) {
+    if (itr != this->_configs.end() && itr->first == "error_page") {
         for (std::vector<std::string>::iterator itr2 = value.begin();
             itr2 != value.end();
             itr2++)
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Keep-alive load driver for webserv.
+
+Starts the server once per busy_poll setting, on a config of its own, and runs
+closed-loop keep-alive clients against it: each connection sends a GET, reads
+the whole response, and sends the next one. A connection the server closes
+(keepalive_requests) is opened again. The latency of every request after the
+warmup is kept, and the percentiles are printed per setting.
+
+    make bench
+    python3 bench/keepalive.py --connections 64 --duration 10 --busy-poll 0 50
+"""
+
+import argparse
+import asyncio
+import multiprocessing
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+CONFIG = """server {{
+    listen {port}{busy_poll};
+    server_name localhost;
+    location / {{
+        allow_method GET;
+        root {root};
+    }}
+}}
+"""
+
+
+async def run_connection(args, warmup_end, deadline, latencies, counters):
+    request = ("GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n" % args.target).encode()
+    reader = writer = None
+
+    while time.monotonic() < deadline:
+        if writer is None:
+            reader, writer = await asyncio.open_connection(args.host, args.port)
+            counters["connects"] += 1
+        start = time.perf_counter_ns()
+        writer.write(request)
+        head = await reader.readuntil(b"\r\n\r\n")
+        fields = {}
+        for line in head.decode("latin-1").split("\r\n")[1:]:
+            name, _, value = line.partition(":")
+            fields[name.strip().lower()] = value.strip().lower()
+        await reader.readexactly(int(fields.get("content-length", "0")))
+        if time.monotonic() >= warmup_end:
+            latencies.append(time.perf_counter_ns() - start)
+        if not head.startswith(b"HTTP/1.1 200"):
+            counters["errors"] += 1
+        if fields.get("connection") == "close":
+            writer.close()
+            reader = writer = None
+    if writer is not None:
+        writer.close()
+
+
+async def run_client(args, connections, start_at):
+    latencies = []
+    counters = {"connects": 0, "errors": 0}
+    warmup_end = start_at + args.warmup
+    deadline = warmup_end + args.duration
+
+    await asyncio.gather(*(run_connection(args, warmup_end, deadline, latencies, counters)
+                           for _ in range(connections)))
+    return latencies, counters
+
+
+def client_process(job):
+    args, connections, start_at = job
+    return asyncio.run(run_client(args, connections, start_at))
+
+
+def wait_for_port(host, port, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection((host, port), timeout=0.2).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+def run_setting(args, busy_poll):
+    root = os.path.abspath(args.root)
+    config = CONFIG.format(port=args.port, root=root,
+                           busy_poll=" busy_poll=%d" % busy_poll if busy_poll > 0 else "")
+
+    with tempfile.NamedTemporaryFile("w", suffix=".conf", delete=False) as conf:
+        conf.write(config)
+    server = subprocess.Popen([args.server, conf.name], stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+    try:
+        if not wait_for_port(args.host, args.port, 5):
+            sys.exit("webserv did not listen on port %d" % args.port)
+        shares = [args.connections // args.processes + (i < args.connections % args.processes)
+                  for i in range(args.processes)]
+        start_at = time.monotonic() + 0.2
+        with multiprocessing.Pool(args.processes) as pool:
+            results = pool.map(client_process, [(args, n, start_at) for n in shares if n > 0])
+    finally:
+        server.terminate()
+        server.wait()
+        os.unlink(conf.name)
+
+    latencies = sorted(value for result in results for value in result[0])
+    connects = sum(result[1]["connects"] for result in results)
+    errors = sum(result[1]["errors"] for result in results)
+    if not latencies:
+        sys.exit("no request completed")
+    print("busy_poll=%-4s requests=%-8d rps=%-9.0f p50=%7.1fus p99=%7.1fus p99.9=%7.1fus connects=%d errors=%d" % (
+        busy_poll if busy_poll > 0 else "off", len(latencies), len(latencies) / args.duration,
+        percentile(latencies, 0.50) / 1000.0, percentile(latencies, 0.99) / 1000.0,
+        percentile(latencies, 0.999) / 1000.0, connects, errors))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--server", default="./webserv", help="webserv binary (default ./webserv)")
+    parser.add_argument("--root", default=".", help="document root (default .)")
+    parser.add_argument("--target", default="/html/index.html", help="path requested")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=18480)
+    parser.add_argument("--connections", type=int, default=32, help="keep-alive connections in all")
+    parser.add_argument("--processes", type=int, default=2, help="client processes sharing them")
+    parser.add_argument("--duration", type=float, default=5.0, help="seconds measured per setting")
+    parser.add_argument("--warmup", type=float, default=1.0, help="seconds run before measuring")
+    parser.add_argument("--busy-poll", type=int, nargs="+", default=[0, 50],
+                        help="busy_poll values in microseconds to compare, 0 for off (default 0 50)")
+    args = parser.parse_args()
+
+    print("webserv keep-alive: %d connections, %d client processes, %s, %.0f s per setting" % (
+        args.connections, args.processes, args.target, args.duration))
+    for busy_poll in args.busy_poll:
+        run_setting(args, busy_poll)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,12 +1,50 @@
 #ifndef CONSTANT_HPP_
 #define CONSTANT_HPP_
 
+#include <cstddef>
+#include <string>
+
 const int BUF_SIZE = 0x1 << 16;
 const unsigned int MAX_WRITEBUFFER = 0x1 << 17;
-const int LISTEN_BACKLOG = 40;
+const int LISTEN_BACKLOG = 511;
+const int DEFER_ACCEPT_TIMEOUT = 10;
 const int DEFAULT_CLIENT_MAX_BODY_SIZE = 100000;
 const int TIMEOUT = 40000000;
+const int SEND_TIMEOUT = 60000;
+const int TIMER_RESOLUTION = 100;
+const int DEFAULT_WORKER_THREADS = 1;
+const int DEFAULT_WORKER_PROCESSES = 0;
+const int WORKER_RESPAWN_DELAY = 1;
+const int DEFAULT_SHUTDOWN_TIMEOUT = 10;
+const int DEFAULT_KEEPALIVE_TIMEOUT = 75;
+const unsigned long DEFAULT_KEEPALIVE_REQUESTS = 1000;
+const int DRAIN_CHECK_INTERVAL = 100;
+const int DEFAULT_OVERLOAD_INTERVAL = 100;
+const int SHED_RETRY_AFTER = 1;
+const int DEFAULT_MAX_EVENTS = 512;
+const int DEFAULT_ACCEPT_BATCH = 64;
+const int DEFAULT_FILE_IO_THREADS = 4;
+const unsigned long LOOP_STATS_INTERVAL = 100000;
+const int LOOP_METRICS_INTERVAL = 60;
+const int DEFAULT_STALL_THRESHOLD = 20;
+const std::size_t DRAIN_BUDGET = 0x1 << 18;
+const std::size_t PIPELINE_BUFFER_SIZE = 0x1 << 20;
+const long PIPELINE_OUTPUT_SIZE = 0x1 << 20;
+const int SEND_IOV_COUNT = 64;
+const int RECEIVE_IOV_COUNT = 16;
+const long DEFAULT_CLIENT_HEADER_BUFFER_SIZE = 0x1 << 10;
+const long DEFAULT_LARGE_HEADER_BUFFERS = 4;
+const long DEFAULT_LARGE_HEADER_BUFFER_SIZE = 0x1 << 13;
+const long DEFAULT_CLIENT_BODY_BUFFER_SIZE = 0x1 << 14;
+const std::size_t BUFFER_POOL_IDLE_LIMIT = 0x1 << 20;
+const long SENDFILE_MIN_SIZE = 0x1 << 14;
+const std::size_t POOL_SLAB_SIZE = 64;
+const std::size_t CONNECTION_POOL_PREALLOC = 256;
+const std::size_t CONTEXT_POOL_PREALLOC = 512;
+const std::size_t FILE_JOB_POOL_PREALLOC = 64;
+const std::size_t CONNECTION_TABLE_PREALLOC = 0x1 << 16;
 const std::string DEFAULT_CONF_PATH = "./conf/sample_for_tester.conf";
+const std::string LISTEN_FDS_ENV = "WEBSERV_LISTEN_FDS";
 
 #define EMPTY_CGI_RESPONSE "HTTP/1.1 200 OK\r\n\
 Content-Type: text/html; charset=utf-8\r\n\
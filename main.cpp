@@ -1,4 +1,3 @@
-#include <sys/event.h>
 #include "FTServer.hpp"
 
 int main(int argc, char **argv) {
@@ -11,6 +10,7 @@ int main(int argc, char **argv) {
 		configFile = argv[1];
 	try {
 	    FTServer ftServer;
+        ftServer.setCommandLine(argc, argv);
         ftServer.initParseConfig(configFile);
 		ftServer.init();
 		ftServer.run();